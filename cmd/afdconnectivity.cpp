@@ -166,10 +166,10 @@ value_type AFDConnectivity::get (const std::string& path)
   size_t count = 0;
 
   Tractography::Streamline<value_type> tck;
+  SetDixel dixels;
   while (loader (tck)) {
     ++count;
 
-    SetDixel dixels;
     mapper (tck, dixels);
     double this_length = 0.0, this_volume = 0.0;
 
@@ -16,8 +16,7 @@
 
 #include "command.h"
 #include "image.h"
-#include <Eigen/Dense>
-#include <Eigen/Eigenvalues>
+#include "dwi/denoise.h"
 
 #define DEFAULT_SIZE 5
 
@@ -64,7 +63,15 @@ void usage ()
     +   Argument ("window").type_sequence_int ()
 
     + Option ("noise", "the output noise map.")
-    +   Argument ("level").type_image_out();
+    +   Argument ("level").type_image_out()
+
+    + Option ("aggregate", "denoise all voxels of each patch, rather than only its centre voxel, and only place "
+                           "patches on a grid with the specified spacing (either a scalar or a list of length 3). "
+                           "The output at each voxel is then the average of the estimates from all patches that "
+                           "include it, weighted according to the number of signal components retained in each "
+                           "patch. Larger spacings are faster; the spacing along each axis must not exceed "
+                           "half the window size plus one, so that every voxel is included in at least one patch.")
+    +   Argument ("spacing").type_sequence_int();
 
   COPYRIGHT = "Copyright (c) 2016 New York University, University of Antwerp, and the MRtrix3 contributors \n \n"
       "Permission is hereby granted, free of charge, to any non-commercial entity ('Recipient') obtaining a copy of this software and "
@@ -86,113 +93,7 @@ void usage ()
 }
 
 
-typedef float value_type;
-
-
-template <class ImageType>
-class DenoisingFunctor
-{
-  public:
-  DenoisingFunctor (ImageType& dwi, std::vector<int> extent, Image<bool>& mask, ImageType& noise)
-    : extent {{extent[0]/2, extent[1]/2, extent[2]/2}},
-      m (dwi.size(3)),
-      n (extent[0]*extent[1]*extent[2]),
-      r ((m<n) ? m : n),
-      X (m,n), 
-      pos {{0, 0, 0}}, 
-      mask (mask),
-      noise (noise)
-  { }
-  
-  void operator () (ImageType& dwi, ImageType& out)
-  {
-    if (mask.valid()) {
-      assign_pos_of (dwi).to (mask);
-      if (!mask.value())
-        return;
-    }
-
-    // Load data in local window
-    load_data (dwi);
-
-    // Compute Eigendecomposition:
-    Eigen::MatrixXf XtX (r,r);
-    if (m <= n)
-      XtX.template triangularView<Eigen::Lower>() = X * X.transpose();
-    else 
-      XtX.template triangularView<Eigen::Lower>() = X.transpose() * X;
-    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig (XtX);
-    // eigenvalues provide squared singular values:
-    Eigen::VectorXf s = eig.eigenvalues();
-   
-    // Marchenko-Pastur optimal threshold
-    const double lam_r = s[0] / n;
-    double clam = 0.0;
-    sigma2 = NaN;
-    ssize_t cutoff_p = 0;
-    for (ssize_t p = 0; p < r; ++p)
-    {
-      double lam = s[p] / n;
-      clam += lam;
-      double gam = double(m-r+p+1) / double(n);
-      double sigsq1 = clam / (p+1) / std::max (gam, 1.0);
-      double sigsq2 = (lam - lam_r) / 4 / std::sqrt(gam);
-      // sigsq2 > sigsq1 if signal else noise
-      if (sigsq2 < sigsq1) {
-        sigma2 = sigsq1;
-        cutoff_p = p+1;
-      } 
-    }
-
-    if (cutoff_p > 0) {
-      // recombine data using only eigenvectors above threshold:
-      s.head (cutoff_p).setZero();
-      s.tail (r-cutoff_p).setOnes();
-      if (m <= n) 
-        X.col (n/2) = eig.eigenvectors() * ( s.asDiagonal() * ( eig.eigenvectors().adjoint() * X.col(n/2) ));
-      else 
-        X.col (n/2) = X * ( eig.eigenvectors() * ( s.asDiagonal() * eig.eigenvectors().adjoint().col(n/2) ));
-    }
-
-    // Store output
-    assign_pos_of(dwi).to(out);
-    for (auto l = Loop (3) (out); l; ++l)
-      out.value() = X(out.index(3), n/2);
-
-    // store noise map if requested:
-    if (noise.valid()) {
-      assign_pos_of(dwi).to(noise);
-      noise.value() = value_type (std::sqrt(sigma2));
-    }
-  }
-  
-  
-  void load_data (ImageType& dwi)
-  {
-    pos[0] = dwi.index(0); pos[1] = dwi.index(1); pos[2] = dwi.index(2);
-    X.setZero();
-    ssize_t k = 0;
-    for (dwi.index(2) = pos[2]-extent[2]; dwi.index(2) <= pos[2]+extent[2]; ++dwi.index(2))
-      for (dwi.index(1) = pos[1]-extent[1]; dwi.index(1) <= pos[1]+extent[1]; ++dwi.index(1))
-        for (dwi.index(0) = pos[0]-extent[0]; dwi.index(0) <= pos[0]+extent[0]; ++dwi.index(0), ++k)
-          if (! is_out_of_bounds(dwi))
-            X.col(k) = dwi.row(3).template cast<float>();
-    // reset image position
-    dwi.index(0) = pos[0];
-    dwi.index(1) = pos[1];
-    dwi.index(2) = pos[2];
-  }
-  
-private:
-  const std::array<ssize_t, 3> extent;
-  const ssize_t m, n, r;
-  Eigen::MatrixXf X;
-  std::array<ssize_t, 3> pos;
-  double sigma2;
-  Image<bool> mask;
-  ImageType noise;
-  
-};
+using namespace MR::DWI::Denoise;
 
 
 
@@ -231,9 +132,28 @@ void run ()
     noise = Image<value_type>::create (opt[0][0], header);
   }
 
-  DenoisingFunctor< Image<value_type> > func (dwi_in, extent, mask, noise);
-  ThreadedLoop ("running MP-PCA denoising", dwi_in, 0, 3)
-    .run (func, dwi_in, dwi_out);
-}
+  std::vector<int> spacing;
+  opt = get_options("aggregate");
+  if (opt.size()) {
+    spacing = parse_ints(opt[0][0]);
+    if (spacing.size() == 1)
+      spacing = {spacing[0], spacing[0], spacing[0]};
+    if (spacing.size() != 3)
+      throw Exception ("-aggregate must be either a scalar or a list of length 3");
+    for (size_t axis = 0; axis < 3; ++axis)
+      if (spacing[axis] < 1 || spacing[axis] > extent[axis]/2 + 1)
+        throw Exception ("-aggregate spacing must lie between 1 and half the window size plus one");
+  }
+
+  Data data (dwi_in, {{ extent[0]/2, extent[1]/2, extent[2]/2 }});
+  std::unique_ptr<Aggregator> aggregator (spacing.size() ? new Aggregator (data) : nullptr);
 
+  DenoisingFunctor< Image<value_type> > func (data, extent, mask, dwi_out, noise, aggregator.get(),
+      spacing.size() ? spacing : std::vector<int> { 1, 1, 1 });
+  ThreadedLoop ("running MP-PCA denoising", dwi_in, { 1, 2 }, { 0 })
+    .run_outer (func);
+
+  if (aggregator)
+    aggregator->write (dwi_out, noise, mask);
+}
 
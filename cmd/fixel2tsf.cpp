@@ -96,8 +96,8 @@ void run ()
   Transform transform (input_fixel);
   Eigen::Vector3 voxel_pos;
 
+  SetVoxelDir dixels;
   while (reader (tck)) {
-    SetVoxelDir dixels;
     mapper (tck, dixels);
     std::vector<float> scalars (tck.size(), 0.0);
     for (size_t p = 0; p < tck.size(); ++p) {
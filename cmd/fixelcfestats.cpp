@@ -116,7 +116,9 @@ void usage ()
   + Option ("nonstationary", "do adjustment for non-stationarity")
 
   + Option ("nperms_nonstationary", "the number of permutations used when precomputing the empirical statistic image for nonstationary correction (Default: " + str(DEFAULT_PERMUTATIONS_NONSTATIONARITY) + ")")
-  + Argument ("num").type_integer (1);
+  + Argument ("num").type_integer (1)
+
+  + Stats::PermTest::Options;
 }
 
 
@@ -141,6 +143,17 @@ void write_fixel_output (const std::string& filename,
 
 
 
+// insert an entry for the fixel itself into its (sorted) row, unless already present
+void add_self_connection (std::vector<Stats::CFE::ConnectivityMatrix::Entry>& row, uint32_t fixel, value_type value)
+{
+  auto it = std::lower_bound (row.begin(), row.end(), fixel,
+      [] (const Stats::CFE::ConnectivityMatrix::Entry& e, uint32_t index) { return e.index < index; });
+  if (it == row.end() || it->index != fixel)
+    row.insert (it, { fixel, value });
+}
+
+
+
 void run() {
 
   auto opt = get_options ("negative");
@@ -223,8 +236,8 @@ void run() {
   CONSOLE ("number of fixels: " + str(num_fixels));
 
   // Compute fixel-fixel connectivity
-  std::vector<std::map<int32_t, Stats::CFE::connectivity> > connectivity_matrix (num_fixels);
-  std::vector<uint16_t> fixel_TDI (num_fixels, 0.0);
+  Stats::CFE::ConnectivityMatrix connectivity_matrix;
+  std::vector<uint32_t> fixel_TDI;
   std::string track_filename = argument[4];
   std::string output_prefix = argument[5];
   DWI::Tractography::Properties properties;
@@ -241,19 +254,24 @@ void run() {
     DWI::Tractography::Mapping::TrackMapperBase mapper (input_header);
     mapper.set_upsample_ratio (DWI::Tractography::Mapping::determine_upsample_ratio (input_header, properties, 0.333f));
     mapper.set_use_precise_mapping (true);
-    Stats::CFE::TrackProcessor tract_processor (fixel_index_image, directions, fixel_TDI, connectivity_matrix, angular_threshold);
-    Thread::run_queue (
-        loader,
-        Thread::batch (DWI::Tractography::Streamline<float>()),
-        mapper,
-        Thread::batch (SetVoxelDir()),
-        tract_processor);
+    Stats::CFE::ConnectivityBuilder builder (num_fixels);
+    {
+      Stats::CFE::TrackProcessor tract_processor (fixel_index_image, directions, builder, angular_threshold);
+      Thread::run_queue (
+          loader,
+          Thread::batch (DWI::Tractography::Streamline<float>()),
+          Thread::multi (mapper),
+          Thread::batch (SetVoxelDir()),
+          Thread::multi (tract_processor));
+    }
+    fixel_TDI = builder.TDI();
+    builder.finalise (connectivity_matrix);
   }
   track_file.close();
 
 
   // Normalise connectivity matrix and threshold, pre-compute fixel-fixel weights for smoothing.
-  std::vector<std::map<int32_t, value_type> > smoothing_weights (num_fixels);
+  Stats::CFE::ConnectivityMatrix smoothing_weights;
   bool do_smoothing = false;
   const value_type gaussian_const2 = 2.0 * smooth_std_dev * smooth_std_dev;
   value_type gaussian_const1 = 1.0;
@@ -263,43 +281,48 @@ void run() {
   }
   {
     ProgressBar progress ("normalising and thresholding fixel-fixel connectivity matrix", num_fixels);
-    for (unsigned int fixel = 0; fixel < num_fixels; ++fixel) {
-      auto it = connectivity_matrix[fixel].begin();
-      while (it != connectivity_matrix[fixel].end()) {
-        value_type connectivity = it->second.value / value_type (fixel_TDI[fixel]);
-        if (connectivity < connectivity_threshold)  {
-          connectivity_matrix[fixel].erase (it++);
-        } else {
-          if (do_smoothing) {
-            value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[it->first][0]) +
-                                             Math::pow2 (positions[fixel][1] - positions[it->first][1]) +
-                                             Math::pow2 (positions[fixel][2] - positions[it->first][2]));
-            value_type smoothing_weight = connectivity * gaussian_const1 * std::exp (-std::pow (distance, 2) / gaussian_const2);
-            if (smoothing_weight > connectivity_threshold)
-              smoothing_weights[fixel].insert (std::pair<int32_t, value_type> (it->first, smoothing_weight));
-          }
-          // Here we pre-exponentiate each connectivity value by C
-          it->second.value = std::pow (connectivity, cfe_c);
-          ++it;
+    Stats::CFE::ConnectivityMatrix thresholded_matrix;
+    std::vector<Stats::CFE::ConnectivityMatrix::Entry> row, smoothing_row;
+    for (uint32_t fixel = 0; fixel < num_fixels; ++fixel) {
+      row.clear();
+      smoothing_row.clear();
+      for (auto it = connectivity_matrix.begin (fixel); it != connectivity_matrix.end (fixel); ++it) {
+        value_type connectivity = it->value / value_type (fixel_TDI[fixel]);
+        if (connectivity < connectivity_threshold)
+          continue;
+        if (do_smoothing) {
+          value_type distance = std::sqrt (Math::pow2 (positions[fixel][0] - positions[it->index][0]) +
+                                           Math::pow2 (positions[fixel][1] - positions[it->index][1]) +
+                                           Math::pow2 (positions[fixel][2] - positions[it->index][2]));
+          value_type smoothing_weight = connectivity * gaussian_const1 * std::exp (-std::pow (distance, 2) / gaussian_const2);
+          if (smoothing_weight > connectivity_threshold)
+            smoothing_row.push_back ({ it->index, smoothing_weight });
         }
+        // Here we pre-exponentiate each connectivity value by C
+        row.push_back ({ it->index, std::pow (connectivity, cfe_c) });
       }
       // Make sure the fixel is fully connected to itself giving it a smoothing weight of 1
-      Stats::CFE::connectivity self_connectivity;
-      self_connectivity.value = 1.0;
-      connectivity_matrix[fixel].insert (std::pair<int32_t, Stats::CFE::connectivity> (fixel, self_connectivity));
-      smoothing_weights[fixel].insert (std::pair<int32_t, value_type> (fixel, gaussian_const1));
+      add_self_connection (row, fixel, 1.0);
+      add_self_connection (smoothing_row, fixel, gaussian_const1);
+      for (const auto& entry : row)
+        thresholded_matrix.push_back (entry.index, entry.value);
+      thresholded_matrix.end_row();
+      for (const auto& entry : smoothing_row)
+        smoothing_weights.push_back (entry.index, entry.value);
+      smoothing_weights.end_row();
       progress++;
     }
+    connectivity_matrix = std::move (thresholded_matrix);
   }
 
   // Normalise smoothing weights
   for (size_t fixel = 0; fixel < num_fixels; ++fixel) {
     value_type sum = 0.0;
-    for (auto it = smoothing_weights[fixel].begin(); it != smoothing_weights[fixel].end(); ++it)
-      sum += it->second;
+    for (auto it = smoothing_weights.begin (fixel); it != smoothing_weights.end (fixel); ++it)
+      sum += it->value;
     value_type norm_factor = 1.0 / sum;
-    for (auto it = smoothing_weights[fixel].begin(); it != smoothing_weights[fixel].end(); ++it)
-      it->second *= norm_factor;
+    for (auto it = smoothing_weights.begin (fixel); it != smoothing_weights.end (fixel); ++it)
+      it->value *= norm_factor;
   }
 
 
@@ -338,9 +361,8 @@ void run() {
       // Smooth the data
       for (size_t fixel = 0; fixel < num_fixels; ++fixel) {
         value_type value = 0.0;
-        std::map<int32_t, value_type>::const_iterator it = smoothing_weights[fixel].begin();
-        for (; it != smoothing_weights[fixel].end(); ++it)
-          value += temp_fixel_data[it->first] * it->second;
+        for (auto it = smoothing_weights.begin (fixel); it != smoothing_weights.end (fixel); ++it)
+          value += temp_fixel_data[it->index] * it->value;
         data (fixel, subject) = value;
       }
       progress++;
@@ -415,10 +437,11 @@ void run() {
       uncorrected_pvalues_neg.reset (new std::vector<value_type> (num_fixels, 0.0));
     }
 
-    Stats::PermTest::run_permutations (glm_ttest, cfe_integrator, num_perms, empirical_cfe_statistic,
-                                       cfe_output, cfe_output_neg,
-                                       perm_distribution, perm_distribution_neg,
-                                       uncorrected_pvalues, uncorrected_pvalues_neg);
+    if (!Stats::PermTest::run_permutations (glm_ttest, cfe_integrator, num_perms, empirical_cfe_statistic,
+                                            cfe_output, cfe_output_neg,
+                                            perm_distribution, perm_distribution_neg,
+                                            uncorrected_pvalues, uncorrected_pvalues_neg))
+      return;
 
     ProgressBar progress ("outputting final results");
     save_matrix (perm_distribution, output_prefix + "perm_dist.txt");
@@ -140,6 +140,11 @@ typedef float real_type;
 typedef cfloat complex_type;
 
 
+template <typename ValueType> inline ValueType to_value_type (const complex_type& value);
+template <> inline real_type to_value_type<real_type> (const complex_type& value) { return value.real(); }
+template <> inline complex_type to_value_type<complex_type> (const complex_type& value) { return value; }
+
+
 /**********************************************************************
   STACK FRAMEWORK:
  **********************************************************************/
@@ -148,38 +153,46 @@ typedef cfloat complex_type;
 class Evaluator;
 
 
-class Chunk : public std::vector<complex_type> {
+template <typename ValueType>
+class Chunk : public std::vector<ValueType> {
   public:
-    complex_type value;
+    ValueType value;
 };
 
 
+template <typename ValueType>
 class ThreadLocalStorageItem {
   public:
-    Chunk chunk;
-    copy_ptr<Image<complex_type>> image;
+    Chunk<ValueType> chunk;
+    copy_ptr<Image<ValueType>> image;
 };
 
-class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem> {
+template <typename ValueType>
+class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem<ValueType>> {
   public:
 
-      void load (Chunk& chunk, Image<complex_type>& image) {
+      void load (Chunk<ValueType>& chunk, Image<ValueType>& image) {
         for (size_t n = 0; n < image.ndim(); ++n)
           if (image.size(n) > 1)
             image.index(n) = iter->index(n);
 
-        size_t n = 0;
+        // images of size 1 along either axis are broadcast along it:
+        const bool along_x = axes[0] < image.ndim() && image.size (axes[0]) > 1;
+        const bool along_y = axes[1] < image.ndim() && image.size (axes[1]) > 1;
+
+        auto value = chunk.begin();
         for (size_t y = 0; y < size[1]; ++y) {
-          if (axes[1] < image.ndim()) if (image.size (axes[1]) > 1) image.index(axes[1]) = y;
-          for (size_t x = 0; x < size[0]; ++x) {
-            if (axes[0] < image.ndim()) if (image.size (axes[0]) > 1) image.index(axes[0]) = x;
-            chunk[n++] = image.value();
-          }
+          if (along_y) image.index(axes[1]) = y;
+          if (along_x)
+            image.get_row (axes[0], &*value);
+          else
+            std::fill (value, value + size[0], ValueType (image.value()));
+          value += size[0];
         }
       }
 
-    Chunk& next () {
-      ThreadLocalStorageItem& item ((*this)[current++]);
+    Chunk<ValueType>& next () {
+      ThreadLocalStorageItem<ValueType>& item ((*this)[current++]);
       if (item.image) load (item.chunk, *item.image);
       return item.chunk;
     }
@@ -196,16 +209,38 @@ class ThreadLocalStorage : public std::vector<ThreadLocalStorageItem> {
 
 
 
-class LoadedImage
+class LoadedImage : public Header
 {
   public:
-    LoadedImage (std::shared_ptr<Image<complex_type>>& i, const bool c) :
-        image (i),
-        image_is_complex (c) { }
-    std::shared_ptr<Image<complex_type>> image;
-    bool image_is_complex;
+    LoadedImage (Header&& header) :
+        Header (std::move (header)) { }
+
+    // the data are only accessed once it is known whether the whole
+    // expression can be evaluated using real values:
+    template <typename ValueType>
+      Image<ValueType>& get ();
+
+  private:
+    Image<real_type> real_image;
+    Image<complex_type> complex_image;
 };
 
+template <>
+  inline Image<real_type>& LoadedImage::get<real_type> ()
+  {
+    if (!real_image.valid())
+      real_image = get_image<real_type>();
+    return real_image;
+  }
+
+template <>
+  inline Image<complex_type>& LoadedImage::get<complex_type> ()
+  {
+    if (!complex_image.valid())
+      complex_image = get_image<complex_type>();
+    return complex_image;
+  }
+
 
 
 
@@ -225,15 +260,14 @@ class StackEntry {
       auto search = image_list.find (arg);
       if (search != image_list.end()) {
         DEBUG (std::string ("image \"") + arg + "\" already loaded - re-using exising image");
-        image = search->second.image;
-        image_is_complex = search->second.image_is_complex;
+        image = search->second;
+        image_is_complex = image->datatype().is_complex();
       }
       else {
         try {
-          auto header = Header::open (arg);
-          image_is_complex = header.datatype().is_complex();
-          image.reset (new Image<complex_type> (header.get_image<complex_type>()));
-          image_list.insert (std::make_pair (arg, LoadedImage (image, image_is_complex)));
+          image = std::make_shared<LoadedImage> (Header::open (arg));
+          image_is_complex = image->datatype().is_complex();
+          image_list.insert (std::make_pair (arg, image));
         }
         catch (Exception) {
           std::string a = lowercase (arg);
@@ -251,20 +285,23 @@ class StackEntry {
 
     const char* arg;
     std::shared_ptr<Evaluator> evaluator;
-    std::shared_ptr<Image<complex_type>> image;
+    std::shared_ptr<LoadedImage> image;
     copy_ptr<Math::RNG> rng;
     complex_type value;
     bool rng_gausssian;
     bool image_is_complex;
 
     bool is_complex () const;
+    //! true if no part of the expression involves complex values
+    bool is_real () const;
 
-    static std::map<std::string, LoadedImage> image_list;
+    static std::map<std::string, std::shared_ptr<LoadedImage>> image_list;
 
-    Chunk& evaluate (ThreadLocalStorage& storage) const;
+    template <typename ValueType>
+      Chunk<ValueType>& evaluate (ThreadLocalStorage<ValueType>& storage) const;
 };
 
-std::map<std::string, LoadedImage> StackEntry::image_list;
+std::map<std::string, std::shared_ptr<LoadedImage>> StackEntry::image_list;
 
 
 class Evaluator
@@ -281,17 +318,21 @@ class Evaluator
     bool ZtoR, RtoZ;
     std::vector<StackEntry> operands;
 
-    Chunk& evaluate (ThreadLocalStorage& storage) const {
-      Chunk& in1 (operands[0].evaluate (storage));
-      if (num_args() == 1) return evaluate (in1);
-      Chunk& in2 (operands[1].evaluate (storage));
-      if (num_args() == 2) return evaluate (in1, in2);
-      Chunk& in3 (operands[2].evaluate (storage));
-      return evaluate (in1, in2, in3);
-    }
-    virtual Chunk& evaluate (Chunk& in) const { throw Exception ("operation \"" + id + "\" not supported!"); return in; }
-    virtual Chunk& evaluate (Chunk& a, Chunk& b) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
-    virtual Chunk& evaluate (Chunk& a, Chunk& b, Chunk& c) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
+    template <typename ValueType>
+      Chunk<ValueType>& evaluate (ThreadLocalStorage<ValueType>& storage) const {
+        Chunk<ValueType>& in1 (operands[0].evaluate (storage));
+        if (num_args() == 1) return evaluate (in1);
+        Chunk<ValueType>& in2 (operands[1].evaluate (storage));
+        if (num_args() == 2) return evaluate (in1, in2);
+        Chunk<ValueType>& in3 (operands[2].evaluate (storage));
+        return evaluate (in1, in2, in3);
+      }
+    virtual Chunk<complex_type>& evaluate (Chunk<complex_type>& in) const { throw Exception ("operation \"" + id + "\" not supported!"); return in; }
+    virtual Chunk<complex_type>& evaluate (Chunk<complex_type>& a, Chunk<complex_type>& b) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
+    virtual Chunk<complex_type>& evaluate (Chunk<complex_type>& a, Chunk<complex_type>& b, Chunk<complex_type>& c) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
+    virtual Chunk<real_type>& evaluate (Chunk<real_type>& in) const { throw Exception ("operation \"" + id + "\" not supported!"); return in; }
+    virtual Chunk<real_type>& evaluate (Chunk<real_type>& a, Chunk<real_type>& b) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
+    virtual Chunk<real_type>& evaluate (Chunk<real_type>& a, Chunk<real_type>& b, Chunk<real_type>& c) const { throw Exception ("operation \"" + id + "\" not supported!"); return a; }
 
     virtual bool is_complex () const {
       for (size_t n = 0; n < operands.size(); ++n) 
@@ -313,26 +354,40 @@ inline bool StackEntry::is_complex () const {
 }
 
 
+inline bool StackEntry::is_real () const {
+  if (is_complex())
+    return false;
+  if (evaluator) {
+    for (const auto& operand : evaluator->operands)
+      if (!operand.is_real())
+        return false;
+  }
+  return true;
+}
 
-inline Chunk& StackEntry::evaluate (ThreadLocalStorage& storage) const
-{
-  if (evaluator) return evaluator->evaluate (storage);
-  if (rng) {
-    Chunk& chunk = storage.next();
-    if (rng_gausssian) {
-      std::normal_distribution<real_type> dis (0.0, 1.0);
-      for (size_t n = 0; n < chunk.size(); ++n)
-        chunk[n] = dis (*rng);
-    }
-    else {
-      std::uniform_real_distribution<real_type> dis (0.0, 1.0);
-      for (size_t n = 0; n < chunk.size(); ++n)
-        chunk[n] = dis (*rng);
+
+
+template <typename ValueType>
+  inline Chunk<ValueType>& StackEntry::evaluate (ThreadLocalStorage<ValueType>& storage) const
+  {
+    if (evaluator) return evaluator->evaluate (storage);
+    if (rng) {
+      Chunk<ValueType>& chunk = storage.next();
+      if (rng_gausssian) {
+        std::normal_distribution<real_type> dis (0.0, 1.0);
+        for (size_t n = 0; n < chunk.size(); ++n)
+          chunk[n] = dis (*rng);
+      }
+      else {
+        std::uniform_real_distribution<real_type> dis (0.0, 1.0);
+        for (size_t n = 0; n < chunk.size(); ++n)
+          chunk[n] = dis (*rng);
+      }
+      return chunk;
     }
-    return chunk;
+    return storage.next();
   }
-  return storage.next();
-}
+
 
 
 
@@ -379,6 +434,51 @@ std::string operation_string (const StackEntry& entry)
 
 
 
+// apply the operation over the whole chunk, dealing with scalar operands
+// (held as empty chunks) outside of the inner loop, so that the loops over
+// contiguous values remain branch-free and can be vectorised:
+template <typename ValueType, class Function>
+  inline Chunk<ValueType>& apply (Chunk<ValueType>& a, Function func)
+  {
+    for (auto& v : a)
+      v = func (v);
+    return a;
+  }
+
+template <typename ValueType, class Function>
+  inline Chunk<ValueType>& apply (Chunk<ValueType>& a, Chunk<ValueType>& b, Function func)
+  {
+    if (!a.size()) {
+      for (auto& v : b)
+        v = func (a.value, v);
+      return b;
+    }
+    if (!b.size()) {
+      for (auto& v : a)
+        v = func (v, b.value);
+      return a;
+    }
+    for (size_t n = 0; n < a.size(); ++n)
+      a[n] = func (a[n], b[n]);
+    return a;
+  }
+
+template <typename ValueType, class Function>
+  inline Chunk<ValueType>& apply (Chunk<ValueType>& a, Chunk<ValueType>& b, Chunk<ValueType>& c, Function func)
+  {
+    Chunk<ValueType>& out (a.size() ? a : (b.size() ? b : c));
+    const ValueType* pa = a.size() ? a.data() : &a.value;
+    const ValueType* pb = b.size() ? b.data() : &b.value;
+    const ValueType* pc = c.size() ? c.data() : &c.value;
+    const size_t sa = a.size() ? 1 : 0, sb = b.size() ? 1 : 0, sc = c.size() ? 1 : 0;
+    for (size_t n = 0; n < out.size(); ++n)
+      out[n] = func (pa[n*sa], pb[n*sb], pc[n*sc]);
+    return out;
+  }
+
+
+
+
 template <class Operation>
 class UnaryEvaluator : public Evaluator 
 {
@@ -387,19 +487,20 @@ class UnaryEvaluator : public Evaluator
       Evaluator (name, operation.format, operation.ZtoR, operation.RtoZ), 
       op (operation) { 
         operands.push_back (operand);
+        complex_operands = operand.is_complex();
       }
 
     Operation op;
+    bool complex_operands;
 
-    virtual Chunk& evaluate (Chunk& in) const { 
-      if (operands[0].is_complex()) 
-        for (size_t n = 0; n < in.size(); ++n)
-          in[n] = op.Z (in[n]);
-      else 
-        for (size_t n = 0; n < in.size(); ++n)
-          in[n] = op.R (in[n].real());
+    virtual Chunk<complex_type>& evaluate (Chunk<complex_type>& in) const { 
+      if (complex_operands) 
+        return apply (in, [this] (complex_type v) { return op.Z (v); });
+      return apply (in, [this] (complex_type v) { return op.R (v.real()); });
+    }
 
-      return in; 
+    virtual Chunk<real_type>& evaluate (Chunk<real_type>& in) const { 
+      return apply (in, [this] (real_type v) { return op.R (v).real(); });
     }
 };
 
@@ -417,25 +518,20 @@ class BinaryEvaluator : public Evaluator
       op (operation) { 
         operands.push_back (operand1);
         operands.push_back (operand2);
+        complex_operands = operand1.is_complex() || operand2.is_complex();
       }
 
     Operation op;
+    bool complex_operands;
 
-    virtual Chunk& evaluate (Chunk& a, Chunk& b) const {
-      Chunk& out (a.size() ? a : b);
-      if (operands[0].is_complex() || operands[1].is_complex()) {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.Z (
-              a.size() ? a[n] : a.value, 
-              b.size() ? b[n] : b.value );
-      }
-      else {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.R (
-              a.size() ? a[n].real() : a.value.real(), 
-              b.size() ? b[n].real() : b.value.real() );
-      }
-      return out;
+    virtual Chunk<complex_type>& evaluate (Chunk<complex_type>& a, Chunk<complex_type>& b) const {
+      if (complex_operands)
+        return apply (a, b, [this] (complex_type x, complex_type y) { return op.Z (x, y); });
+      return apply (a, b, [this] (complex_type x, complex_type y) { return op.R (x.real(), y.real()); });
+    }
+
+    virtual Chunk<real_type>& evaluate (Chunk<real_type>& a, Chunk<real_type>& b) const {
+      return apply (a, b, [this] (real_type x, real_type y) { return op.R (x, y).real(); });
     }
 
 };
@@ -452,27 +548,20 @@ class TernaryEvaluator : public Evaluator
         operands.push_back (operand1);
         operands.push_back (operand2);
         operands.push_back (operand3);
+        complex_operands = operand1.is_complex() || operand2.is_complex() || operand3.is_complex();
       }
 
     Operation op;
+    bool complex_operands;
 
-    virtual Chunk& evaluate (Chunk& a, Chunk& b, Chunk& c) const {
-      Chunk& out (a.size() ? a : (b.size() ? b : c));
-      if (operands[0].is_complex() || operands[1].is_complex() || operands[2].is_complex()) {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.Z (
-              a.size() ? a[n] : a.value,
-              b.size() ? b[n] : b.value,
-              c.size() ? c[n] : c.value );
-      }
-      else {
-        for (size_t n = 0; n < out.size(); ++n) 
-          out[n] = op.R (
-              a.size() ? a[n].real() : a.value.real(), 
-              b.size() ? b[n].real() : b.value.real(), 
-              c.size() ? c[n].real() : c.value.real() );
-      }
-      return out;
+    virtual Chunk<complex_type>& evaluate (Chunk<complex_type>& a, Chunk<complex_type>& b, Chunk<complex_type>& c) const {
+      if (complex_operands)
+        return apply (a, b, c, [this] (complex_type x, complex_type y, complex_type z) { return op.Z (x, y, z); });
+      return apply (a, b, c, [this] (complex_type x, complex_type y, complex_type z) { return op.R (x.real(), y.real(), z.real()); });
+    }
+
+    virtual Chunk<real_type>& evaluate (Chunk<real_type>& a, Chunk<real_type>& b, Chunk<real_type>& c) const {
+      return apply (a, b, c, [this] (real_type x, real_type y, real_type z) { return op.R (x, y, z).real(); });
     }
 
 };
@@ -599,16 +688,16 @@ void get_header (const StackEntry& entry, Header& header)
 
 
 
+template <typename ValueType>
 class ThreadFunctor {
   public:
     ThreadFunctor (
         const std::vector<size_t>& inner_axes,
         const StackEntry& top_of_stack, 
-        Image<complex_type>& output_image) :
+        Image<ValueType>& output_image) :
       top_entry (top_of_stack),
-      image (output_image),
-      loop (Loop (inner_axes)) {
-        storage.axes = loop.axes;
+      image (output_image) {
+        storage.axes = inner_axes;
         storage.size.push_back (image.size(storage.axes[0]));
         storage.size.push_back (image.size(storage.axes[1]));
         chunk_size = image.size (storage.axes[0]) * image.size (storage.axes[1]);
@@ -622,16 +711,16 @@ class ThreadFunctor {
         return;
       }
 
-      storage.push_back (ThreadLocalStorageItem());
+      storage.push_back (ThreadLocalStorageItem<ValueType>());
       if (entry.image) {
-        storage.back().image.reset (new Image<complex_type> (*entry.image));
+        storage.back().image.reset (new Image<ValueType> (entry.image->get<ValueType>()));
         storage.back().chunk.resize (chunk_size);
         return;
       }
       else if (entry.rng) {
         storage.back().chunk.resize (chunk_size);
       }
-      else storage.back().chunk.value = entry.value;
+      else storage.back().chunk.value = to_value_type<ValueType> (entry.value);
     }
 
 
@@ -639,24 +728,39 @@ class ThreadFunctor {
       storage.reset (iter);
       assign_pos_of (iter).to (image);
 
-      Chunk& chunk = top_entry.evaluate (storage);
+      Chunk<ValueType>& chunk = top_entry.evaluate (storage);
 
       auto value = chunk.cbegin();
-      for (auto l = loop (image); l; ++l) 
-        image.value() = *(value++);
+      for (size_t y = 0; y < storage.size[1]; ++y) {
+        image.index (storage.axes[1]) = y;
+        image.set_row (storage.axes[0], &*value);
+        value += storage.size[0];
+      }
     }
 
 
 
     const StackEntry& top_entry;
-    Image<complex_type> image;
-    decltype (Loop (std::vector<size_t>())) loop;
-    ThreadLocalStorage storage;
+    Image<ValueType> image;
+    ThreadLocalStorage<ValueType> storage;
     size_t chunk_size;
 };
 
 
 
+template <typename ValueType>
+void evaluate_to (const std::string& output_name, const Header& header, const StackEntry& top_of_stack)
+{
+  auto output = Header::create (output_name, header).get_image<ValueType>();
+
+  auto loop = ThreadedLoop ("computing: " + operation_string (top_of_stack), output, 0, output.ndim(), 2);
+
+  ThreadFunctor<ValueType> functor (loop.inner_axes, top_of_stack, output);
+  loop.run_outer (functor);
+}
+
+
+
 
 
 void run_operations (const std::vector<StackEntry>& stack) 
@@ -692,12 +796,12 @@ void run_operations (const std::vector<StackEntry>& stack)
   }
   else header.datatype() = DataType::from_command_line (DataType::Float32);
 
-  auto output = Header::create (stack[1].arg, header).get_image<complex_type>();
-
-  auto loop = ThreadedLoop ("computing: " + operation_string(stack[0]), output, 0, output.ndim(), 2);
-
-  ThreadFunctor functor (loop.inner_axes, stack[0], output);
-  loop.run_outer (functor);
+  // expressions that never involve complex values are evaluated
+  // entirely using real_type, avoiding any conversion to complex:
+  if (stack[0].is_real())
+    evaluate_to<real_type> (stack[1].arg, header, stack[0]);
+  else
+    evaluate_to<complex_type> (stack[1].arg, header, stack[0]);
 }
 
 
@@ -96,8 +96,9 @@ void usage ()
   + Option ("nonstationary", "perform non-stationarity correction (currently only implemented with tfce)")
 
   + Option ("nperms_nonstationary", "the number of permutations used when precomputing the empirical statistic image for nonstationary correction (Default: " + str(DEFAULT_PERMUTATIONS_NONSTATIONARITY) + ")")
-  +   Argument ("num").type_integer (1);
+  +   Argument ("num").type_integer (1)
 
+  + Stats::PermTest::Options;
 }
 
 
@@ -247,6 +248,7 @@ void run() {
   auto opt = get_options ("notest");
   if (!opt.size()) {
     Math::Stats::GLMTTest glm (data, design, contrast);
+    bool complete;
 
     // Suprathreshold clustering
     if (std::isfinite (cluster_forming_threshold)) {
@@ -259,10 +261,10 @@ void run() {
 
 
 
-      Stats::PermTest::run_permutations (glm, cluster_size_test, num_perms, empirical_tfce_statistic,
-                                         default_cluster_output, default_cluster_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+      complete = Stats::PermTest::run_permutations (glm, cluster_size_test, num_perms, empirical_tfce_statistic,
+                                                    default_cluster_output, default_cluster_output_neg,
+                                                    perm_distribution, perm_distribution_neg,
+                                                    uncorrected_pvalue, uncorrected_pvalue_neg);
     // TFCE
     } else {
       Stats::TFCE::Enhancer tfce_integrator (connector, tfce_dh, tfce_E, tfce_H);
@@ -274,31 +276,38 @@ void run() {
       Stats::PermTest::precompute_default_permutation (glm, tfce_integrator, empirical_tfce_statistic,
                                                        default_cluster_output, default_cluster_output_neg, tvalue_output);
 
-      Stats::PermTest::run_permutations (glm, tfce_integrator, num_perms, empirical_tfce_statistic,
-                                         default_cluster_output, default_cluster_output_neg,
-                                         perm_distribution, perm_distribution_neg,
-                                         uncorrected_pvalue, uncorrected_pvalue_neg);
+      complete = Stats::PermTest::run_permutations (glm, tfce_integrator, num_perms, empirical_tfce_statistic,
+                                                    default_cluster_output, default_cluster_output_neg,
+                                                    perm_distribution, perm_distribution_neg,
+                                                    uncorrected_pvalue, uncorrected_pvalue_neg);
     }
 
-    save_matrix (perm_distribution, prefix + "perm_dist.txt");
-
-    std::vector<value_type> pvalue_output (num_vox, 0.0);
-    Math::Stats::statistic2pvalue (perm_distribution, default_cluster_output, pvalue_output);
     {
       ProgressBar progress ("generating output");
       write_output (tvalue_output, mask_indices, tvalue_image);
       write_output (default_cluster_output, mask_indices, cluster_image);
-      write_output (pvalue_output, mask_indices, fwe_pvalue_image);
-      write_output (uncorrected_pvalue, mask_indices, uncorrected_pvalue_image);
+      if (compute_negative_contrast)
+        write_output (*default_cluster_output_neg, mask_indices, cluster_image_neg);
     }
-    if (compute_negative_contrast) {
-      ProgressBar progress ("generating negative contrast output");
-      save_matrix (*perm_distribution_neg, prefix + "perm_dist_neg.txt");
-      std::vector<value_type> pvalue_output_neg (num_vox, 0.0);
-      Math::Stats::statistic2pvalue (*perm_distribution_neg, *default_cluster_output_neg, pvalue_output_neg);
-      write_output (*default_cluster_output_neg, mask_indices, cluster_image_neg);
-      write_output (pvalue_output_neg, mask_indices, fwe_pvalue_image_neg);
-      write_output (*uncorrected_pvalue_neg, mask_indices, uncorrected_pvalue_image_neg);
+    // p-values are only available once all permutations are complete
+    if (complete) {
+      save_matrix (perm_distribution, prefix + "perm_dist.txt");
+
+      std::vector<value_type> pvalue_output (num_vox, 0.0);
+      Math::Stats::statistic2pvalue (perm_distribution, default_cluster_output, pvalue_output);
+      {
+        ProgressBar progress ("generating p-value output");
+        write_output (pvalue_output, mask_indices, fwe_pvalue_image);
+        write_output (uncorrected_pvalue, mask_indices, uncorrected_pvalue_image);
+      }
+      if (compute_negative_contrast) {
+        ProgressBar progress ("generating negative contrast output");
+        save_matrix (*perm_distribution_neg, prefix + "perm_dist_neg.txt");
+        std::vector<value_type> pvalue_output_neg (num_vox, 0.0);
+        Math::Stats::statistic2pvalue (*perm_distribution_neg, *default_cluster_output_neg, pvalue_output_neg);
+        write_output (pvalue_output_neg, mask_indices, fwe_pvalue_image_neg);
+        write_output (*uncorrected_pvalue_neg, mask_indices, uncorrected_pvalue_image_neg);
+      }
     }
   }
 
@@ -327,6 +327,51 @@ class ImageKernel : public ImageKernelBase {
 
 
 
+// The median requires all values for each voxel to be held in memory at
+// once, so rather than accumulating into a full image of per-voxel lists,
+// all input images are opened together and processed one row at a time:
+// the values for the whole row are gathered from each image in turn into a
+// contiguous buffer, so that memory usage scales with the length of a row
+// times the number of inputs, not with the size of the images (provided the
+// inputs are uncompressed, so that they can be memory-mapped).
+class MedianRowKernel {
+  public:
+    MedianRowKernel (const std::vector<Image<value_type>>& inputs, Image<value_type>& output, const std::vector<size_t>& outer_axes, size_t axis) :
+      inputs (inputs),
+      output (output),
+      outer_axes (outer_axes),
+      axis (axis),
+      buffer (inputs.size() * output.size (axis)),
+      values (inputs.size()) { }
+
+    void operator() (const Iterator& pos) {
+      const size_t num_inputs = inputs.size();
+      const ssize_t length = output.size (axis);
+      for (size_t i = 0; i != num_inputs; ++i) {
+        auto& in (inputs[i]);
+        assign_pos_of (pos, outer_axes).to (in);
+        for (in.index(axis) = 0; in.index(axis) != length; ++in.index(axis))
+          buffer[in.index(axis)*num_inputs + i] = in.value();
+      }
+      assign_pos_of (pos, outer_axes).to (output);
+      for (output.index(axis) = 0; output.index(axis) != length; ++output.index(axis)) {
+        const auto start = buffer.begin() + output.index(axis)*num_inputs;
+        values.assign (start, start + num_inputs);
+        output.value() = Math::median (values);
+      }
+    }
+
+  protected:
+    std::vector<Image<value_type>> inputs;
+    Image<value_type> output;
+    const std::vector<size_t> outer_axes;
+    const size_t axis;
+    std::vector<value_type> buffer, values;
+};
+
+
+
+
 void run ()
 {
   const size_t num_inputs = argument.size() - 2;
@@ -408,11 +453,21 @@ void run ()
       }
     }
 
+    if (op == 1) {
+      std::vector<Image<value_type>> inputs;
+      for (auto& header_in : headers_in)
+        inputs.push_back (header_in.get_image<value_type>());
+      auto out = Header::create (output_path, header).get_image<value_type>();
+      auto loop = ThreadedLoop (std::string("computing ") + operations[op] + " across "
+          + str(headers_in.size()) + " images", out, 0, out.ndim(), 1);
+      loop.run_outer (MedianRowKernel (inputs, out, loop.outer_loop.axes, loop.inner_axes[0]));
+      return;
+    }
+
     // Instantiate a kernel depending on the operation requested
     std::unique_ptr<ImageKernelBase> kernel;
     switch (op) {
       case 0:  kernel.reset (new ImageKernel<Mean>    (header)); break;
-      case 1:  kernel.reset (new ImageKernel<Median>  (header)); break;
       case 2:  kernel.reset (new ImageKernel<Sum>     (header)); break;
       case 3:  kernel.reset (new ImageKernel<Product> (header)); break;
       case 4:  kernel.reset (new ImageKernel<RMS>     (header)); break;
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "stats/permtest.h"
+
+
+using namespace MR;
+using namespace App;
+
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  DESCRIPTION
+  + "merge the checkpoint files produced by statistical inference commands "
+    "(e.g. fixelcfestats, mrclusterstats) run on disjoint subsets of the "
+    "permutations using the -shard option."
+
+  + "The merged file can then be supplied to the original command via the "
+    "-checkpoint option (with the same inputs and options, but without the "
+    "-shard option) to generate the final statistical inference outputs.";
+
+  ARGUMENTS
+  + Argument ("input", "the checkpoint files to be merged").type_file_in().allow_multiple()
+  + Argument ("output", "the merged checkpoint file").type_file_out();
+}
+
+
+
+void run ()
+{
+  Stats::PermTest::State state (argument[0]);
+  for (size_t n = 1; n < argument.size()-1; ++n) {
+    try {
+      state.merge (Stats::PermTest::State (argument[n]));
+    }
+    catch (Exception& E) {
+      throw Exception (E, "error merging checkpoint file \"" + str(argument[n]) + "\"");
+    }
+  }
+
+  if (state.complete()) {
+    INFO ("all " + str(state.num_permutations()) + " permutations completed");
+  } else {
+    WARN ("only " + str(state.num_completed()) + " of " + str(state.num_permutations()) + " permutations have been completed");
+  }
+
+  check_overwrite (argument[argument.size()-1]);
+  state.save (argument[argument.size()-1]);
+}
+
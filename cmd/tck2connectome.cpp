@@ -24,6 +24,7 @@
 
 #include "dwi/tractography/file.h"
 #include "dwi/tractography/properties.h"
+#include "dwi/tractography/sharded_reader.h"
 #include "dwi/tractography/weights.h"
 #include "dwi/tractography/mapping/loader.h"
 #include "dwi/tractography/connectome/connectome.h"
@@ -125,28 +126,30 @@ void run ()
 
   // Prepare for reading the track data
   Tractography::Properties properties;
-  Tractography::Reader<float> reader (argument[0], properties);
+  Tractography::ShardedReader<float> reader (argument[0], properties);
 
   // Initialise classes in preparation for multi-threading
-  Mapping::TrackLoader loader (reader, properties["count"].empty() ? 0 : to<size_t>(properties["count"]), "Constructing connectome");
   Tractography::Connectome::Mapper mapper (*tck2nodes, metric);
   Tractography::Connectome::Matrix connectome (max_node_index, statistic, vector_output);
 
   // Multi-threaded connectome construction
-  if (tck2nodes->provides_pair()) {
-    Thread::run_queue (
-        loader,
-        Thread::batch (Tractography::Streamline<float>()),
-        Thread::multi (mapper),
-        Thread::batch (Mapped_track_nodepair()),
-        connectome);
-  } else {
-    Thread::run_queue (
-        loader,
-        Thread::batch (Tractography::Streamline<float>()),
-        Thread::multi (mapper),
-        Thread::batch (Mapped_track_nodelist()),
-        connectome);
+  {
+    Mapping::ShardedTrackLoader loader (reader, properties["count"].empty() ? 0 : to<size_t>(properties["count"]), "Constructing connectome");
+    if (tck2nodes->provides_pair()) {
+      Thread::run_queue (
+          Thread::multi (loader),
+          Thread::batch (Tractography::Streamline<float>()),
+          Thread::multi (mapper),
+          Thread::batch (Mapped_track_nodepair()),
+          connectome);
+    } else {
+      Thread::run_queue (
+          Thread::multi (loader),
+          Thread::batch (Tractography::Streamline<float>()),
+          Thread::multi (mapper),
+          Thread::batch (Mapped_track_nodelist()),
+          connectome);
+    }
   }
 
   connectome.finalize();
@@ -162,9 +162,21 @@ void run ()
 
   // Parameters that the output thread needs to be aware of
   const size_t number = get_option_value ("number", size_t(0));
-  const size_t skip   = get_option_value ("skip",   size_t(0));
+  size_t skip         = get_option_value ("skip",   size_t(0));
 
   Loader loader (input_file_list);
+
+  // If no streamlines can be rejected by the worker, those to be skipped can
+  //   be bypassed by the loader instead; this avoids reading them at all if
+  //   the input file has a streamline index. Streamline weights are checked
+  //   against the (default) weight thresholds, so could also cause rejection.
+  const bool selective = inverse || properties.include.size() || properties.exclude.size() || properties.mask.size()
+                         || properties.find ("min_dist")   != properties.end() || properties.find ("max_dist")   != properties.end()
+                         || properties.find ("min_weight") != properties.end() || properties.find ("max_weight") != properties.end()
+                         || get_options ("tck_weights_in").size();
+  if (skip && num_inputs == 1 && !selective)
+    skip -= loader.skip (skip);
+
   Worker worker (properties, inverse, ends_only);
   // This needs to be run AFTER creation of the Worker class
   // (worker needs to be able to set max & min number of points based on step size in input file,
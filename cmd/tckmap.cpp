@@ -26,6 +26,7 @@
 
 #include "dwi/gradient.h"
 #include "dwi/tractography/file.h"
+#include "dwi/tractography/sharded_reader.h"
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/weights.h"
 
@@ -145,7 +146,15 @@ const OptionGroup MappingOption = OptionGroup ("Options for the streamline-to-vo
       "(these lengths are then taken into account during TWI calculation)")
 
   + Option ("ends_only",
-      "only map the streamline endpoints to the image");
+      "only map the streamline endpoints to the image")
+
+  + Option ("local_buffers",
+      "accumulate the streamlines mapped by each thread into a separate buffer, and combine these "
+      "buffers once all streamlines have been mapped, rather than writing all mapped streamlines "
+      "to the output image from a single thread. This can be faster when many threads are available, "
+      "at the expense of additional memory. Each buffer covers the full output image if the total "
+      "size of the buffers fits within the TckmapLocalBufferMemory config file entry, and only "
+      "the voxels traversed otherwise.");
 
 
 
@@ -245,6 +254,20 @@ MapWriterBase* make_writer (Header& H, const std::string& name, const vox_stat_t
 
 
 
+template <class MapperType, class SetType>
+void map_tracks (ShardedTrackLoader& loader, MapperType& mapper, MapWriterBase& writer, LocalMapBuffers* buffers)
+{
+  if (buffers) {
+    MapAccumulator<MapperType, SetType> accumulator (mapper, *buffers);
+    Thread::run_queue (Thread::multi (loader), Thread::batch (Tractography::Streamline<float>()), Thread::multi (accumulator));
+    writer.reduce (*buffers);
+  } else {
+    Thread::run_queue (Thread::multi (loader), Thread::batch (Tractography::Streamline<float>()), Thread::multi (mapper), Thread::batch (SetType()), writer);
+  }
+}
+
+
+
 DataType determine_datatype (const DataType current_dt, const contrast_t contrast, const DataType default_dt, const bool precise)
 {
   if (current_dt == DataType::Undefined) {
@@ -262,7 +285,7 @@ DataType determine_datatype (const DataType current_dt, const contrast_t contras
 void run () {
 
   Tractography::Properties properties;
-  Tractography::Reader<float> file (argument[0], properties);
+  Tractography::ShardedReader<float> file (argument[0], properties);
 
   const size_t num_tracks = properties["count"].empty() ? 0 : to<size_t> (properties["count"]);
 
@@ -541,8 +564,6 @@ void run () {
 
 
   // Start initialising members for multi-threaded calculation
-  TrackLoader loader (file, num_tracks);
-
   std::unique_ptr<TrackMapperTWI> mapper ((stat_tck == GAUSSIAN) ? (new Gaussian::TrackMapper (header, contrast)) : (new TrackMapperTWI (header, contrast, stat_tck)));
   mapper->set_upsample_ratio      (upsample_ratio);
   mapper->set_map_zero            (map_zero);
@@ -585,28 +606,36 @@ void run () {
     case TOD:       writer.reset (new MapWriter<float>  (header, argument[1], stat_vox, TOD));       break;
   }
 
+  std::unique_ptr<LocalMapBuffers> buffers;
+  if (get_options ("local_buffers").size())
+    buffers.reset (new LocalMapBuffers (header, stat_vox, writer_type));
+
   // Finally get to do some number crunching!
   // Complete branch here for Gaussian track-wise statistic; it's a nightmare to manage, so am
   //   keeping the code as separate as possible
-  if (stat_tck == GAUSSIAN) {
-    Gaussian::TrackMapper* const mapper_ptr = dynamic_cast<Gaussian::TrackMapper*>(mapper.get());
-    mapper_ptr->set_gaussian_FWHM (gaussian_fwhm_tck);
-    switch (writer_type) {
-      case UNDEFINED: throw Exception ("Invalid TWI writer image dimensionality");
-      case GREYSCALE: Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper_ptr), Thread::batch (Gaussian::SetVoxel()),    *writer); break;
-      case DEC:       Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper_ptr), Thread::batch (Gaussian::SetVoxelDEC()), *writer); break;
-      case DIXEL:     Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper_ptr), Thread::batch (Gaussian::SetDixel()),    *writer); break;
-      case TOD:       Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper_ptr), Thread::batch (Gaussian::SetVoxelTOD()), *writer); break;
-    }
-  } else {
-    switch (writer_type) {
-      case UNDEFINED: throw Exception ("Invalid TWI writer image dimensionality");
-      case GREYSCALE: Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper), Thread::batch (SetVoxel()),    *writer); break;
-      case DEC:       Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper), Thread::batch (SetVoxelDEC()), *writer); break;
-      case DIXEL:     Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper), Thread::batch (SetDixel()),    *writer); break;
-      case TOD:       Thread::run_queue (loader, Thread::batch (Tractography::Streamline<float>()), Thread::multi (*mapper), Thread::batch (SetVoxelTOD()), *writer); break;
+  {
+    ShardedTrackLoader loader (file, num_tracks);
+    if (stat_tck == GAUSSIAN) {
+      Gaussian::TrackMapper* const mapper_ptr = dynamic_cast<Gaussian::TrackMapper*>(mapper.get());
+      mapper_ptr->set_gaussian_FWHM (gaussian_fwhm_tck);
+      switch (writer_type) {
+        case UNDEFINED: throw Exception ("Invalid TWI writer image dimensionality");
+        case GREYSCALE: map_tracks<Gaussian::TrackMapper, Gaussian::SetVoxel>    (loader, *mapper_ptr, *writer, buffers.get()); break;
+        case DEC:       map_tracks<Gaussian::TrackMapper, Gaussian::SetVoxelDEC> (loader, *mapper_ptr, *writer, buffers.get()); break;
+        case DIXEL:     map_tracks<Gaussian::TrackMapper, Gaussian::SetDixel>    (loader, *mapper_ptr, *writer, buffers.get()); break;
+        case TOD:       map_tracks<Gaussian::TrackMapper, Gaussian::SetVoxelTOD> (loader, *mapper_ptr, *writer, buffers.get()); break;
+      }
+    } else {
+      switch (writer_type) {
+        case UNDEFINED: throw Exception ("Invalid TWI writer image dimensionality");
+        case GREYSCALE: map_tracks<TrackMapperTWI, SetVoxel>    (loader, *mapper, *writer, buffers.get()); break;
+        case DEC:       map_tracks<TrackMapperTWI, SetVoxelDEC> (loader, *mapper, *writer, buffers.get()); break;
+        case DIXEL:     map_tracks<TrackMapperTWI, SetDixel>    (loader, *mapper, *writer, buffers.get()); break;
+        case TOD:       map_tracks<TrackMapperTWI, SetVoxelTOD> (loader, *mapper, *writer, buffers.get()); break;
+      }
     }
   }
+  buffers.reset();
 
   writer->finalise();
 }
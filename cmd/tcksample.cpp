@@ -179,7 +179,6 @@ class Sampler {
 
       } else {
 
-        DWI::Tractography::Mapping::SetVoxel voxels;
         (*mapper) (tck, voxels);
 
         if (statistic == MEAN) {
@@ -263,6 +262,7 @@ class Sampler {
     MR::copy_ptr<Image<value_type>> image;
     MR::copy_ptr<TDI> tdi;
     const stat_tck statistic;
+    DWI::Tractography::Mapping::SetVoxel voxels;
 
     value_type get_tdi_multiplier (const DWI::Tractography::Mapping::Voxel& v)
     {
@@ -69,6 +69,15 @@ void usage ()
                                 "numbers of remaining streamlines; provide as comma-separated list of integers")
     + Argument ("counts").type_sequence_int()
 
+  + Option ("batch", "remove candidate streamlines in batches of up to this size, where the streamlines within each "
+                     "batch do not traverse any common fixel; the cost function changes for all candidates in a batch "
+                     "are then evaluated in parallel, and between iterations only the gradients of those streamlines "
+                     "traversing fixels affected by the removals are re-calculated. "
+                     "This yields a slightly different result to the default behaviour of evaluating and removing one "
+                     "candidate at a time (equivalent to a batch size of 1), "
+                     "and requires additional memory for an inverted index from fixels to streamlines.")
+    + Argument ("size").type_integer (1)
+
   + SIFTModelProcMaskOption
   + SIFTModelOption
   + SIFTOutputOption
@@ -125,6 +134,9 @@ void run ()
     opt = get_options ("csv");
     if (opt.size())
       sifter.set_csv_path (opt[0][0]);
+    opt = get_options ("batch");
+    if (opt.size())
+      sifter.set_batch_size (int(opt[0][0]));
     opt = get_options ("output_at_counts");
     if (opt.size()) {
       std::vector<int> counts = parse_ints (opt[0][0]);
@@ -84,6 +84,7 @@ namespace MR
                    const value_type value_when_out_of_bounds = Interp::Base<ImageType>::default_out_of_bounds_value()) :
             interp (original, value_when_out_of_bounds),
             x { 0, 0, 0 },
+            last { -1, -1, -1 },
             dim { reference.size(0), reference.size(1), reference.size(2) },
             vox { reference.spacing(0), reference.spacing(1), reference.spacing(2) },
             transform_ (reference.transform()),
@@ -161,7 +162,12 @@ namespace MR
             result *= norm;
             return result;
           }
-          interp.voxel (direct_transform * Vector3 (x[0], x[1], x[2]));
+          // the interpolation weights depend only on the spatial position, so need
+          // not be re-computed when iterating over the remaining axes:
+          if (x[0] != last[0] || x[1] != last[1] || x[2] != last[2]) {
+            interp.voxel (direct_transform * Vector3 (x[0], x[1], x[2]));
+            last[0] = x[0]; last[1] = x[1]; last[2] = x[2];
+          }
           return interp.value();
         }
 
@@ -174,7 +180,7 @@ namespace MR
 
       private:
         Interpolator<ImageType> interp;
-        ssize_t x[3];
+        ssize_t x[3], last[3];
         const ssize_t dim[3];
         const default_type vox[3];
         bool oversampling;
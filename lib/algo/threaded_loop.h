@@ -16,11 +16,17 @@
 #ifndef __algo_threaded_loop_h__
 #define __algo_threaded_loop_h__
 
+#include <atomic>
+#include <mutex>
+
 #include "debug.h"
 #include "algo/loop.h"
 #include "algo/iterator.h"
 #include "thread.h"
 
+// the fraction of its remaining positions claimed by each thread at a time:
+#define THREADED_LOOP_CHUNK_DIVISOR 8
+
 namespace MR
 {
 
@@ -58,15 +64,19 @@ namespace MR
    * been set to the z and volume axes (i.e. axes 2 & 3). Each thread will do
    * the following:
    *
-   * 1. lock the loop mutex, obtain a new set of z & volume coordinates, then
-   *    release the mutex so other threads can obtain their own unique set of
-   *    coordinates to process;
+   * 1. obtain a new set of z & volume coordinates, unique to this thread;
    * 2. set the position of all `ImageType` classes to be processed according
    *    to these coordinates;
    * 3. iterate over the x & y axes, invoking the user-supplied functor each
    *    time;
    * 4. repeat from step 1 until all the data have been processed.
    *
+   * In practice, the outer coordinates are handed out to each thread in
+   * contiguous chunks of automatically-determined size, with idle threads
+   * stealing work from busy ones (see ThreadedLoopScheduler). This keeps
+   * synchronisation overhead low even when the inner axes are small, and
+   * means each thread mostly processes a contiguous region of the image.
+   *
    *
    * \section threaded_loop_constructor Instantiating a ThreadedLoop() object
    *
@@ -260,6 +270,73 @@ namespace MR
       }
 
 
+    //! work-stealing scheduler for the positions of the outer loop
+    /*! The outer iteration space is treated as a single linear range of
+     * positions, which is initially split into contiguous sub-ranges, one
+     * per thread. Each thread claims chunks of decreasing size from the
+     * start of its own sub-range (guided self-scheduling); once exhausted,
+     * it steals the second half of the remaining positions from another
+     * thread. Each thread therefore mostly processes a contiguous region of
+     * the image, and the per-range locks are taken roughly logarithmically
+     * many times in the number of positions, rather than once per position. */
+    class ThreadedLoopScheduler
+    {
+      public:
+        ThreadedLoopScheduler (size_t total, size_t num_threads) :
+          ranges (std::max (num_threads, size_t(1))) {
+            for (size_t n = 0; n < ranges.size(); ++n) {
+              ranges[n].first = total * n / ranges.size();
+              ranges[n].last = total * (n+1) / ranges.size();
+            }
+          }
+
+        //! claim the next chunk [\a first, \a last) of positions for \a thread
+        bool next (size_t thread, size_t& first, size_t& last) {
+          Range& own (ranges[thread % ranges.size()]);
+          while (true) {
+            {
+              std::lock_guard<std::mutex> lock (own.mutex);
+              if (own.first < own.last) {
+                first = own.first;
+                own.first += std::max ((own.last - own.first) / THREADED_LOOP_CHUNK_DIVISOR, size_t(1));
+                last = own.first;
+                return true;
+              }
+            }
+            if (!steal (thread % ranges.size()))
+              return false;
+          }
+        }
+
+      private:
+        struct Range {
+          std::mutex mutex;
+          size_t first, last;
+        };
+        std::vector<Range> ranges;
+
+        bool steal (size_t thread) {
+          for (size_t n = 1; n < ranges.size(); ++n) {
+            Range& victim (ranges[(thread+n) % ranges.size()]);
+            size_t first, last;
+            {
+              std::lock_guard<std::mutex> lock (victim.mutex);
+              if (victim.first >= victim.last)
+                continue;
+              first = victim.first + (victim.last - victim.first) / 2;
+              last = victim.last;
+              victim.last = first;
+            }
+            std::lock_guard<std::mutex> lock (ranges[thread].mutex);
+            ranges[thread].first = first;
+            ranges[thread].last = last;
+            return true;
+          }
+          return false;
+        }
+    };
+
+
     template <int N, class Functor, class... ImageType>
       struct ThreadedLoopRunInner
       {
@@ -319,30 +396,46 @@ namespace MR
               return;
             }
 
-            std::mutex mutex;
-
             struct Shared {
-              Iterator& iterator;
+              const Iterator start;
               decltype (outer_loop (iterator)) loop;
-              std::mutex& mutex;
-              FORCE_INLINE bool next (Iterator& pos) {
+              ThreadedLoopScheduler scheduler;
+              std::atomic<size_t> thread_index;
+              std::mutex mutex;
+
+              //! advance the outer loop (and its progress bar, if any) by \a count positions
+              void done (size_t count) {
                 std::lock_guard<std::mutex> lock (mutex);
-                if (loop) {
-                  assign_pos_of (iterator, loop.axes).to (pos);
+                while (count--)
                   ++loop;
-                  return true;
-                }
-                else return false;
               }
-            } shared = { iterator, outer_loop (iterator), mutex };
+            } shared = { iterator, outer_loop (iterator), 
+              { size_t (voxel_count (iterator, outer_loop.axes)), Thread::number_of_threads() }, { 0 }, { } };
 
             struct {
               Shared& shared;
               typename std::remove_reference<Functor>::type func;
               void execute () {
-                Iterator pos = shared.iterator;
-                while (shared.next (pos))
-                  func (pos);
+                const size_t thread = shared.thread_index++;
+                const auto& axes = shared.loop.axes;
+                Iterator pos = shared.start;
+                size_t first, last;
+                while (shared.scheduler.next (thread, first, last)) {
+                  size_t index = first;
+                  for (auto axis : axes) {
+                    pos.index (axis) = index % pos.size (axis);
+                    index /= pos.size (axis);
+                  }
+                  for (index = first; index < last; ++index) {
+                    func (pos);
+                    for (auto axis : axes) {
+                      if (++pos.index (axis) < pos.size (axis))
+                        break;
+                      pos.index (axis) = 0;
+                    }
+                  }
+                  shared.done (last - first);
+                }
               }
             } loop_thread = { shared, functor };
 
@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <zlib.h>
+
+#include "file/gz_parallel.h"
+#include "file/config.h"
+#include "file/mmap.h"
+#include "progressbar.h"
+#include "thread.h"
+
+// gzip header (10 bytes), XLEN (2 bytes), then subfield ID & LEN (4 bytes):
+#define GZ_INDEX_OFFSET 16
+// the payload holds the uncompressed block size, then the compressed size
+// of each block, all as 32-bit little-endian integers:
+#define GZ_MAX_BLOCKS ((65535 - 4 - 4) / 4)
+// number of blocks to hold in RAM per thread before writing out:
+#define GZ_BLOCKS_PER_THREAD 4
+
+namespace MR
+{
+  namespace File
+  {
+    namespace ParallelGZ
+    {
+
+      namespace
+      {
+
+        inline void put_le32 (uint8_t* p, uint32_t value)
+        {
+          p[0] = value; p[1] = value >> 8; p[2] = value >> 16; p[3] = value >> 24;
+        }
+
+        inline uint32_t get_le32 (const uint8_t* p)
+        {
+          return uint32_t (p[0]) | (uint32_t (p[1]) << 8) | (uint32_t (p[2]) << 16) | (uint32_t (p[3]) << 24);
+        }
+
+        inline uint16_t get_le16 (const uint8_t* p)
+        {
+          return uint16_t (p[0]) | (uint16_t (p[1]) << 8);
+        }
+
+
+
+        // state shared between all threads, holding the progress bar, the
+        // index of the next block to process, and the per-block results:
+        class Shared {
+          public:
+            Shared (size_t total_size, size_t block_size, ProgressBar* progress, size_t progress_unit) :
+              total_size (total_size),
+              block_size (block_size),
+              num_blocks (std::max<size_t> (1, (total_size + block_size - 1) / block_size)),
+              crc (num_blocks),
+              next (0), end (0),
+              progress (progress),
+              progress_unit (progress_unit),
+              processed (0) { }
+
+            size_t block_start (size_t n) const { return n * block_size; }
+            size_t block_end (size_t n) const { return std::min (total_size, (n+1) * block_size); }
+
+            bool get (size_t& n) {
+              n = next++;
+              return n < end;
+            }
+
+            void done (size_t n) {
+              if (!progress) return;
+              std::lock_guard<std::mutex> lock (mutex);
+              const size_t previous = processed / progress_unit;
+              processed += block_end (n) - block_start (n);
+              for (size_t i = previous; i < processed / progress_unit; ++i)
+                ++(*progress);
+            }
+
+            // CRC-32 of the whole stream, computed from the per-block values:
+            uint32_t stream_crc () const {
+              uLong value = crc[0];
+              for (size_t n = 1; n < num_blocks; ++n)
+                value = crc32_combine (value, crc[n], block_end (n) - block_start (n));
+              return value;
+            }
+
+            const size_t total_size, block_size, num_blocks;
+            std::vector<uint32_t> crc;
+            std::atomic<size_t> next;
+            size_t end;
+
+          protected:
+            ProgressBar* progress;
+            const size_t progress_unit;
+            size_t processed;
+            std::mutex mutex;
+        };
+
+
+
+
+        class Compressor {
+          public:
+            Compressor (Shared& shared, const uint8_t* lead_in, size_t lead_in_size, const uint8_t* data,
+                std::vector<std::vector<uint8_t>>& output, size_t first) :
+              shared (shared), lead_in (lead_in), lead_in_size (lead_in_size), data (data),
+              output (output), first (first) { }
+
+            void execute () {
+              size_t n;
+              while (shared.get (n)) {
+                compress (n, output[n - first]);
+                shared.done (n);
+              }
+            }
+
+          protected:
+            Shared& shared;
+            const uint8_t* lead_in;
+            const size_t lead_in_size;
+            const uint8_t* data;
+            std::vector<std::vector<uint8_t>>& output;
+            const size_t first;
+            std::vector<uint8_t> gathered;
+
+            // return a pointer to the contiguous input for block n, copying
+            // the relevant parts of the lead-in and data if it straddles both:
+            const uint8_t* input (size_t begin, size_t end) {
+              if (begin >= lead_in_size)
+                return data + (begin - lead_in_size);
+              if (end <= lead_in_size)
+                return lead_in + begin;
+              gathered.resize (end - begin);
+              memcpy (gathered.data(), lead_in + begin, lead_in_size - begin);
+              memcpy (gathered.data() + lead_in_size - begin, data, end - lead_in_size);
+              return gathered.data();
+            }
+
+            void compress (size_t n, std::vector<uint8_t>& out) {
+              const size_t begin = shared.block_start (n), end = shared.block_end (n);
+              const bool last = (n == shared.num_blocks - 1);
+              const uint8_t* in = input (begin, end);
+
+              shared.crc[n] = crc32 (crc32 (0L, Z_NULL, 0), in, end - begin);
+
+              z_stream strm;
+              memset (&strm, 0, sizeof (strm));
+              if (deflateInit2 (&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                throw Exception ("error initialising zlib compression: insufficient memory");
+
+              // sync flush appends an empty stored block: allow for it
+              out.resize (deflateBound (&strm, end - begin) + 16);
+              strm.next_in = const_cast<Bytef*> (in);
+              strm.avail_in = end - begin;
+              strm.next_out = out.data();
+              strm.avail_out = out.size();
+
+              int ret;
+              while ((ret = deflate (&strm, last ? Z_FINISH : Z_SYNC_FLUSH)) == Z_OK && strm.avail_out == 0) {
+                const size_t current = out.size();
+                out.resize (2*current);
+                strm.next_out = out.data() + current;
+                strm.avail_out = current;
+              }
+              if (ret != (last ? Z_STREAM_END : Z_OK)) {
+                deflateEnd (&strm);
+                throw Exception ("error compressing data: " + std::string (strm.msg ? strm.msg : "unknown zlib error"));
+              }
+              out.resize (strm.total_out);
+              deflateEnd (&strm);
+            }
+        };
+
+
+
+
+        class Decompressor {
+          public:
+            Decompressor (Shared& shared, const uint8_t* compressed, const std::vector<size_t>& block_offsets,
+                int64_t offset, uint8_t* data, size_t size) :
+              shared (shared), compressed (compressed), block_offsets (block_offsets),
+              offset (offset), data (data), size (size) { }
+
+            void execute () {
+              size_t n;
+              while (shared.get (n)) {
+                decompress (n);
+                shared.done (n);
+              }
+            }
+
+          protected:
+            Shared& shared;
+            const uint8_t* compressed;
+            const std::vector<size_t>& block_offsets;
+            const size_t offset;
+            uint8_t* data;
+            const size_t size;
+            std::vector<uint8_t> scratch;
+
+            void decompress (size_t n) {
+              const size_t begin = shared.block_start (n), end = shared.block_end (n);
+              const bool last = (n == shared.num_blocks - 1);
+
+              // inflate straight into the destination if the block lies
+              // entirely within the requested region:
+              uint8_t* out;
+              if (begin >= offset && end <= offset + size)
+                out = data + (begin - offset);
+              else {
+                scratch.resize (end - begin);
+                out = scratch.data();
+              }
+
+              z_stream strm;
+              memset (&strm, 0, sizeof (strm));
+              if (inflateInit2 (&strm, -MAX_WBITS) != Z_OK)
+                throw Exception ("error initialising zlib decompression: insufficient memory");
+
+              strm.next_in = const_cast<Bytef*> (compressed + block_offsets[n]);
+              strm.avail_in = block_offsets[n+1] - block_offsets[n];
+              strm.next_out = out;
+              strm.avail_out = end - begin;
+
+              const int ret = inflate (&strm, Z_SYNC_FLUSH);
+              const bool ok = last ?
+                (ret == Z_STREAM_END) :
+                (ret == Z_OK || (ret == Z_BUF_ERROR && strm.avail_out == 0));
+              const std::string msg (strm.msg ? strm.msg : "unexpected end of block");
+              const size_t total_out = strm.total_out;
+              inflateEnd (&strm);
+              if (!ok || total_out != end - begin)
+                throw Exception ("error uncompressing data: " + msg);
+
+              shared.crc[n] = crc32 (crc32 (0L, Z_NULL, 0), out, end - begin);
+
+              if (out == scratch.data()) {
+                const size_t from = std::max (begin, offset);
+                const size_t to = std::min (end, offset + size);
+                if (from < to)
+                  memcpy (data + (from - offset), out + (from - begin), to - from);
+              }
+            }
+        };
+
+      }
+
+
+
+
+
+      size_t block_size ()
+      {
+        //CONF option: GZBlockSize
+        //CONF default: 1048576
+        //CONF The size (in bytes) of the blocks that are compressed
+        //CONF independently (and concurrently) when writing compressed images
+        //CONF (e.g. .nii.gz, .mif.gz). Files written in this way remain standard
+        //CONF gzip streams, but can also be uncompressed using multiple
+        //CONF threads. Set to zero to use the original single-threaded
+        //CONF compression.
+        static const size_t size = File::Config::get_int ("GZBlockSize", 1048576);
+        return size;
+      }
+
+
+
+
+
+      void write (const std::string& filename,
+          const uint8_t* lead_in, size_t lead_in_size,
+          const uint8_t* data, size_t size,
+          ProgressBar* progress, size_t progress_unit)
+      {
+        const size_t total_size = lead_in_size + size;
+        size_t bsize = std::max<size_t> (block_size(), 1);
+        if ((total_size + bsize - 1) / bsize > GZ_MAX_BLOCKS)
+          bsize = (total_size + GZ_MAX_BLOCKS - 1) / GZ_MAX_BLOCKS;
+        if (bsize > std::numeric_limits<uInt>::max())
+          throw Exception ("image \"" + filename + "\" is too large for compressed output");
+
+        Shared shared (total_size, bsize, progress, progress_unit);
+        const size_t index_size = 4 * (shared.num_blocks + 1);
+
+        std::vector<uint8_t> header (GZ_INDEX_OFFSET + index_size, 0);
+        header[0] = 0x1f; header[1] = 0x8b; // ID1, ID2
+        header[2] = 8;                      // CM: deflate
+        header[3] = 4;                      // FLG: FEXTRA
+        header[9] = 3;                      // OS: Unix
+        header[10] = (index_size + 4) & 0xff;
+        header[11] = (index_size + 4) >> 8;
+        header[12] = 'M'; header[13] = 'R';
+        header[14] = index_size & 0xff;
+        header[15] = index_size >> 8;
+        put_le32 (&header[GZ_INDEX_OFFSET], bsize);
+
+        // the file will already have been created by the relevant format handler:
+        std::ofstream out (filename.c_str(), std::ios::out | std::ios::binary);
+        if (!out)
+          throw Exception ("error opening output file \"" + filename + "\": " + strerror (errno));
+        out.write (reinterpret_cast<const char*> (header.data()), header.size());
+
+        const size_t nthreads = std::max<size_t> (Thread::number_of_threads(), 1);
+        std::vector<std::vector<uint8_t>> compressed (GZ_BLOCKS_PER_THREAD * nthreads);
+        for (size_t first = 0; first < shared.num_blocks; first += compressed.size()) {
+          shared.next = first;
+          shared.end = std::min (shared.num_blocks, first + compressed.size());
+          Thread::run (Thread::multi (Compressor (shared, lead_in, lead_in_size, data, compressed, first), nthreads), "gzip compression").wait();
+          for (size_t n = first; n < shared.end; ++n) {
+            auto& block = compressed[n - first];
+            out.write (reinterpret_cast<const char*> (block.data()), block.size());
+            put_le32 (&header[GZ_INDEX_OFFSET + 4*(n+1)], block.size());
+          }
+        }
+
+        uint8_t trailer[8];
+        put_le32 (trailer, shared.stream_crc());
+        put_le32 (trailer+4, total_size);
+        out.write (reinterpret_cast<const char*> (trailer), 8);
+
+        out.seekp (GZ_INDEX_OFFSET);
+        out.write (reinterpret_cast<const char*> (&header[GZ_INDEX_OFFSET]), index_size);
+        if (!out.good())
+          throw Exception ("error writing to file \"" + filename + "\": " + strerror (errno));
+      }
+
+
+
+
+
+
+      Reader::Reader (const std::string& filename) :
+        filename (filename),
+        bsize (0),
+        total_size (0)
+      {
+        std::unique_ptr<File::MMap> map (new File::MMap (File::Entry (filename, 0)));
+        const uint8_t* p = map->address();
+        const size_t file_size = map->size();
+
+        if (file_size < GZ_INDEX_OFFSET + 8 + 8 ||
+            p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || p[3] != 4 ||
+            p[12] != 'M' || p[13] != 'R')
+          return;
+        const size_t index_size = get_le16 (p+14);
+        if (get_le16 (p+10) != index_size + 4 || index_size < 8 || index_size % 4 ||
+            file_size < GZ_INDEX_OFFSET + index_size + 8)
+          return;
+
+        const size_t num_blocks = index_size/4 - 1;
+        std::vector<size_t> offsets (num_blocks+1, GZ_INDEX_OFFSET + index_size);
+        for (size_t n = 0; n < num_blocks; ++n)
+          offsets[n+1] = offsets[n] + get_le32 (p + GZ_INDEX_OFFSET + 4*(n+1));
+        const size_t block_size = get_le32 (p + GZ_INDEX_OFFSET);
+        if (!block_size || offsets.back() + 8 != file_size)
+          return;
+
+        // the last block holds the remainder, as given by ISIZE (modulo 2^32):
+        const uint32_t isize = get_le32 (p + file_size - 4);
+        const size_t last_size = uint32_t (isize - uint32_t ((num_blocks-1) * block_size));
+        if (last_size > block_size)
+          return;
+
+        bsize = block_size;
+        total_size = (num_blocks-1) * bsize + last_size;
+        block_offsets = std::move (offsets);
+        mmap = std::move (map);
+      }
+
+
+
+
+      void Reader::read (int64_t offset, uint8_t* data, size_t size, ProgressBar* progress, size_t progress_unit) const
+      {
+        assert (valid());
+        if (offset + size > total_size)
+          throw Exception ("unexpected end of file in compressed file \"" + filename + "\"");
+        if (!size)
+          return;
+
+        Shared shared (total_size, bsize, progress, progress_unit);
+        assert (shared.num_blocks == block_offsets.size()-1);
+        shared.next = offset / bsize;
+        shared.end = (offset + size - 1) / bsize + 1;
+        const bool whole_stream = (shared.next == 0 && shared.end == shared.num_blocks);
+        const size_t nthreads = std::min (Thread::number_of_threads(), shared.end - shared.next);
+
+        DEBUG ("uncompressing " + str(shared.end - shared.next) + " blocks from file \"" + filename + "\" in parallel");
+        Thread::run (Thread::multi (Decompressor (shared, mmap->address(), block_offsets, offset, data, size), nthreads), "gzip decompression").wait();
+
+        if (whole_stream && shared.stream_crc() != get_le32 (mmap->address() + mmap->size() - 8))
+          throw Exception ("CRC mismatch in compressed file \"" + filename + "\"");
+      }
+
+
+
+
+
+      bool read (const std::string& filename, int64_t offset,
+          uint8_t* data, size_t size,
+          ProgressBar* progress, size_t progress_unit)
+      {
+        Reader reader (filename);
+        if (!reader.valid())
+          return false;
+        reader.read (offset, data, size, progress, progress_unit);
+        return true;
+      }
+
+
+    }
+  }
+}
+
+
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __file_gz_parallel_h__
+#define __file_gz_parallel_h__
+
+#include "memory.h"
+#include "types.h"
+#include "file/mmap.h"
+
+namespace MR
+{
+  class ProgressBar;
+
+  namespace File
+  {
+
+    //! multi-threaded compression & decompression of gzip streams
+    /*! These functions produce a standard single-member gzip stream (readable
+     * by gzip, zlib and any other compliant decoder), in which the data are
+     * split into blocks that are deflated independently and concurrently,
+     * in the same way as pigz. Each block is terminated with a sync flush,
+     * so that it starts on a byte boundary and makes no reference to the
+     * data in previous blocks.
+     *
+     * The compressed size of each block is recorded in a block index held
+     * within the 'extra' field of the gzip header (subfield ID 'MR'), which
+     * is ignored by other decoders. When such an index is present, the
+     * blocks can also be inflated concurrently. */
+    namespace ParallelGZ
+    {
+
+      //! the uncompressed size of each block, as set in the configuration file
+      /*! A value of zero indicates that the parallel engine should not be used. */
+      size_t block_size ();
+
+      //! compress \a lead_in followed by \a data into file \a filename
+      /*! The file will be created (or overwritten). If \a progress is
+       * non-null, it will be incremented once per \a progress_unit bytes of
+       * uncompressed data processed. */
+      void write (const std::string& filename,
+          const uint8_t* lead_in, size_t lead_in_size,
+          const uint8_t* data, size_t size,
+          ProgressBar* progress = nullptr, size_t progress_unit = 1);
+
+      //! random access to the blocks of a file written using ParallelGZ::write()
+      /*! The file is memory-mapped, and its block index parsed on
+       * construction. If no block index is found, valid() will return
+       * false, and the file can only be uncompressed sequentially (e.g.
+       * using File::GZ). */
+      class Reader
+      {
+        public:
+          Reader (const std::string& filename);
+
+          //! whether the file holds a valid block index
+          bool valid () const { return bool (mmap); }
+          //! the total size of the uncompressed stream
+          size_t size () const { return total_size; }
+
+          //! decompress \a size bytes at uncompressed \a offset into \a data
+          /*! Only those blocks that overlap the requested region are
+           * inflated, using multiple threads. The CRC of the stream is
+           * verified whenever all blocks are inflated. */
+          void read (int64_t offset, uint8_t* data, size_t size,
+              ProgressBar* progress = nullptr, size_t progress_unit = 1) const;
+
+        protected:
+          const std::string filename;
+          std::unique_ptr<MMap> mmap;
+          size_t bsize, total_size;
+          std::vector<size_t> block_offsets;
+      };
+
+      //! decompress \a size bytes at uncompressed \a offset from file \a filename into \a data
+      /*! This will only succeed if the file was written using
+       * ParallelGZ::write(), in which case the function returns true. If the
+       * file does not contain a block index, nothing is read and the function
+       * returns false, in which case the caller should fall back to standard
+       * sequential decompression (e.g. using File::GZ). If \a progress is
+       * non-null, it will be incremented once per \a progress_unit bytes of
+       * uncompressed data processed. */
+      bool read (const std::string& filename, int64_t offset,
+          uint8_t* data, size_t size,
+          ProgressBar* progress = nullptr, size_t progress_unit = 1);
+
+    }
+
+  }
+}
+
+#endif
+
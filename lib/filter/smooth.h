@@ -20,7 +20,7 @@
 #include "image.h"
 #include "algo/copy.h"
 #include "algo/threaded_copy.h"
-#include "adapter/gaussian1D.h"
+#include "algo/threaded_loop.h"
 #include "filter/base.h"
 
 namespace MR
@@ -117,12 +117,17 @@ namespace MR
         }
 
         //! Smooth the input image. Both input and output images can be the same image
+        /*! The output image is used as the working buffer: each line along
+         * the axis being smoothed is copied into a contiguous buffer,
+         * convolved, and written back in place. The result is identical to
+         * that of applying Adapter::Gaussian1D along each axis in turn (to
+         * within rounding), including the renormalisation of the kernel at
+         * the image boundaries and around non-finite values. */
         template <class InputImageType, class OutputImageType, typename ValueType = float>
         void operator() (InputImageType& input, OutputImageType& output)
         {
-          std::shared_ptr <Image<ValueType> > in (std::make_shared<Image<ValueType> > (Image<ValueType>::scratch (input)));
-          threaded_copy (input, *in);
-          std::shared_ptr <Image<ValueType> > out;
+          if (static_cast<const void*> (&input) != static_cast<const void*> (&output))
+            threaded_copy (input, output);
 
           std::unique_ptr<ProgressBar> progress;
           if (message.size()) {
@@ -135,21 +140,122 @@ namespace MR
 
           for (size_t dim = 0; dim < 3; dim++) {
             if (stdev[dim] > 0) {
-              out = std::make_shared<Image<ValueType> > (Image<ValueType>::scratch (input));
-              Adapter::Gaussian1D<Image<ValueType> > gaussian (*in, stdev[dim], dim, extent[dim], zero_boundary);
-              threaded_copy (gaussian, *out, 0, input.ndim(), 2);
-              in = out;
+              LineSmoother<ValueType> smoother (output, stdev[dim], dim, extent[dim], zero_boundary);
+              if (smoother.active()) {
+                std::vector<size_t> axes;
+                for (size_t n = 0; n < output.ndim(); ++n)
+                  if (n != dim)
+                    axes.push_back (n);
+                ThreadedLoop (output, axes).run (smoother, output);
+              }
               if (progress)
                 ++(*progress);
             }
           }
-          threaded_copy (*in, output);
         }
 
       protected:
         std::vector<int> extent;
         std::vector<default_type> stdev;
         bool zero_boundary;
+
+
+        // Smooths a single line through the image along the specified axis
+        template <typename ValueType>
+        class LineSmoother
+        {
+          public:
+            template <class HeaderType>
+            LineSmoother (const HeaderType& header, default_type stdev, size_t axis, size_t extent, bool zero_boundary) :
+                axis (axis),
+                size (header.size (axis)),
+                zero_boundary (zero_boundary)
+            {
+              // kernel as computed in Adapter::Gaussian1D:
+              ssize_t radius;
+              if (!extent)
+                radius = std::ceil (2 * stdev / header.spacing (axis));
+              else if (extent == 1)
+                radius = 0;
+              else
+                radius = (extent - 1) / 2;
+              if (radius < 1 || stdev <= 0.0)
+                return;
+              std::vector<default_type> weights (2 * radius + 1);
+              default_type norm_factor = 0.0;
+              for (ssize_t c = 0; c < ssize_t (weights.size()); ++c) {
+                weights[c] = std::exp (-((c-radius) * (c-radius) * header.spacing (axis) * header.spacing (axis)) / (2 * stdev * stdev));
+                norm_factor += weights[c];
+              }
+              kernel.resize (weights.size());
+              for (size_t c = 0; c < weights.size(); ++c)
+                kernel[c] = weights[c] / norm_factor;
+
+              // sum of the kernel weights that fall within the image at each position,
+              // for the case where all values along the line are finite:
+              line.setZero (size + 2*radius);
+              line.segment (radius, size).setOnes();
+              convolve (line, boundary_norm);
+            }
+
+            bool active () const { return kernel.size(); }
+
+            template <class ImageType>
+            void operator() (ImageType& image)
+            {
+              const ssize_t radius = kernel.size() / 2;
+              if (!line.size())
+                line.setZero (size + 2*radius);
+              bool all_finite = true;
+              for (ssize_t k = 0; k < size; ++k) {
+                image.index (axis) = k;
+                line[radius+k] = image.value();
+                if (!std::isfinite (line[radius+k]))
+                  all_finite = false;
+              }
+
+              if (all_finite) {
+                convolve (line, result);
+                result /= boundary_norm;
+              } else {
+                Eigen::Array<ValueType, Eigen::Dynamic, 1> mask, norm;
+                mask.setZero (line.size());
+                for (ssize_t k = radius; k < radius + size; ++k) {
+                  if (std::isfinite (line[k])) {
+                    mask[k] = 1.0;
+                  } else {
+                    line[k] = 0.0;
+                  }
+                }
+                convolve (line, result);
+                convolve (mask, norm);
+                result /= norm;
+              }
+
+              if (zero_boundary)
+                result[0] = result[size-1] = 0.0;
+
+              for (ssize_t k = 0; k < size; ++k) {
+                image.index (axis) = k;
+                image.value() = result[k];
+              }
+            }
+
+          private:
+            const size_t axis;
+            const ssize_t size;
+            const bool zero_boundary;
+            Eigen::Array<ValueType, Eigen::Dynamic, 1> kernel, boundary_norm, line, result;
+
+            // convolve the zero-padded line with the kernel, one tap at a time,
+            // so that each tap is applied to the whole line as a single vectorised operation:
+            void convolve (const Eigen::Array<ValueType, Eigen::Dynamic, 1>& in, Eigen::Array<ValueType, Eigen::Dynamic, 1>& out) const
+            {
+              out = kernel[0] * in.head (size);
+              for (ssize_t c = 1; c < kernel.size(); ++c)
+                out += kernel[c] * in.segment (c, size);
+            }
+        };
     };
     //! @}
   }
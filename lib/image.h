@@ -103,6 +103,30 @@ namespace MR
                    (address(), size (axis), Eigen::InnerStride<> (stride (axis)));
         }
 
+        //! get all values along the specified axis at the current index position
+        /*! Unlike row(), this can be used with any Image: if the data need
+         * to be converted, the whole row is converted in a single call. */
+        FORCE_INLINE void get_row (size_t axis, ValueType* values)
+        {
+          index (axis) = 0;
+          if (data_pointer) {
+            for (ssize_t n = 0; n < size (axis); ++n)
+              values[n] = Raw::fetch_native<ValueType> (data_pointer, data_offset + n*stride (axis));
+          }
+          else buffer->get_values (data_offset, stride (axis), size (axis), values);
+        }
+
+        //! set all values along the specified axis at the current index position
+        FORCE_INLINE void set_row (size_t axis, const ValueType* values)
+        {
+          index (axis) = 0;
+          if (data_pointer) {
+            for (ssize_t n = 0; n < size (axis); ++n)
+              Raw::store_native<ValueType> (values[n], data_pointer, data_offset + n*stride (axis));
+          }
+          else buffer->set_values (data_offset, stride (axis), size (axis), values);
+        }
+
         //! use for debugging
         friend std::ostream& operator<< (std::ostream& stream, const Image& V) {
           stream << "\"" << V.name() << "\", datatype " << DataType::from<Image::value_type>().specifier() << ", index [ ";
@@ -230,31 +254,75 @@ namespace MR
         Buffer& operator= (const Buffer&) = delete;
         Buffer& operator= (Buffer&&) = default;
         Buffer (const Buffer& b) : 
-          Header (b), fetch_func (b.fetch_func), store_func (b.store_func) { }
+          Header (b), single_segment (nullptr),
+          fetch_func (b.fetch_func), store_func (b.store_func),
+          fetch_row_func (b.fetch_row_func), store_row_func (b.store_row_func) { }
 
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW  // avoid memory alignment errors in Eigen3;
 
         FORCE_INLINE ValueType get_value (size_t offset) const {
+          if (single_segment)
+            return fetch_func (single_segment, offset, intensity_offset(), intensity_scale());
           ssize_t nseg = offset / io->segment_size();
+          if (io->segment_cache()) {
+            ImageIO::SegmentCache::Lock segment (*io->segment_cache(), nseg);
+            return fetch_func (segment.address(), offset - nseg*io->segment_size(), intensity_offset(), intensity_scale());
+          }
           return fetch_func (io->segment (nseg), offset - nseg*io->segment_size(), intensity_offset(), intensity_scale());
         }
 
         FORCE_INLINE void set_value (size_t offset, ValueType val) const {
+          if (single_segment) {
+            store_func (val, single_segment, offset, intensity_offset(), intensity_scale());
+            return;
+          }
           ssize_t nseg = offset / io->segment_size();
+          if (io->segment_cache()) {
+            ImageIO::SegmentCache::Lock segment (*io->segment_cache(), nseg, true);
+            store_func (val, segment.address(), offset - nseg*io->segment_size(), intensity_offset(), intensity_scale());
+            return;
+          }
           store_func (val, io->segment (nseg), offset - nseg*io->segment_size(), intensity_offset(), intensity_scale());
         }
 
+        //! get the \a n values starting at \a offset, separated by \a stride
+        /*! If the data are held in a single segment, this converts the whole
+         * row in one call to a type-specialised kernel. */
+        FORCE_INLINE void get_values (size_t offset, ssize_t stride, size_t n, ValueType* values) const {
+          if (single_segment) {
+            fetch_row_func (values, single_segment, offset, stride, n, intensity_offset(), intensity_scale());
+            return;
+          }
+          for (size_t k = 0; k < n; ++k, offset += stride)
+            values[k] = get_value (offset);
+        }
+
+        //! set the \a n values starting at \a offset, separated by \a stride
+        FORCE_INLINE void set_values (size_t offset, ssize_t stride, size_t n, const ValueType* values) const {
+          if (single_segment) {
+            store_row_func (values, single_segment, offset, stride, n, intensity_offset(), intensity_scale());
+            return;
+          }
+          for (size_t k = 0; k < n; ++k, offset += stride)
+            set_value (offset, values[k]);
+        }
+
         std::unique_ptr<uint8_t[]> data_buffer;
         void* get_data_pointer ();
 
         FORCE_INLINE ImageIO::Base* get_io () const { return io.get(); }
 
       protected:
-        std::function<ValueType(const void*,size_t,default_type,default_type)> fetch_func;
-        std::function<void(ValueType,void*,size_t,default_type,default_type)> store_func;
+        // set if all data are held in a single segment, to avoid looking up
+        // the segment for each access:
+        uint8_t* single_segment;
+        FetchFunc<ValueType> fetch_func;
+        StoreFunc<ValueType> store_func;
+        FetchRowFunc<ValueType> fetch_row_func;
+        StoreRowFunc<ValueType> store_row_func;
 
         void set_fetch_store_functions () {
-          __set_fetch_store_functions (fetch_func, store_func, datatype());
+          __set_fetch_store_functions (fetch_func, store_func, fetch_row_func, store_row_func, datatype());
         }
     };
 
@@ -312,15 +380,19 @@ namespace MR
 
   template <typename ValueType>
     Image<ValueType>::Buffer::Buffer (Header& H, bool read_write_if_existing) :
-      Header (H) {
+      Header (H),
+      single_segment (nullptr) {
         assert (H.valid() && "IO handler must be set when creating an Image"); 
         assert ((H.is_file_backed() ? is_data_type<ValueType>::value : true) && "class types cannot be stored on file using the Image class");
 
         acquire_io (H);
         io->set_readwrite_if_existing (read_write_if_existing);
         io->open (*this, footprint<ValueType> (voxel_count (*this)));
-        if (io->is_file_backed()) 
+        if (io->is_file_backed()) {
           set_fetch_store_functions ();
+          if (!io->segment_cache() && io->nsegments() == 1)
+            single_segment = io->segment (0);
+        }
       }
 
 
@@ -437,9 +509,27 @@ namespace MR
         memset (buffer->data_buffer.get(), 0, buffer_size);
       }
       else {
+        // convert whole rows along the axis that is contiguous on file:
         auto src (*this);
-        TmpImage<ValueType> dest = { *buffer, buffer->data_buffer.get(), std::vector<ssize_t> (ndim(), 0), with_strides, Stride::offset (with_strides, *this) };
-        threaded_copy_with_progress_message ("preloading data for \"" + name() + "\"", src, dest); 
+        auto loop = ThreadedLoop ("preloading data for \"" + name() + "\"", src, 0, ndim(), 1);
+        const size_t axis = loop.inner_axes[0];
+        const auto& outer_axes = loop.outer_loop.axes;
+        void* const data = buffer->data_buffer.get();
+        const size_t start = Stride::offset (with_strides, *this);
+
+        Eigen::Array<ValueType, Eigen::Dynamic, 1> row;
+        auto preload = [=] (const Iterator& pos) mutable {
+          assign_pos_of (pos, outer_axes).to (src);
+          row.resize (src.size (axis));
+          src.get_row (axis, row.data());
+          size_t offset = start;
+          for (size_t n = 0; n < src.ndim(); ++n)
+            offset += src.index (n) * with_strides[n];
+          for (ssize_t n = 0; n < row.size(); ++n, offset += with_strides[axis])
+            Raw::store_native<ValueType> (row[n], data, offset);
+        };
+
+        loop.run_outer (preload);
       }
 
       return Image (buffer, with_strides);
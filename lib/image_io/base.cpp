@@ -35,7 +35,7 @@ namespace MR
 
     void Base::open (const Header& header, size_t buffer_size)
     {
-      if (addresses.size())
+      if (addresses.size() || cache)
         return;
 
       load (header, buffer_size);
@@ -46,12 +46,13 @@ namespace MR
 
     void Base::close (const Header& header)
     {
-      if (addresses.empty())
+      if (addresses.empty() && !cache)
         return;
 
       unload (header);
       DEBUG ("image \"" + header.name() + "\" unloaded");
       addresses.clear();
+      cache.reset();
     }
 
 
@@ -24,6 +24,7 @@
 #include "memory.h"
 #include "mrtrix.h"
 #include "file/entry.h"
+#include "image_io/segment_cache.h"
 
 #define MAX_FILES_PER_IMAGE 256U
 
@@ -83,6 +84,12 @@ namespace MR
           check();
           return segsize;
         }
+        //! the cache holding the segments, if these are only loaded on access
+        /*! If non-null, the segments are not available via segment(), and
+         * should instead be accessed via a SegmentCache::Lock. */
+        SegmentCache* segment_cache () const {
+          return cache.get();
+        }
 
         std::vector<File::Entry> files;
 
@@ -102,10 +109,11 @@ namespace MR
       protected:
         size_t segsize;
         std::vector<std::unique_ptr<uint8_t[]>> addresses;
+        std::unique_ptr<SegmentCache> cache;
         bool is_new, writable;
 
         void check () const {
-          assert (addresses.size());
+          assert (addresses.size() || cache);
         }
         virtual void load (const Header& header, size_t buffer_size) = 0;
         virtual void unload (const Header& header) = 0;
@@ -134,116 +134,108 @@ namespace MR
       }
 
 
+
+
+    // row conversion, with the per-value conversion inlined:
+
+    template <typename RAMType, FetchFunc<RAMType> fetch>
+      void __fetch_row (RAMType* values, const void* data, size_t i, ssize_t stride, size_t n, default_type offset, default_type scale) {
+        if (stride == 1) {
+          for (size_t k = 0; k < n; ++k)
+            values[k] = fetch (data, i+k, offset, scale);
+        }
+        else {
+          for (size_t k = 0; k < n; ++k, i += stride)
+            values[k] = fetch (data, i, offset, scale);
+        }
+      }
+
+    template <typename RAMType, StoreFunc<RAMType> store>
+      void __store_row (const RAMType* values, void* data, size_t i, ssize_t stride, size_t n, default_type offset, default_type scale) {
+        if (stride == 1) {
+          for (size_t k = 0; k < n; ++k)
+            store (values[k], data, i+k, offset, scale);
+        }
+        else {
+          for (size_t k = 0; k < n; ++k, i += stride)
+            store (values[k], data, i, offset, scale);
+        }
+      }
+
   }
 
 
 
+#define __SET_FETCH_STORE(ByteOrder, DiskType) \
+  fetch_func = __fetch##ByteOrder<ValueType,DiskType>; \
+  store_func = __store##ByteOrder<ValueType,DiskType>; \
+  fetch_row_func = __fetch_row<ValueType,__fetch##ByteOrder<ValueType,DiskType>>; \
+  store_row_func = __store_row<ValueType,__store##ByteOrder<ValueType,DiskType>>; \
+  return
 
 
   template <typename ValueType>
     typename std::enable_if<is_data_type<ValueType>::value, void>::type __set_fetch_store_functions (
-        std::function<ValueType(const void*,size_t,default_type,default_type)>& fetch_func,
-        std::function<void(ValueType,void*,size_t,default_type,default_type)>& store_func, 
+        FetchFunc<ValueType>& fetch_func,
+        StoreFunc<ValueType>& store_func,
+        FetchRowFunc<ValueType>& fetch_row_func,
+        StoreRowFunc<ValueType>& store_row_func,
         DataType datatype) {
 
       switch (datatype()) {
         case DataType::Bit:
-          fetch_func = __fetch<ValueType,bool>;
-          store_func = __store<ValueType,bool>;
-          return;
+          __SET_FETCH_STORE(, bool);
         case DataType::Int8:
-          fetch_func = __fetch<ValueType,int8_t>;
-          store_func = __store<ValueType,int8_t>;
-          return;
+          __SET_FETCH_STORE(, int8_t);
         case DataType::UInt8:
-          fetch_func = __fetch<ValueType,uint8_t>;
-          store_func = __store<ValueType,uint8_t>;
-          return;
+          __SET_FETCH_STORE(, uint8_t);
         case DataType::Int16LE:
-          fetch_func = __fetch_LE<ValueType,int16_t>;
-          store_func = __store_LE<ValueType,int16_t>;
-          return;
+          __SET_FETCH_STORE(_LE, int16_t);
         case DataType::UInt16LE:
-          fetch_func = __fetch_LE<ValueType,uint16_t>;
-          store_func = __store_LE<ValueType,uint16_t>;
-          return;
+          __SET_FETCH_STORE(_LE, uint16_t);
         case DataType::Int16BE:
-          fetch_func = __fetch_BE<ValueType,int16_t>;
-          store_func = __store_BE<ValueType,int16_t>;
-          return;
+          __SET_FETCH_STORE(_BE, int16_t);
         case DataType::UInt16BE:
-          fetch_func = __fetch_BE<ValueType,uint16_t>;
-          store_func = __store_BE<ValueType,uint16_t>;
-          return;
+          __SET_FETCH_STORE(_BE, uint16_t);
         case DataType::Int32LE:
-          fetch_func = __fetch_LE<ValueType,int32_t>;
-          store_func = __store_LE<ValueType,int32_t>;
-          return;
+          __SET_FETCH_STORE(_LE, int32_t);
         case DataType::UInt32LE:
-          fetch_func = __fetch_LE<ValueType,uint32_t>;
-          store_func = __store_LE<ValueType,uint32_t>;
-          return;
+          __SET_FETCH_STORE(_LE, uint32_t);
         case DataType::Int32BE:
-          fetch_func = __fetch_BE<ValueType,int32_t>;
-          store_func = __store_BE<ValueType,int32_t>;
-          return;
+          __SET_FETCH_STORE(_BE, int32_t);
         case DataType::UInt32BE:
-          fetch_func = __fetch_BE<ValueType,uint32_t>;
-          store_func = __store_BE<ValueType,uint32_t>;
-          return;
+          __SET_FETCH_STORE(_BE, uint32_t);
         case DataType::Int64LE:
-          fetch_func = __fetch_LE<ValueType,int64_t>;
-          store_func = __store_LE<ValueType,int64_t>;
-          return;
+          __SET_FETCH_STORE(_LE, int64_t);
         case DataType::UInt64LE:
-          fetch_func = __fetch_LE<ValueType,uint64_t>;
-          store_func = __store_LE<ValueType,uint64_t>;
-          return;
+          __SET_FETCH_STORE(_LE, uint64_t);
         case DataType::Int64BE:
-          fetch_func = __fetch_BE<ValueType,int64_t>;
-          store_func = __store_BE<ValueType,int64_t>;
-          return;
+          __SET_FETCH_STORE(_BE, int64_t);
         case DataType::UInt64BE:
-          fetch_func = __fetch_BE<ValueType,uint64_t>;
-          store_func = __store_BE<ValueType,uint64_t>;
-          return;
+          __SET_FETCH_STORE(_BE, uint64_t);
         case DataType::Float32LE:
-          fetch_func = __fetch_LE<ValueType,float>;
-          store_func = __store_LE<ValueType,float>;
-          return;
+          __SET_FETCH_STORE(_LE, float);
         case DataType::Float32BE:
-          fetch_func = __fetch_BE<ValueType,float>;
-          store_func = __store_BE<ValueType,float>;
-          return;
+          __SET_FETCH_STORE(_BE, float);
         case DataType::Float64LE:
-          fetch_func = __fetch_LE<ValueType,double>;
-          store_func = __store_LE<ValueType,double>;
-          return;
+          __SET_FETCH_STORE(_LE, double);
         case DataType::Float64BE:
-          fetch_func = __fetch_BE<ValueType,double>;
-          store_func = __store_BE<ValueType,double>;
-          return;
+          __SET_FETCH_STORE(_BE, double);
         case DataType::CFloat32LE:
-          fetch_func = __fetch_LE<ValueType,cfloat>;
-          store_func = __store_LE<ValueType,cfloat>;
-          return;
+          __SET_FETCH_STORE(_LE, cfloat);
         case DataType::CFloat32BE:
-          fetch_func = __fetch_BE<ValueType,cfloat>;
-          store_func = __store_BE<ValueType,cfloat>;
-          return;
+          __SET_FETCH_STORE(_BE, cfloat);
         case DataType::CFloat64LE:
-          fetch_func = __fetch_LE<ValueType,cdouble>;
-          store_func = __store_LE<ValueType,cdouble>;
-          return;
+          __SET_FETCH_STORE(_LE, cdouble);
         case DataType::CFloat64BE:
-          fetch_func = __fetch_BE<ValueType,cdouble>;
-          store_func = __store_BE<ValueType,cdouble>;
-          return;
+          __SET_FETCH_STORE(_BE, cdouble);
         default:
           throw Exception ("invalid data type in image header");
       }
     }
 
+#undef __SET_FETCH_STORE
+
 #undef MRTRIX_EXTERN
 #define MRTRIX_EXTERN
   __DEFINE_FETCH_STORE_FUNCTIONS;
@@ -22,29 +22,67 @@
 namespace MR
 {
 
+  //! the functions used to convert a single value between RAM and storage
+  /*! These take the address of the data, the offset (in voxels) of the
+   * value, and the intensity offset & scale to apply. */
+  template <typename ValueType>
+    using FetchFunc = ValueType (*) (const void*, size_t, default_type, default_type);
+  template <typename ValueType>
+    using StoreFunc = void (*) (ValueType, void*, size_t, default_type, default_type);
+
+  //! the functions used to convert a whole row of values between RAM and storage
+  /*! These take the in-RAM array of values, the address of the data, the
+   * offset (in voxels) of the first value, the stride (in voxels) between
+   * successive values, the number of values, and the intensity offset &
+   * scale to apply. The conversion for each data type is inlined within
+   * these, allowing the compiler to vectorise the loop over the row. */
+  template <typename ValueType>
+    using FetchRowFunc = void (*) (ValueType*, const void*, size_t, ssize_t, size_t, default_type, default_type);
+  template <typename ValueType>
+    using StoreRowFunc = void (*) (const ValueType*, void*, size_t, ssize_t, size_t, default_type, default_type);
+
+
 
   template <typename ValueType>
     typename std::enable_if<!is_data_type<ValueType>::value, void>::type __set_fetch_store_functions (
-        std::function<ValueType(const void*,size_t,default_type,default_type)>& /*fetch_func*/,
-        std::function<void(ValueType,void*,size_t,default_type,default_type)>& /*store_func*/, 
+        FetchFunc<ValueType>& /*fetch_func*/,
+        StoreFunc<ValueType>& /*store_func*/,
+        FetchRowFunc<ValueType>& /*fetch_row_func*/,
+        StoreRowFunc<ValueType>& /*store_row_func*/,
         DataType /*datatype*/) { }
 
 
 
   template <typename ValueType>
     typename std::enable_if<is_data_type<ValueType>::value, void>::type __set_fetch_store_functions (
-        std::function<ValueType(const void*,size_t,default_type,default_type)>& fetch_func,
-        std::function<void(ValueType,void*,size_t,default_type,default_type)>& store_func, 
+        FetchFunc<ValueType>& fetch_func,
+        StoreFunc<ValueType>& store_func,
+        FetchRowFunc<ValueType>& fetch_row_func,
+        StoreRowFunc<ValueType>& store_row_func,
         DataType datatype);
 
 
+
+  template <typename ValueType>
+    inline void __set_fetch_store_functions (
+        FetchFunc<ValueType>& fetch_func,
+        StoreFunc<ValueType>& store_func,
+        DataType datatype) {
+      FetchRowFunc<ValueType> fetch_row_func;
+      StoreRowFunc<ValueType> store_row_func;
+      __set_fetch_store_functions (fetch_func, store_func, fetch_row_func, store_row_func, datatype);
+    }
+
+
   // define fetch/store methods for all types using C++11 extern templates, 
   // to avoid massive recompile times...
 #define __DEFINE_FETCH_STORE_FUNCTION_FOR_TYPE(ValueType) \
   MRTRIX_EXTERN template void __set_fetch_store_functions<ValueType> ( \
-      std::function<ValueType(const void*,size_t,default_type,default_type)>& fetch_func, \
-        std::function<void(ValueType,void*,size_t,default_type,default_type)>& store_func, \
-        DataType datatype) 
+      FetchFunc<ValueType>& fetch_func, \
+      StoreFunc<ValueType>& store_func, \
+      FetchRowFunc<ValueType>& fetch_row_func, \
+      StoreRowFunc<ValueType>& store_row_func, \
+      DataType datatype) 
 
 #define __DEFINE_FETCH_STORE_FUNCTIONS \
   __DEFINE_FETCH_STORE_FUNCTION_FOR_TYPE(bool); \
@@ -19,9 +19,11 @@
 #include "progressbar.h"
 #include "header.h"
 #include "image_io/gz.h"
-#include "file/gz.h"
+#include "file/config.h"
 
 #define BYTES_PER_ZCALL 524288
+// size of the chunks held in RAM when uncompressing on demand:
+#define BYTES_PER_CHUNK 4194304
 
 namespace MR
 {
@@ -38,6 +40,23 @@ namespace MR
       if (files.size() * bytes_per_segment > std::numeric_limits<size_t>::max())
         throw Exception ("image \"" + header.name() + "\" is larger than maximum accessible memory");
 
+      if (!is_new && !writable && header.datatype().bits() != 1) {
+        //CONF option: GZCacheSize
+        //CONF default: 0 (disabled)
+        //CONF The maximum amount of RAM (in bytes) to use for the
+        //CONF uncompressed data of read-only compressed images (e.g. .nii.gz,
+        //CONF .mif.gz). Images whose uncompressed size exceeds this value
+        //CONF are only uncompressed one chunk at a time as their data are
+        //CONF accessed, with the least recently used chunks discarded as
+        //CONF required. If zero, images are always uncompressed in full on
+        //CONF loading.
+        const int64_t cache_size = File::Config::get_int ("GZCacheSize", 0);
+        if (cache_size > 0 && int64_t (files.size()) * bytes_per_segment > cache_size) {
+          load_on_demand (header, cache_size);
+          return;
+        }
+      }
+
       DEBUG ("loading image \"" + header.name() + "\"...");
       addresses.resize (header.datatype().bits() == 1 && files.size() > 1 ? files.size() : 1);
       addresses[0].reset (new uint8_t [files.size() * bytes_per_segment]);
@@ -50,9 +69,11 @@ namespace MR
         ProgressBar progress ("uncompressing image \"" + header.name() + "\"",
             files.size() * bytes_per_segment / BYTES_PER_ZCALL);
         for (size_t n = 0; n < files.size(); n++) {
+          uint8_t* address = addresses[0].get() + n*bytes_per_segment;
+          if (File::ParallelGZ::read (files[n].name, files[n].start, address, bytes_per_segment, &progress, BYTES_PER_ZCALL))
+            continue;
           File::GZ zf (files[n].name, "rb");
           zf.seek (files[n].start);
-          uint8_t* address = addresses[0].get() + n*bytes_per_segment;
           uint8_t* last = address + bytes_per_segment - BYTES_PER_ZCALL;
           while (address < last) {
             zf.read (reinterpret_cast<char*> (address), BYTES_PER_ZCALL);
@@ -74,6 +95,65 @@ namespace MR
 
 
 
+    void GZ::load_on_demand (const Header& header, size_t cache_size)
+    {
+      INFO ("image \"" + header.name() + "\" will be uncompressed on demand");
+
+      // for multi-file images, each file is held as a separate segment:
+      if (files.size() > 1) {
+        cache.reset (new SegmentCache (files.size(), bytes_per_segment, cache_size,
+              [this](size_t n, uint8_t* data) { read (files[n], 0, data, bytes_per_segment); }));
+        return;
+      }
+
+      // otherwise, split the single file into chunks of whole voxels:
+      const size_t bytes_per_voxel = header.datatype().bytes();
+      segsize = std::max<size_t> (1, BYTES_PER_CHUNK / bytes_per_voxel);
+      const size_t bytes_per_chunk = segsize * bytes_per_voxel;
+      const size_t num_chunks = (bytes_per_segment + bytes_per_chunk - 1) / bytes_per_chunk;
+
+      reader.reset (new File::ParallelGZ::Reader (files[0].name));
+      if (!reader->valid()) {
+        DEBUG ("no block index found in \"" + files[0].name + "\" - random access will be slow");
+        reader.reset();
+      }
+
+      cache.reset (new SegmentCache (num_chunks, bytes_per_chunk, cache_size,
+            [this,bytes_per_chunk](size_t n, uint8_t* data) {
+              const int64_t offset = n * bytes_per_chunk;
+              read (files[0], offset, data, std::min<int64_t> (bytes_per_chunk, bytes_per_segment - offset));
+            }));
+    }
+
+
+
+    // this is only invoked by the SegmentCache, with its mutex held:
+    void GZ::read (const File::Entry& file, int64_t offset, uint8_t* data, size_t size)
+    {
+      if (files.size() == 1 && reader) {
+        reader->read (file.start + offset, data, size);
+        return;
+      }
+
+      if (files.size() > 1) {
+        File::ParallelGZ::Reader file_reader (file.name);
+        if (file_reader.valid()) {
+          file_reader.read (file.start + offset, data, size);
+          return;
+        }
+      }
+
+      // sequential access: seeking forward from the current position is
+      // cheap, so keep the stream open across calls when possible:
+      if (!zf || zf->name() != file.name)
+        zf.reset (new File::GZ (file.name, "rb"));
+      zf->seek (file.start + offset);
+      if (zf->read (reinterpret_cast<char*> (data), size) != int (size))
+        throw Exception ("unexpected end of file in compressed file \"" + file.name + "\"");
+    }
+
+
+
     void GZ::unload (const Header& header)
     {
       if (addresses.size()) {
@@ -84,10 +164,14 @@ namespace MR
               files.size() * bytes_per_segment / BYTES_PER_ZCALL);
           for (size_t n = 0; n < files.size(); n++) {
             assert (files[n].start == int64_t (lead_in_size));
+            uint8_t* address = addresses[0].get() + n*bytes_per_segment;
+            if (File::ParallelGZ::block_size()) {
+              File::ParallelGZ::write (files[n].name, lead_in.get(), lead_in_size, address, bytes_per_segment, &progress, BYTES_PER_ZCALL);
+              continue;
+            }
             File::GZ zf (files[n].name, "wb");
             if (lead_in)
               zf.write (reinterpret_cast<const char*> (lead_in.get()), lead_in_size);
-            uint8_t* address = addresses[0].get() + n*bytes_per_segment;
             uint8_t* last = address + bytes_per_segment - BYTES_PER_ZCALL;
             while (address < last) {
               zf.write (reinterpret_cast<const char*> (address), BYTES_PER_ZCALL);
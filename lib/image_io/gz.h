@@ -18,6 +18,8 @@
 
 #include "image_io/base.h"
 #include "file/mmap.h"
+#include "file/gz.h"
+#include "file/gz_parallel.h"
 
 namespace MR
 {
@@ -43,8 +45,15 @@ namespace MR
         size_t   lead_in_size;
         std::unique_ptr<uint8_t[]> lead_in;
 
+        // used when uncompressing a single large file on demand:
+        std::unique_ptr<File::ParallelGZ::Reader> reader;
+        std::unique_ptr<File::GZ> zf;
+
         virtual void load (const Header&, size_t);
         virtual void unload (const Header&);
+
+        void load_on_demand (const Header&, size_t cache_size);
+        void read (const File::Entry& file, int64_t offset, uint8_t* data, size_t size);
     };
 
   }
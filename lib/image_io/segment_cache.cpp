@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "image_io/segment_cache.h"
+#include "exception.h"
+#include "mrtrix.h"
+
+namespace MR
+{
+  namespace ImageIO
+  {
+
+    SegmentCache::SegmentCache (size_t num_segments, size_t bytes_per_segment, size_t max_bytes, LoadFunc&& load_func) :
+      entries (num_segments),
+      segment_bytes (bytes_per_segment),
+      max_loaded (std::max<size_t> (1, max_bytes / bytes_per_segment)),
+      load_func (std::move (load_func)),
+      clock_hand (0)
+    {
+      DEBUG ("segment cache initialised with " + str(num_segments) + " segments of " + str(bytes_per_segment)
+          + " bytes, up to " + str(max_loaded) + " held in RAM");
+    }
+
+
+
+
+    uint8_t* SegmentCache::load (size_t n)
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      Entry& entry (entries[n]);
+      // may have been loaded by another thread in the meantime:
+      uint8_t* data = entry.data.load();
+      if (data)
+        return data;
+
+      while (loaded.size() >= max_loaded && evict_one());
+
+      if (spare)
+        entry.buffer = std::move (spare);
+      else {
+        entry.buffer.reset (new (std::nothrow) uint8_t [segment_bytes]);
+        if (!entry.buffer)
+          throw Exception ("failed to allocate memory for image segment");
+      }
+
+      load_func (n, entry.buffer.get());
+      loaded.push_back (n);
+      entry.referenced = true;
+      entry.data = entry.buffer.get();
+      return entry.buffer.get();
+    }
+
+
+
+
+    // must be called with the mutex held. Returns false if no segment
+    // could be evicted, since all are either in use or have been modified:
+    bool SegmentCache::evict_one ()
+    {
+      for (size_t i = 0; i < 2*loaded.size(); ++i, ++clock_hand) {
+        if (clock_hand >= loaded.size())
+          clock_hand = 0;
+        Entry& entry (entries[loaded[clock_hand]]);
+        if (entry.pins || entry.modified)
+          continue;
+        if (entry.referenced) {
+          entry.referenced = false;
+          continue;
+        }
+        // a reader may have pinned the segment since the check above: if
+        // so, it will either see the null pointer (and wait on the mutex to
+        // reload it), or will have seen the buffer, in which case it must
+        // be restored:
+        uint8_t* data = entry.data.exchange (nullptr);
+        if (entry.pins) {
+          entry.data = data;
+          continue;
+        }
+        spare = std::move (entry.buffer);
+        loaded[clock_hand] = loaded.back();
+        loaded.pop_back();
+        return true;
+      }
+      return false;
+    }
+
+  }
+}
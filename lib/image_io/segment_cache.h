@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __image_io_segment_cache_h__
+#define __image_io_segment_cache_h__
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "memory.h"
+#include "types.h"
+
+namespace MR
+{
+  namespace ImageIO
+  {
+
+    //! a bounded cache of image segments, populated on first access
+    /*! This is used by ImageIO handlers that cannot (or should not) hold the
+     * whole image in RAM, notably large compressed images. Each segment is
+     * loaded on demand using the function supplied to the constructor, and
+     * segments are evicted (using the 'clock' approximation to
+     * least-recently-used) whenever the total size of the loaded segments
+     * would exceed \a max_bytes.
+     *
+     * Access to a segment should be made through a SegmentCache::Lock
+     * object, which guarantees the segment will remain in RAM for its
+     * lifetime. This is safe to use concurrently from multiple threads.
+     * Segments that have been written to are never evicted. */
+    class SegmentCache
+    {
+      protected:
+        struct Entry;
+
+      public:
+        typedef std::function<void(size_t,uint8_t*)> LoadFunc;
+
+        SegmentCache (size_t num_segments, size_t bytes_per_segment, size_t max_bytes, LoadFunc&& load_func);
+
+        class Lock {
+          public:
+            FORCE_INLINE Lock (SegmentCache& cache, size_t n, bool modify = false) :
+              entry (cache.entries[n]) {
+                ++entry.pins;
+                if (!(data = entry.data.load()))
+                  data = cache.load (n);
+                if (!entry.referenced.load (std::memory_order_relaxed))
+                  entry.referenced.store (true, std::memory_order_relaxed);
+                if (modify && !entry.modified.load (std::memory_order_relaxed))
+                  entry.modified = true;
+              }
+            FORCE_INLINE ~Lock () { --entry.pins; }
+
+            FORCE_INLINE uint8_t* address () const { return data; }
+
+          protected:
+            Entry& entry;
+            uint8_t* data;
+        };
+
+        size_t num_segments () const { return entries.size(); }
+        size_t bytes_per_segment () const { return segment_bytes; }
+
+      protected:
+        struct Entry {
+          Entry () : data (nullptr), pins (0), referenced (false), modified (false) { }
+          std::atomic<uint8_t*> data;
+          std::atomic<size_t> pins;
+          std::atomic<bool> referenced, modified;
+          std::unique_ptr<uint8_t[]> buffer;
+        };
+
+        std::vector<Entry> entries;
+        const size_t segment_bytes, max_loaded;
+        LoadFunc load_func;
+        std::mutex mutex;
+        std::vector<size_t> loaded;
+        size_t clock_hand;
+        std::unique_ptr<uint8_t[]> spare;
+
+        uint8_t* load (size_t n);
+        bool evict_one ();
+    };
+
+  }
+}
+
+#endif
+
@@ -218,7 +218,12 @@ namespace MR
         }
 
         //! Read interpolated values from volumes along axis >= 3
-        /*! See file interp/base.h for details. */
+        /*! See file interp/base.h for details.
+         *
+         * The rows of the 8 neighbouring voxels are accessed in place, and
+         * combined in a single pass; where the volumes are contiguous in
+         * memory (as for images loaded using Image::with_direct_io (3)),
+         * this weighted sum is vectorised. */
         Eigen::Matrix<value_type, Eigen::Dynamic, 1> row (size_t axis) {
           if (Base<ImageType>::out_of_bounds) {
             Eigen::Matrix<value_type, Eigen::Dynamic, 1> out_of_bounds_row (ImageType::size(axis));
@@ -229,7 +234,8 @@ namespace MR
 
           ssize_t c[] = { ssize_t (std::floor (P[0])), ssize_t (std::floor (P[1])), ssize_t (std::floor (P[2])) };
 
-          Eigen::Matrix<value_type, Eigen::Dynamic, 8> coeff_matrix ( ImageType::size(3), 8 );
+          const value_type* rows[8];
+          ssize_t stride = 1;
 
           size_t i(0);
           for (ssize_t z = 0; z < 2; ++z) {
@@ -238,16 +244,33 @@ namespace MR
               ImageType::index(1) = clamp (c[1] + y, ImageType::size (1));
               for (ssize_t x = 0; x < 2; ++x) {
                 ImageType::index(0) = clamp (c[0] + x, ImageType::size (0));
-                coeff_matrix.col (i++) = ImageType::row (axis);
+                auto corner = ImageType::row (axis);
+                rows[i++] = corner.data();
+                stride = corner.innerStride();
               }
             }
           }
 
-          return coeff_matrix * factors;
+          Eigen::Matrix<value_type, Eigen::Dynamic, 1> result;
+          if (stride == 1)
+            weighted_sum<Eigen::InnerStride<1>> (rows, ImageType::size (axis), stride, result);
+          else
+            weighted_sum<Eigen::InnerStride<>> (rows, ImageType::size (axis), stride, result);
+          return result;
         }
 
       protected:
         Eigen::Matrix<coef_type, 8, 1> factors;
+
+        template <class StrideType>
+        FORCE_INLINE void weighted_sum (const value_type* const* rows, ssize_t size, ssize_t stride, Eigen::Matrix<value_type, Eigen::Dynamic, 1>& result) const {
+          typedef Eigen::Map<const Eigen::Matrix<value_type, Eigen::Dynamic, 1>, Eigen::Unaligned, StrideType> RowMap;
+          const StrideType s (stride);
+          result = RowMap (rows[0], size, s) * factors[0] + RowMap (rows[1], size, s) * factors[1]
+                 + RowMap (rows[2], size, s) * factors[2] + RowMap (rows[3], size, s) * factors[3]
+                 + RowMap (rows[4], size, s) * factors[4] + RowMap (rows[5], size, s) * factors[5]
+                 + RowMap (rows[6], size, s) * factors[6] + RowMap (rows[7], size, s) * factors[7];
+        }
     };
 
 
@@ -465,12 +465,20 @@ namespace MR
 #endif
 
       //! Precomputed Associated Legrendre Polynomials - used to speed up SH calculation
+      /*! In addition to the associated Legendre polynomials themselves, a
+       * table of the (scaled) polynomial for each SH coefficient is held
+       * for each elevation, so that value() reduces to the dot product of
+       * the SH coefficients (weighted by the relevant azimuthal factor) with
+       * the interpolated table entries, which the compiler can vectorise.
+       * This is only done for up to max_basis_size coefficients; beyond
+       * this, value() reverts to the less efficient direct computation. */
       template <typename ValueType> class PrecomputedAL
       {
         public:
           typedef ValueType value_type;
+          static constexpr int max_basis_size = 256;
 
-          PrecomputedAL () : lmax (0), ndir (0), nAL (0), inc (0.0) { }
+          PrecomputedAL () : lmax (0), ndir (0), nAL (0), nSH (0), inc (0.0) { }
           PrecomputedAL (int up_to_lmax, int num_dir = 512) {
             init (up_to_lmax, num_dir);
           }
@@ -499,6 +507,21 @@ namespace MR
                   p[index_mpos (l,m)] = SH_NON_M0_SCALE_FACTOR buf[l];
               }
             }
+
+            nSH = NforL (lmax);
+            basis.clear();
+            azimuth_index.clear();
+            if (nSH > max_basis_size)
+              return;
+            basis.resize (ndir*nSH);
+            azimuth_index.resize (nSH);
+            for (int l = 0; l <= lmax; l+=2) {
+              for (int m = -l; m <= l; m++) {
+                azimuth_index[index (l,m)] = lmax + m;
+                for (int n = 0; n < ndir; n++)
+                  basis[n*nSH + index (l,m)] = AL[n*nAL + index_mpos (l,std::abs (m))];
+              }
+            }
           }
 
           void set (PrecomputedFraction<ValueType>& f, const ValueType elevation) const {
@@ -548,6 +571,30 @@ namespace MR
               ValueType rxy = std::sqrt ( pow2(unit_dir[1]) + pow2(unit_dir[0]) );
               ValueType cp = (rxy) ? unit_dir[0]/rxy : 1.0;
               ValueType sp = (rxy) ? unit_dir[1]/rxy : 0.0;
+
+              if (basis.size()) {
+                // azimuthal factors: cos(m*phi) at lmax+m, sin(m*phi) at lmax-m:
+                Eigen::Matrix<ValueType,Eigen::Dynamic,1,0,max_basis_size> azimuthal (2*lmax+1);
+                azimuthal[lmax] = 1.0;
+                ValueType c0 (1.0), s0 (0.0);
+                for (int m = 1; m <= lmax; m++) {
+                  azimuthal[lmax+m] = c0 * cp - s0 * sp;
+                  azimuthal[lmax-m] = s0 * cp + c0 * sp;
+                  c0 = azimuthal[lmax+m];
+                  s0 = azimuthal[lmax-m];
+                }
+                Eigen::Matrix<ValueType,Eigen::Dynamic,1,0,max_basis_size> weighted (nSH);
+                for (int i = 0; i < nSH; i++)
+                  weighted[i] = azimuthal[azimuth_index[i]] * val[i];
+
+                typedef Eigen::Map<const Eigen::Matrix<ValueType,Eigen::Dynamic,1>> BasisRow;
+                const ValueType* row = basis.data() + ((f.p1 - AL.begin()) / nAL) * nSH;
+                ValueType v = BasisRow (row, nSH).dot (weighted);
+                if (f.f2)
+                  v = f.f1 * v + f.f2 * BasisRow (row + nSH, nSH).dot (weighted);
+                return v;
+              }
+
               ValueType v = 0.0;
               for (int l = 0; l <= lmax; l+=2)
                 v += get (f,l,0) * val[index (l,0)];
@@ -564,9 +611,10 @@ namespace MR
             }
 
         protected:
-          int lmax, ndir, nAL;
+          int lmax, ndir, nAL, nSH;
           ValueType inc;
-          std::vector<ValueType> AL;
+          std::vector<ValueType> AL, basis;
+          std::vector<int> azimuth_index;
       };
 
 
@@ -16,9 +16,12 @@
 #define __math_stats_glm_h__
 
 #include "types.h"
+#include "math/math.h"
 #include "math/least_squares.h"
 
 #define GLM_BATCH_SIZE 1024
+#define GLM_MAX_PERMUTATION_BLOCK_SIZE 32
+#define GLM_MAX_PERMUTATION_BLOCK_BYTES 67108864
 
 namespace MR
 {
@@ -137,7 +140,21 @@ namespace MR
 
       /** \addtogroup Statistics
       @{ */
-      /*! A class to compute t-statistics using a General Linear Model. */
+      /*! A class to compute t-statistics using a General Linear Model.
+       *
+       * The t-statistics are computed using the projection-matrix
+       * formulation of the GLM. Permuting the rows of the design matrix X
+       * using the permutation matrix P yields the pseudo-inverse
+       * pinv(X) P^T and the hat matrix P U U^T P^T, where U is an
+       * orthonormal basis for the column space of X. Hence, for the data y
+       * of each element, the effect of interest is y^T P w (with w =
+       * pinv(X)^T c for the scaled contrast c), and the squared norm of
+       * the residual is |y|^2 - |U^T P^T y|^2. These are obtained for a
+       * whole block of permutations in a single matrix product of the data
+       * with the row-permuted matrix [ w U ] for each permutation in the
+       * block. If the column space of X includes the constant vector, the
+       * data for each element are demeaned to limit the loss of precision
+       * in computing the residual. */
       class GLMTTest
       {
         public:
@@ -153,7 +170,20 @@ namespace MR
             X (design),
             scaled_contrasts (GLM::scale_contrasts (contrast, X, X.rows()-rank(X)).transpose())
           {
-            pinvX = Math::pinv (X.cast<double>()).template cast<float>();
+            const Eigen::MatrixXd Xd = X.cast<double>();
+            const Eigen::MatrixXd pinvXd = Math::pinv (Xd);
+
+            const size_t r = rank (Xd);
+            Eigen::JacobiSVD<Eigen::MatrixXd> svd (Xd, Eigen::ComputeThinU);
+            const Eigen::MatrixXd U = svd.matrixU().leftCols (r);
+            const Eigen::VectorXd w = pinvXd.transpose() * scaled_contrasts.col(0).cast<double>();
+            basis.resize (X.rows(), 1 + r);
+            basis.col(0) = w.cast<float>();
+            basis.rightCols (r) = U.cast<float>();
+
+            const Eigen::VectorXd ones = Eigen::VectorXd::Ones (X.rows());
+            demean = (U * (U.transpose() * ones) - ones).norm() < 1.0e-6 * std::sqrt (default_type (X.rows()));
+            mean_weight = w.sum();
           }
 
           /*! Compute the t-statistics
@@ -165,42 +195,87 @@ namespace MR
           void operator() (const std::vector<size_t>& perm_labelling, std::vector<float>& stats,
                            float& max_stat, float& min_stat) const
           {
-            stats.resize (y.rows(), 0.0);
-            Eigen::MatrixXf tvalues, betas, residuals, SX, pinvSX;
-
-            SX.resize (X.rows(), X.cols());
-            pinvSX.resize (pinvX.rows(), pinvX.cols());
-            for (ssize_t i = 0; i < X.rows(); ++i) {
-              SX.row(i) = X.row (perm_labelling[i]);
-              pinvSX.col(i) = pinvX.col (perm_labelling[i]);
-            }
+            std::vector<std::vector<float> > block_stats (1);
+            std::vector<float> block_max_stat, block_min_stat;
+            std::swap (block_stats[0], stats);
+            (*this) (std::vector<std::vector<size_t> > (1, perm_labelling), block_stats, block_max_stat, block_min_stat);
+            std::swap (block_stats[0], stats);
+            max_stat = std::max (max_stat, block_max_stat[0]);
+            min_stat = std::min (min_stat, block_min_stat[0]);
+          }
+
+          /*! Compute the t-statistics for a block of permutations
+          * @param perm_labellings the vectors used to shuffle the rows in the design matrix, one per permutation
+          * @param stats the vectors containing the output t-statistics, one per permutation
+          * @param max_stats the maximum t-statistic for each permutation (or zero if negative)
+          * @param min_stats the minimum t-statistic for each permutation (or zero if positive)
+          */
+          void operator() (const std::vector<std::vector<size_t> >& perm_labellings, std::vector<std::vector<float> >& stats,
+                           std::vector<float>& max_stats, std::vector<float>& min_stats) const
+          {
+            const size_t num_perms = perm_labellings.size();
+            const ssize_t stride = basis.cols();
 
-            pinvSX.transposeInPlace();
-            SX.transposeInPlace();
-            for (ssize_t i = 0; i < y.rows(); i += GLM_BATCH_SIZE) {
-              Eigen::MatrixXf tmp = y.block (i, 0, std::min (GLM_BATCH_SIZE, (int)(y.rows()-i)), y.cols());
-              GLM::ttest (tvalues, SX, pinvSX, tmp, scaled_contrasts, betas, residuals);
-              for (ssize_t n = 0; n < tvalues.rows(); ++n) {
-                float val = tvalues(n,0);
-                if (std::isfinite (val)) {
-                  if (val > max_stat)
-                    max_stat = val;
-                  if (val < min_stat)
-                    min_stat = val;
-                } else {
-                  val = float(0.0);
+            Eigen::MatrixXf permuted_basis (X.rows(), num_perms * stride);
+            for (size_t p = 0; p < num_perms; ++p)
+              for (ssize_t i = 0; i < X.rows(); ++i)
+                permuted_basis.block (i, p*stride, 1, stride) = basis.row (perm_labellings[p][i]);
+
+            stats.resize (num_perms);
+            for (auto& s : stats)
+              s.resize (y.rows());
+            max_stats.assign (num_perms, 0.0);
+            min_stats.assign (num_perms, 0.0);
+
+            // split the elements into near-equal batches, to avoid any small remainder:
+            const ssize_t num_batches = (y.rows() + GLM_BATCH_SIZE - 1) / GLM_BATCH_SIZE;
+            Eigen::MatrixXf data, projections;
+            Eigen::VectorXf means;
+            for (ssize_t b = 0; b < num_batches; ++b) {
+              const ssize_t first = y.rows() * b / num_batches;
+              data = y.middleRows (first, y.rows() * (b+1) / num_batches - first);
+              if (demean) {
+                means = data.rowwise().mean();
+                data.colwise() -= means;
+              }
+              projections.noalias() = data * permuted_basis;
+
+              for (ssize_t n = 0; n < data.rows(); ++n) {
+                const default_type sum_squares = data.row(n).squaredNorm();
+                const default_type offset = demean ? means[n] * mean_weight : 0.0;
+                for (size_t p = 0; p < num_perms; ++p) {
+                  default_type explained = 0.0;
+                  for (ssize_t j = 1; j < stride; ++j)
+                    explained += Math::pow2 (default_type (projections (n, p*stride + j)));
+                  float val = (projections (n, p*stride) + offset) / std::sqrt (sum_squares - explained);
+                  if (std::isfinite (val)) {
+                    if (val > max_stats[p])
+                      max_stats[p] = val;
+                    if (val < min_stats[p])
+                      min_stats[p] = val;
+                  } else {
+                    val = float(0.0);
+                  }
+                  stats[p][first+n] = val;
                 }
-                stats[i+n] = val;
               }
             }
           }
 
+          //! the number of permutations to process per call, such that the output statistics fit within a bounded amount of memory
+          size_t permutation_block_size () const {
+            const size_t bytes_per_permutation = std::max (size_t(1), size_t(y.rows()) * sizeof(float));
+            return std::max (size_t(1), std::min (size_t(GLM_MAX_PERMUTATION_BLOCK_SIZE), size_t(GLM_MAX_PERMUTATION_BLOCK_BYTES) / bytes_per_permutation));
+          }
+
           size_t num_subjects () const { return y.cols(); }
           size_t num_elements () const { return y.rows(); }
 
         protected:
           const Eigen::MatrixXf& y;
-          Eigen::MatrixXf X, pinvX, scaled_contrasts;
+          Eigen::MatrixXf X, scaled_contrasts, basis;
+          bool demean;
+          default_type mean_weight;
       };
       //! @}
 
@@ -48,10 +48,13 @@ namespace MR
       // Note that this function does not take into account grouping of subjects and therefore generated
       // permutations are not guaranteed to be unique wrt the computed test statistic.
       // If the number of subjects is large then the likelihood of generating duplicates is low.
+      // The shuffle functor is invoked on each candidate labelling to permute it in-place.
+      template <class ShuffleFunctor>
       inline void generate_permutations (const size_t num_perms,
                                          const size_t num_subjects,
                                          std::vector<std::vector<size_t> >& permutations,
-                                         bool include_default)
+                                         bool include_default,
+                                         ShuffleFunctor&& shuffle)
       {
         permutations.clear();
         std::vector<size_t> default_labelling (num_subjects);
@@ -65,13 +68,23 @@ namespace MR
         for (;p < num_perms; ++p) {
           std::vector<size_t> permuted_labelling (default_labelling);
           do {
-            std::random_shuffle (permuted_labelling.begin(), permuted_labelling.end());
+            shuffle (permuted_labelling);
           } while (is_duplicate_permutation (permuted_labelling, permutations));
           permutations.push_back (permuted_labelling);
         }
       }
 
 
+      inline void generate_permutations (const size_t num_perms,
+                                         const size_t num_subjects,
+                                         std::vector<std::vector<size_t> >& permutations,
+                                         bool include_default)
+      {
+        generate_permutations (num_perms, num_subjects, permutations, include_default,
+            [] (std::vector<size_t>& labelling) { std::random_shuffle (labelling.begin(), labelling.end()); });
+      }
+
+
       inline void statistic2pvalue (const Eigen::Matrix<value_type, Eigen::Dynamic, 1>& perm_dist,
                                     const std::vector<value_type>& stats,
                                     std::vector<value_type>& pvalues)
@@ -17,14 +17,41 @@
 #ifndef __mrtrix_thread_queue_h__
 #define __mrtrix_thread_queue_h__
 
+#include <atomic>
+#include <chrono>
 #include <stack>
 #include <condition_variable>
+#include <thread>
 
 #include "memory.h"
 #include "thread.h"
+#include "file/config.h"
 
 #define MRTRIX_QUEUE_DEFAULT_CAPACITY 128
 #define MRTRIX_QUEUE_DEFAULT_BATCH_SIZE 128
+#define MRTRIX_QUEUE_DEFAULT_MAX_BATCH_SIZE 4096
+
+// adaptive batching: the batch size is halved when a batch takes longer than
+// MRTRIX_QUEUE_ADAPTIVE_LATENCY_US microseconds to fill, and otherwise doubled
+// when the time taken to push it onto the queue exceeds this fraction of the
+// time taken to fill it:
+#define MRTRIX_QUEUE_ADAPTIVE_LATENCY_US 10000
+#define MRTRIX_QUEUE_ADAPTIVE_GROW_RATIO 0.05
+
+// number of attempts a thread will make to access a full or empty lock-free
+// queue (yielding in between) before going to sleep:
+#define MRTRIX_QUEUE_SPIN_COUNT 64
+// maximum time (in microseconds) a thread will sleep on a lock-free queue
+// before trying again:
+#define MRTRIX_QUEUE_SLEEP_US 500
+
+// whether the lock-free queue is used unless otherwise specified in the
+// config file:
+#ifdef MRTRIX_LOCKFREE_QUEUE
+# define MRTRIX_QUEUE_LOCKFREE_DEFAULT true
+#else
+# define MRTRIX_QUEUE_LOCKFREE_DEFAULT false
+#endif
 
 namespace MR
 {
@@ -41,8 +68,9 @@ namespace MR
       template <class Item> 
         class __Batch {
           public:
-            __Batch (size_t number) : num (number) { }
+            __Batch (size_t number, size_t maximum = 0) : num (number), max (maximum) { }
             size_t num;
+            size_t max; // non-zero for adaptive batching
         };
 
 
@@ -88,6 +116,104 @@ namespace MR
 
 
 
+    //* \cond skip
+
+    // a bounded lock-free multi-producer / multi-consumer queue of pointers,
+    // based on the design by D. Vyukov: each cell holds a sequence number
+    // that indicates whether it is ready to be written or read on the current
+    // pass through the buffer, so that producers and consumers only contend
+    // on a single atomic counter each.
+    template <class T>
+      class __RingBuffer
+      {
+        public:
+          __RingBuffer (size_t min_size) :
+            mask (size_for (min_size) - 1),
+            cells (new Cell [mask+1]),
+            enqueue_pos (0),
+            dequeue_pos (0) {
+              for (size_t n = 0; n <= mask; ++n)
+                cells[n].sequence.store (n, std::memory_order_relaxed);
+            }
+
+          //! push \a item onto the buffer, returning false if full
+          bool push (T* item) {
+            Cell* cell;
+            size_t pos = enqueue_pos.load (std::memory_order_relaxed);
+            while (true) {
+              cell = &cells[pos & mask];
+              const ssize_t diff = ssize_t (cell->sequence.load (std::memory_order_acquire)) - ssize_t (pos);
+              if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak (pos, pos+1, std::memory_order_relaxed))
+                  break;
+              }
+              else if (diff < 0)
+                return false;
+              else
+                pos = enqueue_pos.load (std::memory_order_relaxed);
+            }
+            cell->data = item;
+            cell->sequence.store (pos+1, std::memory_order_release);
+            return true;
+          }
+
+          //! pop \a item from the buffer, returning false if empty
+          bool pop (T*& item) {
+            Cell* cell;
+            size_t pos = dequeue_pos.load (std::memory_order_relaxed);
+            while (true) {
+              cell = &cells[pos & mask];
+              const ssize_t diff = ssize_t (cell->sequence.load (std::memory_order_acquire)) - ssize_t (pos+1);
+              if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak (pos, pos+1, std::memory_order_relaxed))
+                  break;
+              }
+              else if (diff < 0)
+                return false;
+              else
+                pos = dequeue_pos.load (std::memory_order_relaxed);
+            }
+            item = cell->data;
+            cell->sequence.store (pos+mask+1, std::memory_order_release);
+            return true;
+          }
+
+          //! the approximate number of items in the buffer
+          size_t size () const {
+            const size_t back = enqueue_pos.load (std::memory_order_relaxed);
+            const size_t front = dequeue_pos.load (std::memory_order_relaxed);
+            return back > front ? back - front : 0;
+          }
+
+        private:
+          class Cell {
+            public:
+              std::atomic<size_t> sequence;
+              T* data;
+          };
+
+          static size_t size_for (size_t min_size) {
+            size_t size = 2;
+            while (size < min_size)
+              size <<= 1;
+            return size;
+          }
+
+          const size_t mask;
+          std::unique_ptr<Cell[]> cells;
+          // keep producer & consumer counters on separate cache lines:
+          char pad0[64];
+          std::atomic<size_t> enqueue_pos;
+          char pad1[64];
+          std::atomic<size_t> dequeue_pos;
+          char pad2[64];
+      };
+
+    //* \endcond
+
+
+
+
     /** \addtogroup thread_classes
      * @{ */
 
@@ -346,6 +472,19 @@ namespace MR
      * pointers, and ensuring the Queue itself is responsible for all
      * allocation and deallocation of items as needed.
      *
+     * \section thread_queue_lockfree Lock-free operation
+     *
+     * By default, access to the queue is serialised using a mutex, with
+     * threads waiting on condition variables when the queue is full or
+     * empty. Alternatively, the queue can use a lock-free ring buffer, in
+     * which case threads only contend on atomic counters, and spin briefly
+     * (then sleep for short periods) when the queue is full or empty. This
+     * can reduce the synchronisation overhead substantially when many
+     * threads exchange small items. The lock-free backend is used if
+     * MRtrix3 is compiled with MRTRIX_LOCKFREE_QUEUE defined, or if the
+     * ThreadQueueLockFree config file option is set; it can also be
+     * requested explicitly on construction.
+     *
      * \sa Thread::run_queue()
      */
     template <class T> class Queue
@@ -358,29 +497,29 @@ namespace MR
          * queue already contains this number of items, the thread will block until
          * at least one item has been popped.  By default, the buffer size is
          * MRTRIX_QUEUE_DEFAULT_CAPACITY items.
+         * \param lockfree whether to use the lock-free backend (see
+         * \ref thread_queue_lockfree).
          */
-        Queue (const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
+        Queue (const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY, bool lockfree = use_lockfree()) :
           buffer (new T* [buffer_size]),
           front (buffer),
           back (buffer),
           capacity (buffer_size),
           writer_count (0),
           reader_count (0),
+          data_sleepers (0),
+          space_sleepers (0),
           name (description) {
           assert (capacity > 0);
+          if (lockfree) {
+            ring.reset (new __RingBuffer<T> (capacity));
+            free_items.reset (new __RingBuffer<T> (2*capacity));
+          }
         }
 
         //! needed for Thread::run_queue()
-        Queue (const T& /*item_type*/, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
-          buffer (new T* [buffer_size]),
-          front (buffer),
-          back (buffer),
-          capacity (buffer_size),
-          writer_count (0),
-          reader_count (0),
-          name (description) {
-          assert (capacity > 0);
-        }
+        Queue (const T& /*item_type*/, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY, bool lockfree = use_lockfree()) :
+          Queue (description, buffer_size, lockfree) { }
 
 
         ~Queue () {
@@ -527,7 +666,20 @@ namespace MR
           std::lock_guard<std::mutex> lock (mutex);
           std::cerr << "Thread::Queue \"" + name + "\": "
                     << writer_count << " writer" << (writer_count > 1 ? "s" : "") << ", "
-                    << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " << size() << "\n";
+                    << reader_count << " reader" << (reader_count > 1 ? "s" : "") << ", items waiting: " << size()
+                    << (ring ? " (lock-free)" : "") << "\n";
+        }
+
+        //! whether queues should use the lock-free backend by default
+        //CONF option: ThreadQueueLockFree
+        //CONF default: 0 (false)
+        //CONF A boolean value to indicate whether the queues used to pass
+        //CONF data between threads should use a lock-free ring buffer rather
+        //CONF than a mutex. This can reduce the synchronisation overhead
+        //CONF on systems with many cores.
+        static bool use_lockfree () {
+          static const bool value = File::Config::get_bool ("ThreadQueueLockFree", MRTRIX_QUEUE_LOCKFREE_DEFAULT);
+          return value;
         }
 
 
@@ -538,9 +690,11 @@ namespace MR
         T** front;
         T** back;
         size_t capacity;
-        size_t writer_count, reader_count;
+        std::atomic<size_t> writer_count, reader_count;
+        std::atomic<size_t> data_sleepers, space_sleepers;
         std::stack<T*,std::vector<T*> > item_stack;
         std::vector<std::unique_ptr<T>> items;
+        std::unique_ptr<__RingBuffer<T>> ring, free_items;
         std::string name;
 
         Queue (const Queue&) = delete;
@@ -580,6 +734,8 @@ namespace MR
           return (inc (back) == front);
         }
         FORCE_INLINE size_t size () const {
+          if (ring)
+            return ring->size();
           return ( (back < front ? back+capacity : back) - front);
         }
 
@@ -591,6 +747,8 @@ namespace MR
         }
 
         FORCE_INLINE bool push (T*& item) {
+          if (ring)
+            return push_lockfree (item);
           std::unique_lock<std::mutex> lock (mutex);
           more_space.wait (lock, [this]{ return !(full() && reader_count); });
           if (!reader_count) return false;
@@ -609,6 +767,8 @@ namespace MR
         }
 
         FORCE_INLINE bool pop (T*& item) {
+          if (ring)
+            return pop_lockfree (item);
           std::unique_lock<std::mutex> lock (mutex);
           if (item)
             item_stack.push (item);
@@ -627,6 +787,77 @@ namespace MR
           if (p >= buffer + capacity) p = buffer;
           return p;
         }
+
+
+        bool push_lockfree (T*& item) {
+          size_t attempt = 0;
+          while (true) {
+            if (!reader_count)
+              return false;
+            if (ring->push (item))
+              break;
+            wait (more_space, space_sleepers, attempt);
+          }
+          if (data_sleepers)
+            more_data.notify_one();
+          item = get_free_item();
+          return true;
+        }
+
+        bool pop_lockfree (T*& item) {
+          if (item)
+            recycle_item (item);
+          item = nullptr;
+          size_t attempt = 0;
+          while (!ring->pop (item)) {
+            // check again after seeing no writers, since the last writer
+            // may have pushed its final item in the meantime:
+            if (!writer_count) {
+              if (ring->pop (item))
+                break;
+              item = nullptr;
+              return false;
+            }
+            wait (more_data, data_sleepers, attempt);
+          }
+          if (space_sleepers)
+            more_space.notify_one();
+          return true;
+        }
+
+        // spin for a while, then sleep for short periods until notified:
+        void wait (std::condition_variable& condition, std::atomic<size_t>& sleepers, size_t& attempt) {
+          if (++attempt < MRTRIX_QUEUE_SPIN_COUNT) {
+            std::this_thread::yield();
+            return;
+          }
+          std::unique_lock<std::mutex> lock (mutex);
+          ++sleepers;
+          condition.wait_for (lock, std::chrono::microseconds (MRTRIX_QUEUE_SLEEP_US));
+          --sleepers;
+        }
+
+        T* get_free_item () {
+          T* item;
+          if (free_items->pop (item))
+            return item;
+          std::lock_guard<std::mutex> lock (mutex);
+          if (item_stack.size()) {
+            item = item_stack.top();
+            item_stack.pop();
+            return item;
+          }
+          item = new T;
+          items.push_back (std::unique_ptr<T> (item));
+          return item;
+        }
+
+        void recycle_item (T* item) {
+          if (free_items->push (item))
+            return;
+          std::lock_guard<std::mutex> lock (mutex);
+          item_stack.push (item);
+        }
     };
 
 
@@ -645,21 +876,24 @@ namespace MR
       public:
         Queue (const __Batch<T>& item_type, const std::string& description = "unnamed", size_t buffer_size = MRTRIX_QUEUE_DEFAULT_CAPACITY) :
           batch_queue (description, buffer_size),
-          batch_size (item_type.num) { }
+          batch_size (item_type.num),
+          max_batch_size (item_type.max) { }
 
 
         class Writer
         {
           public:
             Writer (Queue<__Batch<T>>& queue) : 
-              batch_writer (queue.batch_queue), batch_size (queue.batch_size) { }
+              batch_writer (queue.batch_queue), batch_size (queue.batch_size), max_batch_size (queue.max_batch_size) { }
 
             class Item
             {
               public:
                 Item (const Writer& writer) : 
-                  batch_item (writer.batch_writer), batch_size (writer.batch_size), n (0) { 
+                  batch_item (writer.batch_writer), batch_size (writer.batch_size), max_batch_size (writer.max_batch_size), n (0) { 
                     batch_item->resize (batch_size);
+                    if (max_batch_size)
+                      start = clock::now();
                 }
                 ~Item () {
                   if (n) {
@@ -669,7 +903,15 @@ namespace MR
                 }
                 FORCE_INLINE bool write () {
                   if (++n >= batch_size) {
-                    if (!batch_item.write()) 
+                    if (max_batch_size) {
+                      const auto filled = clock::now();
+                      if (!batch_item.write()) 
+                        return false;
+                      const auto pushed = clock::now();
+                      adapt (filled - start, pushed - filled);
+                      start = pushed;
+                    }
+                    else if (!batch_item.write()) 
                       return false;
                     n = 0;
                     batch_item->resize (batch_size);
@@ -683,14 +925,27 @@ namespace MR
                   return &((*batch_item)[n]);
                 }
               private:
+                typedef std::chrono::steady_clock clock;
                 typename BatchQueue::Writer::Item batch_item;
-                const size_t batch_size;
+                size_t batch_size;
+                const size_t max_batch_size;
                 size_t n;
+                clock::time_point start;
+
+                // shrink the batch if it takes too long to fill, to preserve
+                // load balancing downstream; otherwise grow it if pushing it
+                // onto the queue is costly relative to filling it:
+                void adapt (clock::duration filling, clock::duration pushing) {
+                  if (filling > std::chrono::microseconds (MRTRIX_QUEUE_ADAPTIVE_LATENCY_US))
+                    batch_size = std::max (batch_size/2, size_t(1));
+                  else if (pushing > filling * MRTRIX_QUEUE_ADAPTIVE_GROW_RATIO)
+                    batch_size = std::min (2*batch_size, max_batch_size);
+                }
             };
 
           private:
             typename BatchQueue::Writer batch_writer;
-            const size_t batch_size;
+            const size_t batch_size, max_batch_size;
         };
 
 
@@ -736,7 +991,7 @@ namespace MR
 
       private:
         BatchQueue batch_queue;
-        const size_t batch_size;
+        const size_t batch_size, max_batch_size;
     };
 
 
@@ -837,6 +1092,25 @@ namespace MR
         return __Batch<Item> (number);
       }
 
+    //! used to request batched processing of items, with adaptive batch size
+    /*! This function is used in combination with Thread::run_queue to request
+     * that the items \a object be processed in batches, as for
+     * Thread::batch(). In this case however, each thread writing to the
+     * queue will adjust the size of its batches as processing proceeds,
+     * starting from \a initial and up to \a maximum items, based on the
+     * time taken to push each batch onto the queue relative to the time
+     * taken to fill it. This reduces the synchronisation overhead when
+     * items are cheap to produce, while preserving load balancing when
+     * they are expensive. The order of items from any one thread is
+     * preserved.
+     * \sa Thread::run_queue() */
+    template <class Item>
+      inline __Batch<Item> adaptive_batch (const Item& object, size_t initial = 1, size_t maximum = MRTRIX_QUEUE_DEFAULT_MAX_BATCH_SIZE) 
+      {
+        assert (initial > 0 && maximum >= initial);
+        return __Batch<Item> (initial, maximum);
+      }
+
 
 
 
@@ -1019,6 +1293,15 @@ namespace MR
      * }
      * \endcode
      *
+     * If the cost of processing each item is not known in advance, or
+     * varies widely between uses, Thread::adaptive_batch() can be used
+     * instead, in which case the batch size is adjusted at runtime:
+     *
+     * \code 
+     *   // as above, with batch size adjusted between 1 and 4096 items:
+     *   Thread::run_queue (source, Thread::adaptive_batch (size_t()), Thread::multi (sink));
+     * \endcode
+     *
      * Obviously, Thread::multi() and Thread::batch() can be used in any
      * combination to perform the operations required. 
      */
@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __dwi_denoise_h__
+#define __dwi_denoise_h__
+
+#include <mutex>
+#include <Eigen/Dense>
+#include <Eigen/Eigenvalues>
+
+#include "image.h"
+#include "algo/loop.h"
+#include "algo/threaded_loop.h"
+
+
+namespace MR {
+  namespace DWI {
+    namespace Denoise {
+
+      typedef float value_type;
+
+
+
+      //! the DWI data, preloaded into a contiguous voxel-major buffer
+      /*! Each column of \c values holds all volumes of one voxel. The grid is
+       * padded with zeros by the half-extent of the denoising window along
+       * each spatial axis, so that the window around any voxel within the
+       * image can be addressed without bounds checks. The image must have
+       * been opened using Image::with_direct_io(3). */
+      class Data
+      {
+        public:
+          template <class ImageType>
+            Data (ImageType& dwi, const std::array<ssize_t,3>& half_extent) :
+              half_extent (half_extent),
+              dim {{ dwi.size(0), dwi.size(1), dwi.size(2) }},
+              stride {{ 1, dim[0] + 2*half_extent[0], (dim[0] + 2*half_extent[0]) * (dim[1] + 2*half_extent[1]) }},
+              values (Eigen::MatrixXf::Zero (dwi.size(3), stride[2] * (dim[2] + 2*half_extent[2]))) {
+                ThreadedLoop ("preloading DWI data", dwi, 0, 3).run ([&] (ImageType& in) {
+                    values.col (index (in.index(0), in.index(1), in.index(2))) = in.row(3).template cast<float>();
+                    }, dwi);
+              }
+
+          //! the column of \c values holding voxel [ \a x \a y \a z ]
+          /*! this is valid for positions up to the half-extent outside the image */
+          size_t index (ssize_t x, ssize_t y, ssize_t z) const {
+            return (x + half_extent[0]) + (y + half_extent[1]) * stride[1] + (z + half_extent[2]) * stride[2];
+          }
+
+          const std::array<ssize_t,3> half_extent, dim, stride;
+          Eigen::MatrixXf values;
+      };
+
+
+
+
+      //! accumulate the denoised patches into a weighted average per voxel
+      class Aggregator
+      {
+        public:
+          Aggregator (const Data& data) :
+            data (data),
+            values (Eigen::MatrixXf::Zero (data.values.rows(), data.values.cols())),
+            weights (Eigen::VectorXf::Zero (data.values.cols())),
+            noise (Eigen::VectorXf::Zero (data.values.cols())),
+            noise_weights (Eigen::VectorXf::Zero (data.values.cols())) { }
+
+          //! add the denoised patch \a X, whose columns correspond to voxels \a index of the Data
+          void add (const std::vector<size_t>& index, const Eigen::MatrixXf& X, float weight, double sigma2) {
+            std::lock_guard<std::mutex> lock (mutex);
+            for (size_t k = 0; k < index.size(); ++k) {
+              values.col (index[k]) += weight * X.col(k);
+              weights[index[k]] += weight;
+              if (std::isfinite (sigma2)) {
+                noise[index[k]] += weight * std::sqrt (sigma2);
+                noise_weights[index[k]] += weight;
+              }
+            }
+          }
+
+          //! write the aggregated results (noise map only if \a noise_out is valid)
+          template <class ImageType>
+            void write (ImageType& out, ImageType& noise_out, Image<bool>& mask) const {
+              ThreadedLoop ("writing aggregated denoised data", out, 0, 3).run ([&] (ImageType& dwi) {
+                  if (mask.valid()) {
+                    Image<bool> m (mask);
+                    assign_pos_of (dwi, 0, 3).to (m);
+                    if (!m.value())
+                      return;
+                  }
+                  const size_t i = data.index (dwi.index(0), dwi.index(1), dwi.index(2));
+                  if (weights[i] > 0.0f) {
+                    for (auto l = Loop (3) (dwi); l; ++l)
+                      dwi.value() = values (ssize_t (dwi.index(3)), i) / weights[i];
+                  }
+                  if (noise_out.valid()) {
+                    ImageType n (noise_out);
+                    assign_pos_of (dwi, 0, 3).to (n);
+                    n.value() = noise_weights[i] > 0.0f ? noise[i] / noise_weights[i] : value_type (NaN);
+                  }
+                  }, out);
+            }
+
+        protected:
+          const Data& data;
+          Eigen::MatrixXf values;
+          Eigen::VectorXf weights, noise, noise_weights;
+          std::mutex mutex;
+      };
+
+
+
+
+
+      //! MP-PCA denoising of one row of voxels along the x axis
+      /*! This functor is intended to be used with a ThreadedLoop over axes 1
+       * & 2 of the image (via ThreadedLoopRunOuter::run_outer()), and
+       * processes all voxels in the row along axis 0 in turn.
+       *
+       * The patch matrix \c X is held in circular order along axis 0: the
+       * columns for the slab of the window at position \a x are stored in
+       * block <tt>x mod extent[0]</tt>. As the window slides along the row,
+       * only the slabs entering the window need to be loaded, and the Gram
+       * matrix is updated incrementally: by rank-updates of \f$ XX^T \f$
+       * (when \a m <= \a n), or by recomputing only the rows & columns of
+       * \f$ X^TX \f$ for the entering slabs (when \a m > \a n). The Gram
+       * matrix is recomputed in full at the start of each row, or whenever
+       * the window moves too far for an update to be worthwhile. Since the
+       * eigendecomposition is invariant to a symmetric permutation of the
+       * Gram matrix, the circular ordering does not otherwise affect the
+       * result.
+       *
+       * Only the eigenvalues are required to determine the Marchenko-Pastur
+       * threshold, and only the eigenvectors of the (typically few) signal
+       * components are needed for the reconstruction; these are computed by
+       * inverse iteration on the tridiagonalised Gram matrix, rather than
+       * via a full eigendecomposition.
+       *
+       * If \a spacing is provided, the window is only centred on voxels
+       * lying on a grid of that spacing, all voxels of each patch are
+       * denoised, and the results are passed to the \a aggregator to be
+       * averaged across patches. */
+      template <class ImageType>
+        class DenoisingFunctor
+        {
+          public:
+            DenoisingFunctor (const Data& data, const std::vector<int>& extent, Image<bool>& mask,
+                ImageType& out, ImageType& noise, Aggregator* aggregator = nullptr,
+                const std::vector<int>& spacing = { 1, 1, 1 }) :
+              data (data),
+              extent {{ extent[0], extent[1], extent[2] }},
+              half {{ extent[0]/2, extent[1]/2, extent[2]/2 }},
+              spacing {{ spacing[0], spacing[1], spacing[2] }},
+              slab (extent[1]*extent[2]),
+              m (data.values.rows()),
+              n (extent[0]*extent[1]*extent[2]),
+              r (std::min (m, n)),
+              X (m, n),
+              XtX (r, r),
+              gram (r, r),
+              tri (r),
+              eig (r),
+              index (n),
+              mask (mask),
+              out (out),
+              noise (noise),
+              aggregator (aggregator) { }
+
+            void operator() (const Iterator& pos)
+            {
+              const ssize_t y = pos.index(1), z = pos.index(2);
+              if (y % spacing[1] || z % spacing[2])
+                return;
+
+              ssize_t last_x = -1;
+              for (ssize_t x = 0; x < data.dim[0]; x += spacing[0]) {
+                if (!in_mask (x, y, z))
+                  continue;
+
+                load_data (x, y, z, last_x);
+                last_x = x;
+
+                const ssize_t cutoff_p = threshold();
+
+                if (cutoff_p > 0)
+                  signal_eigenvectors (r-cutoff_p);
+
+                if (aggregator) {
+                  if (cutoff_p > 0) {
+                    // recombine data using only eigenvectors above threshold:
+                    if (m <= n)
+                      X_out.noalias() = V * (V.transpose() * X);
+                    else
+                      X_out.noalias() = (X * V) * V.transpose();
+                  }
+                  else
+                    X_out = X;
+                  // weight each patch according to the number of components retained:
+                  aggregator->add (index, X_out, 1.0f / (1.0f + r - cutoff_p), sigma2);
+                }
+                else {
+                  const ssize_t c = centre();
+                  if (cutoff_p > 0) {
+                    if (m <= n)
+                      x_out.noalias() = V * (V.transpose() * X.col(c));
+                    else
+                      x_out.noalias() = X * (V * V.row(c).transpose());
+                  }
+                  else
+                    x_out = X.col(c);
+
+                  // Store output
+                  out.index(0) = x; out.index(1) = y; out.index(2) = z;
+                  for (auto l = Loop (3) (out); l; ++l)
+                    out.value() = x_out[ssize_t (out.index(3))];
+
+                  // store noise map if requested:
+                  if (noise.valid()) {
+                    noise.index(0) = x; noise.index(1) = y; noise.index(2) = z;
+                    noise.value() = value_type (std::sqrt (sigma2));
+                  }
+                }
+              }
+            }
+
+
+          protected:
+            const Data& data;
+            const std::array<ssize_t,3> extent, half, spacing;
+            const ssize_t slab, m, n, r;
+            Eigen::MatrixXf X, X_out, XtX, V;
+            Eigen::MatrixXd gram, Y;
+            Eigen::VectorXf x_out;
+            Eigen::VectorXd diag, subdiag, lu_diag, lu_upper, lu_upper2, lu_lower, y;
+            std::vector<bool> lu_swap;
+            Eigen::Tridiagonalization<Eigen::MatrixXf> tri;
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig;
+            std::vector<size_t> index;
+            ssize_t current_x;
+            double sigma2;
+            Image<bool> mask;
+            ImageType out, noise;
+            Aggregator* aggregator;
+
+
+            bool in_mask (ssize_t x, ssize_t y, ssize_t z)
+            {
+              if (!mask.valid())
+                return true;
+              if (!aggregator) {
+                mask.index(0) = x; mask.index(1) = y; mask.index(2) = z;
+                return mask.value();
+              }
+              // when aggregating, process any patch that overlaps the mask:
+              for (mask.index(2) = std::max<ssize_t> (z-half[2], 0); mask.index(2) <= std::min (z+half[2], data.dim[2]-1); ++mask.index(2))
+                for (mask.index(1) = std::max<ssize_t> (y-half[1], 0); mask.index(1) <= std::min (y+half[1], data.dim[1]-1); ++mask.index(1))
+                  for (mask.index(0) = std::max<ssize_t> (x-half[0], 0); mask.index(0) <= std::min (x+half[0], data.dim[0]-1); ++mask.index(0))
+                    if (mask.value())
+                      return true;
+              return false;
+            }
+
+
+            // the block of columns of X holding the slab at position x:
+            ssize_t block (ssize_t x) const { return ((x + half[0]) % extent[0]) * slab; }
+
+            // the column of X holding the centre voxel of the current window:
+            ssize_t centre () const { return block (current_x) + half[2]*extent[1] + half[1]; }
+
+
+            void load_slab (ssize_t x, ssize_t y, ssize_t z)
+            {
+              ssize_t k = block (x);
+              for (ssize_t dz = -half[2]; dz <= half[2]; ++dz) {
+                for (ssize_t dy = -half[1]; dy <= half[1]; ++dy, ++k) {
+                  index[k] = data.index (x, y+dy, z+dz);
+                  X.col(k) = data.values.col (index[k]);
+                }
+              }
+            }
+
+
+            // load data in local window, and update Gram matrix:
+            void load_data (ssize_t x, ssize_t y, ssize_t z, ssize_t last_x)
+            {
+              current_x = x;
+              const ssize_t shift = x - last_x;
+              const bool update = last_x >= 0 && ( m <= n ? 2*shift < extent[0] : shift < extent[0] );
+
+              if (!update) {
+                for (ssize_t dx = -half[0]; dx <= half[0]; ++dx)
+                  load_slab (x+dx, y, z);
+                const Eigen::MatrixXd Xd = X.cast<double>();
+                if (m <= n)
+                  gram.template triangularView<Eigen::Lower>() = Xd * Xd.transpose();
+                else
+                  gram.template triangularView<Eigen::Lower>() = Xd.transpose() * Xd;
+                return;
+              }
+
+              for (ssize_t xin = last_x + half[0] + 1; xin <= x + half[0]; ++xin) {
+                const ssize_t b = block (xin);
+                if (m <= n) {
+                  gram.template selfadjointView<Eigen::Lower>().rankUpdate (X.middleCols (b, slab).template cast<double>(), -1.0);
+                  load_slab (xin, y, z);
+                  gram.template selfadjointView<Eigen::Lower>().rankUpdate (X.middleCols (b, slab).template cast<double>(), 1.0);
+                }
+                else {
+                  load_slab (xin, y, z);
+                  const Eigen::MatrixXd S = (X.transpose() * X.middleCols (b, slab)).template cast<double>();
+                  gram.middleCols (b, slab) = S;
+                  gram.middleRows (b, slab) = S.transpose();
+                }
+              }
+            }
+
+
+            // compute eigendecomposition and Marchenko-Pastur optimal threshold:
+            ssize_t threshold ()
+            {
+              XtX.template triangularView<Eigen::Lower>() = gram.template cast<float>();
+              // only the eigenvalues are needed at this stage; the eigenvectors
+              // are computed for the signal components only, once these are known:
+              tri.compute (XtX);
+              eig.computeFromTridiagonal (tri.diagonal(), tri.subDiagonal(), Eigen::EigenvaluesOnly);
+              // eigenvalues provide squared singular values:
+              const Eigen::VectorXf& s = eig.eigenvalues();
+
+              const double lam_r = s[0] / n;
+              double clam = 0.0;
+              sigma2 = NaN;
+              ssize_t cutoff_p = 0;
+              for (ssize_t p = 0; p < r; ++p) {
+                double lam = s[p] / n;
+                clam += lam;
+                double gam = double(m-r+p+1) / double(n);
+                double sigsq1 = clam / (p+1) / std::max (gam, 1.0);
+                double sigsq2 = (lam - lam_r) / 4 / std::sqrt(gam);
+                // sigsq2 > sigsq1 if signal else noise
+                if (sigsq2 < sigsq1) {
+                  sigma2 = sigsq1;
+                  cutoff_p = p+1;
+                }
+              }
+              return cutoff_p;
+            }
+
+
+            // compute the eigenvectors for the p largest eigenvalues into V, by
+            // inverse iteration on the tridiagonal matrix followed by the
+            // back-transformation. This is much cheaper than computing all
+            // eigenvectors when only few signal components are retained.
+            void signal_eigenvectors (ssize_t p)
+            {
+              diag = tri.diagonal().template cast<double>();
+              subdiag = tri.subDiagonal().template cast<double>();
+              const double norm = diag.cwiseAbs().maxCoeff() + (r > 1 ? 2.0 * subdiag.cwiseAbs().maxCoeff() : 0.0);
+              const double tiny = std::max (norm, 1.0) * std::numeric_limits<float>::epsilon();
+
+              Y.resize (r, p);
+              for (ssize_t j = 0; j < p; ++j) {
+                factorise (eig.eigenvalues()[r-p+j], tiny);
+                for (ssize_t i = 0; i < r; ++i)
+                  y[i] = 1.0 + 0.1 * ((i*(j+3)) % 7);
+                for (size_t iter = 0; iter < 3; ++iter) {
+                  solve();
+                  // keep orthogonal to the eigenvectors of any (near-)degenerate eigenvalues:
+                  y -= Y.leftCols (j) * (Y.leftCols (j).transpose() * y);
+                  y.normalize();
+                }
+                Y.col (j) = y;
+              }
+
+              V = tri.matrixQ() * Y.template cast<float>();
+            }
+
+
+            // LU decomposition with partial pivoting of the tridiagonal
+            // matrix, shifted by -lambda (as in LAPACK's dgttrf):
+            void factorise (double lambda, double tiny)
+            {
+              lu_diag = diag.array() - lambda;
+              lu_upper = subdiag;
+              lu_lower = subdiag;
+              lu_upper2 = Eigen::VectorXd::Zero (r);
+              lu_swap.assign (r, false);
+              y.resize (r);
+              for (ssize_t i = 0; i < r-1; ++i) {
+                if (std::abs (lu_diag[i]) >= std::abs (lu_lower[i])) {
+                  if (lu_diag[i] == 0.0)
+                    lu_diag[i] = tiny;
+                  lu_lower[i] /= lu_diag[i];
+                  lu_diag[i+1] -= lu_lower[i] * lu_upper[i];
+                }
+                else {
+                  const double fact = lu_diag[i] / lu_lower[i];
+                  lu_diag[i] = lu_lower[i];
+                  lu_lower[i] = fact;
+                  const double temp = lu_upper[i];
+                  lu_upper[i] = lu_diag[i+1];
+                  lu_diag[i+1] = temp - fact * lu_diag[i+1];
+                  if (i < r-2) {
+                    lu_upper2[i] = lu_upper[i+1];
+                    lu_upper[i+1] *= -fact;
+                  }
+                  lu_swap[i] = true;
+                }
+              }
+              for (ssize_t i = 0; i < r; ++i)
+                if (std::abs (lu_diag[i]) < tiny)
+                  lu_diag[i] = lu_diag[i] < 0.0 ? -tiny : tiny;
+            }
+
+
+            // solve in place for y using the factorisation above:
+            void solve ()
+            {
+              for (ssize_t i = 0; i < r-1; ++i) {
+                if (lu_swap[i]) {
+                  const double temp = y[i];
+                  y[i] = y[i+1];
+                  y[i+1] = temp - lu_lower[i] * y[i];
+                }
+                else
+                  y[i+1] -= lu_lower[i] * y[i];
+              }
+              y[r-1] /= lu_diag[r-1];
+              if (r > 1)
+                y[r-2] = (y[r-2] - lu_upper[r-2] * y[r-1]) / lu_diag[r-2];
+              for (ssize_t i = r-3; i >= 0; --i)
+                y[i] = (y[i] - lu_upper[i] * y[i+1] - lu_upper2[i] * y[i+2]) / lu_diag[i];
+            }
+
+        };
+
+
+    }
+  }
+}
+
+#endif
@@ -93,7 +93,7 @@ namespace MR
 
         protected:
           std::string tck_file_path;
-          std::vector<TrackContribution*> contributions;
+          TrackContributions contributions;
 
           using Fixel_map<Fixel>::accessor;
           using Fixel_map<Fixel>::begin;
@@ -131,13 +131,15 @@ namespace MR
           class FixelRemapper
           {
             public:
-              FixelRemapper (Model& i, std::vector<size_t>& r) :
+              FixelRemapper (Model& i, std::vector<size_t>& r, TrackContributions& c) :
                 master   (i),
-                remapper (r) { }
+                remapper (r),
+                new_contributions (c) { }
               bool operator() (const TrackIndexRange&);
             private:
               Model& master;
               std::vector<size_t>& remapper;
+              TrackContributions& new_contributions;
           };
 
       };
@@ -147,15 +149,7 @@ namespace MR
 
 
       template <class Fixel>
-      Model<Fixel>::~Model ()
-      {
-        for (std::vector<TrackContribution*>::iterator i = contributions.begin(); i != contributions.end(); ++i) {
-          if (*i) {
-            delete *i;
-            *i = nullptr;
-          }
-        }
-      }
+      Model<Fixel>::~Model () { }
 
 
 
@@ -170,7 +164,7 @@ namespace MR
         if (!count)
           throw Exception ("Cannot map streamlines: track file " + Path::basename(path) + " is empty");
 
-        contributions.assign (count, nullptr);
+        contributions.assign (count);
 
         {
           Mapping::TrackLoader loader (file, count);
@@ -186,10 +180,10 @@ namespace MR
               Thread::multi (receiver));
         }
 
-        if (!contributions.back()) {
+        if (!contributions.exists (contributions.size() - 1)) {
           track_t num_tracks = 0, max_index = 0;
           for (track_t i = 0; i != contributions.size(); ++i) {
-            if (contributions[i]) {
+            if (contributions.exists (i)) {
               ++num_tracks;
               max_index = std::max (max_index, i);
             }
@@ -200,6 +194,7 @@ namespace MR
 
         tck_file_path = path;
 
+        INFO ("Memory used to store streamline contributions: " + str (contributions.memory_usage() / (1024*1024)) + " MB");
         INFO ("Proportionality coefficient after streamline mapping is " + str (mu()));
       }
 
@@ -252,9 +247,12 @@ namespace MR
 
         fixels.swap (new_fixels);
 
+        TrackContributions new_contributions;
+        new_contributions.assign (num_tracks());
         TrackIndexRangeWriter writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks(), "Removing excluded fixels");
-        FixelRemapper remapper (*this, fixel_index_mapping);
+        FixelRemapper remapper (*this, fixel_index_mapping, new_contributions);
         Thread::run_queue (writer, TrackIndexRange(), Thread::multi (remapper));
+        contributions.swap (new_contributions);
 
         TD_sum = 0.0;
         for (typename std::vector<Fixel>::const_iterator i = fixels.begin(); i != fixels.end(); ++i)
@@ -282,9 +280,9 @@ namespace MR
         VAR (sum_from_fixels);
         VAR (sum_from_fixels_weighted);
         double sum_from_tracks = 0.0;
-        for (std::vector<TrackContribution*>::const_iterator i = contributions.begin(); i != contributions.end(); ++i) {
-          if (*i)
-            sum_from_tracks += (*i)->get_total_contribution();
+        for (track_t i = 0; i != contributions.size(); ++i) {
+          if (contributions.exists (i))
+            sum_from_tracks += contributions[i].get_total_contribution();
         }
         VAR (sum_from_tracks);
       }
@@ -303,7 +301,7 @@ namespace MR
         ProgressBar progress ("Writing non-contributing streamlines output file", contributions.size());
         track_t tck_counter = 0;
         while (reader (tck) && tck_counter < contributions.size()) {
-          if (contributions[tck_counter] && !contributions[tck_counter++]->get_total_contribution())
+          if (contributions.exists (tck_counter) && !contributions[tck_counter++].get_total_contribution())
             writer (tck);
           else
             writer (null_tck);
@@ -336,7 +334,7 @@ namespace MR
 
         if (in.index >= master.contributions.size())
           throw Exception ("Received mapped streamline beyond the expected number of streamlines (run tckfixcount on your .tck file!)");
-        if (master.contributions[in.index])
+        if (master.contributions.exists (in.index))
           throw Exception ("FIXME: Same streamline has been mapped multiple times! (?)");
 
         try {
@@ -359,7 +357,7 @@ namespace MR
             }
           }
 
-          master.contributions[in.index] = new TrackContribution (masked_contributions, total_contribution, total_length);
+          master.contributions.set (in.index, masked_contributions, total_contribution, total_length);
 
           TD_sum += total_contribution;
           for (std::vector<Track_fixel_contribution>::const_iterator i = masked_contributions.begin(); i != masked_contributions.end(); ++i)
@@ -381,20 +379,18 @@ namespace MR
       bool Model<Fixel>::FixelRemapper::operator() (const TrackIndexRange& in)
       {
         for (track_t track_index = in.first; track_index != in.second; ++track_index) {
-          if (master.contributions[track_index]) {
-            TrackContribution& this_cont (*master.contributions[track_index]);
+          if (master.contributions.exists (track_index)) {
+            const TrackContribution this_cont (master.contributions[track_index]);
             std::vector<Track_fixel_contribution> new_cont;
             double total_contribution = 0.0;
-            for (size_t i = 0; i != this_cont.dim(); ++i) {
-              const size_t new_index = remapper[this_cont[i].get_fixel_index()];
+            for (const auto& c : this_cont) {
+              const size_t new_index = remapper[c.get_fixel_index()];
               if (new_index) {
-                new_cont.push_back (Track_fixel_contribution (new_index, this_cont[i].get_length()));
-                total_contribution += this_cont[i].get_length() * master[new_index].get_weight();
+                new_cont.push_back (Track_fixel_contribution (new_index, c.get_length()));
+                total_contribution += c.get_length() * master[new_index].get_weight();
               }
             }
-            TrackContribution* new_contribution = new TrackContribution (new_cont, total_contribution, this_cont.get_total_length());
-            delete master.contributions[track_index];
-            master.contributions[track_index] = new_contribution;
+            new_contributions.set (track_index, new_cont, total_contribution, this_cont.get_total_length());
           }
         }
         return true;
@@ -13,10 +13,14 @@
  * 
  */
 
+#include <atomic>
+#include <numeric>
+
 #include "dwi/tractography/SIFT/sifter.h"
 
 #include "progressbar.h"
 #include "memory.h"
+#include "thread.h"
 #include "timer.h"
 
 #include "algo/loop.h"
@@ -58,11 +62,11 @@ namespace MR
         double sum_contributing_length = 0.0, sum_noncontributing_length = 0.0;
         std::vector<track_t> noncontributing_indices;
         for (track_t i = 0; i != contributions.size(); ++i) {
-          if (contributions[i]) {
-            if (contributions[i]->get_total_contribution()) {
-              sum_contributing_length    += contributions[i]->get_total_length();
+          if (contributions.exists (i)) {
+            if (contributions[i].get_total_contribution()) {
+              sum_contributing_length    += contributions[i].get_total_length();
             } else {
-              sum_noncontributing_length += contributions[i]->get_total_length();
+              sum_noncontributing_length += contributions[i].get_total_length();
               noncontributing_indices.push_back (i);
             }
           }
@@ -78,6 +82,42 @@ namespace MR
           throw Exception ("Error assigning memory for SIFT gradient vector");
         }
 
+        // For batched filtering, construct an inverted index from each fixel to the streamlines traversing it,
+        //   such that only the gradients of those streamlines affected by the removals performed in one
+        //   iteration need to be re-calculated in the next
+        const bool batched = batch_size > 1;
+        std::vector<size_t> fixel_track_offsets, fixel_track_ends;
+        std::vector<track_t> fixel_tracks, stale_tracks;
+        std::vector<bool> fixel_modified, track_stale;
+        std::vector<Cost_fn_gradient_sort> track_gradients;
+        std::unique_ptr<CandidateBatch> batch;
+        bool recalculate_all = true;
+        double mu_at_full_recalculation = 0.0;
+        if (batched) {
+          fixel_track_offsets.assign (fixels.size() + 1, 0);
+          for (track_t i = 0; i != contributions.size(); ++i) {
+            if (contributions.exists (i)) {
+              for (const auto& c : contributions[i])
+                ++fixel_track_offsets[c.get_fixel_index() + 1];
+            }
+          }
+          std::partial_sum (fixel_track_offsets.begin(), fixel_track_offsets.end(), fixel_track_offsets.begin());
+          fixel_tracks.resize (fixel_track_offsets.back());
+          std::vector<size_t> position (fixel_track_offsets.begin(), fixel_track_offsets.end() - 1);
+          for (track_t i = 0; i != contributions.size(); ++i) {
+            if (contributions.exists (i)) {
+              for (const auto& c : contributions[i])
+                fixel_tracks[position[c.get_fixel_index()]++] = i;
+            }
+          }
+          fixel_track_ends.assign (fixel_track_offsets.begin() + 1, fixel_track_offsets.end());
+          INFO ("Fixel-streamline inverted index for batched filtering requires " + str ((fixel_tracks.size() * sizeof (track_t) + 2 * fixel_track_offsets.size() * sizeof (size_t)) / 1048576) + " MB");
+          fixel_modified.assign (fixels.size(), false);
+          track_stale.assign (num_tracks(), false);
+          track_gradients = gradient_vector;
+          batch.reset (new CandidateBatch (*this, batch_size));
+        }
+
         unsigned int tracks_remaining = num_tracks();
 
         if (tracks_remaining < term_number)
@@ -110,9 +150,73 @@ namespace MR
           const double current_roc_cf = calc_roc_cost_function();
 
 
-          TrackIndexRangeWriter range_writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks());
-          TrackGradientCalculator gradient_calculator (*this, gradient_vector, current_mu, current_roc_cf);
-          Thread::run_queue (range_writer, TrackIndexRange(), Thread::multi (gradient_calculator));
+          bool gradients_exact = true;
+          if (batched) {
+
+            // Gradients of streamlines that do not traverse any modified fixel are only affected by the
+            //   change in mu; these are re-used until mu has drifted beyond tolerance, or until filtering
+            //   appears to have converged based on inexact gradients
+            if (!recalculate_all && std::abs (current_mu - mu_at_full_recalculation) < SIFT_BATCH_MU_TOLERANCE * mu_at_full_recalculation) {
+              size_t workload = 0;
+              for (size_t f = 0; f != fixels.size(); ++f) {
+                if (fixel_modified[f])
+                  workload += fixel_track_ends[f] - fixel_track_offsets[f];
+              }
+              // If too many streamlines are affected, the inverted index lookup is no faster than a full recalculation
+              if (workload > fixel_tracks.size() / 2) {
+                recalculate_all = true;
+              } else {
+                // Streamlines that have since been removed are also pruned from the index here
+                for (size_t f = 0; f != fixels.size(); ++f) {
+                  if (fixel_modified[f]) {
+                    size_t end = fixel_track_offsets[f];
+                    for (size_t i = fixel_track_offsets[f]; i != fixel_track_ends[f]; ++i) {
+                      const track_t index = fixel_tracks[i];
+                      if (contributions.exists (index)) {
+                        fixel_tracks[end++] = index;
+                        if (!track_stale[index]) {
+                          track_stale[index] = true;
+                          stale_tracks.push_back (index);
+                        }
+                      }
+                    }
+                    fixel_track_ends[f] = end;
+                  }
+                }
+              }
+            } else {
+              recalculate_all = true;
+            }
+
+            if (recalculate_all) {
+              TrackIndexRangeWriter range_writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks());
+              TrackGradientCalculator gradient_calculator (*this, track_gradients, current_mu, current_roc_cf);
+              Thread::run_queue (range_writer, TrackIndexRange(), Thread::multi (gradient_calculator));
+              mu_at_full_recalculation = current_mu;
+            } else if (stale_tracks.size()) {
+              // Process streamlines in order of index, for locality of access to their contributions
+              std::sort (stale_tracks.begin(), stale_tracks.end());
+              TrackIndexRangeWriter range_writer (SIFT_TRACK_INDEX_BUFFER_SIZE, stale_tracks.size());
+              TrackGradientCalculator gradient_calculator (*this, track_gradients, current_mu, current_roc_cf, &stale_tracks);
+              Thread::run_queue (range_writer, TrackIndexRange(), Thread::multi (gradient_calculator));
+            }
+            gradients_exact = recalculate_all;
+            recalculate_all = false;
+
+            for (auto index : stale_tracks)
+              track_stale[index] = false;
+            stale_tracks.clear();
+            std::fill (fixel_modified.begin(), fixel_modified.end(), false);
+
+            // The sorter re-arranges the gradient vector, so it must operate on a copy
+            gradient_vector = track_gradients;
+            batch->reset();
+
+          } else {
+            TrackIndexRangeWriter range_writer (SIFT_TRACK_INDEX_BUFFER_SIZE, num_tracks());
+            TrackGradientCalculator gradient_calculator (*this, gradient_vector, current_mu, current_roc_cf);
+            Thread::run_queue (range_writer, TrackIndexRange(), Thread::multi (gradient_calculator));
+          }
 
 
           // Theoretically possible to optimise the sorting block size at execution time
@@ -168,49 +272,47 @@ namespace MR
               noncontributing_indices.pop_back();
 
               // Remove this streamline, and adjust all of the relevant quantities
-              noncontributing_length_removed += contributions[to_remove]->get_total_length();
-              delete contributions[to_remove];
-              contributions[to_remove] = nullptr;
+              noncontributing_length_removed += contributions[to_remove].get_total_length();
+              contributions.erase (to_remove);
+              if (batched)
+                track_gradients[to_remove].set (num_tracks(), 0.0, 0.0);
               ++removed_this_iteration;
               --tracks_remaining;
 
             } else { // Proceed as normal
 
-              const std::vector<Cost_fn_gradient_sort>::iterator candidate = sorter.get();
+              const std::vector<Cost_fn_gradient_sort>::iterator candidate = batched ? batch->get (sorter, current_roc_cf) : sorter.get();
 
               const track_t candidate_index = candidate->get_tck_index();
 
               if (candidate->get_cost_gradient() >= 0.0) {
                 recalculate = POS_GRADIENT;
-                if (!removed_this_iteration)
-                  another_iteration = false;
+                if (!removed_this_iteration) {
+                  if (gradients_exact)
+                    another_iteration = false;
+                  else
+                    recalculate_all = true;
+                }
                 goto end_iteration;
               }
 
               assert (candidate_index != num_tracks());
-              assert (contributions[candidate_index]);
+              assert (contributions.exists (candidate_index));
 
               const double streamline_density_ratio = candidate->get_cost_gradient() / (sum_contributing_length - contributing_length_removed);
               const double required_cf_change_ratio = - term_ratio * streamline_density_ratio * current_cf;
 
-              const TrackContribution& candidate_contribution (*contributions[candidate_index]);
+              const TrackContribution candidate_contribution (contributions[candidate_index]);
 
-              const double old_mu = mu();
-              const double new_mu = FOD_sum / (TD_sum - candidate_contribution.get_total_contribution());
-              const double mu_change = new_mu - old_mu;
-
-              // Initial estimate of cost change knowing only the change to the normalisation coefficient
-              double this_actual_cf_change = current_roc_cf * mu_change;
-              double quantisation = 0.0;
-
-              for (size_t f = 0; f != candidate_contribution.dim(); ++f) {
-                const Track_fixel_contribution& fixel_cont = candidate_contribution[f];
-                const float length = fixel_cont.get_length();
-                Fixel& this_fixel = fixels[fixel_cont.get_fixel_index()];
-                quantisation += this_fixel.calc_quantisation (old_mu, length);
-                const double undo_change_mu_only = this_fixel.get_d_cost_d_mu (old_mu) * mu_change;
-                const double change_remove_tck = this_fixel.get_cost_wo_track (new_mu, length) - this_fixel.get_cost (old_mu);
-                this_actual_cf_change = this_actual_cf_change - undo_change_mu_only + change_remove_tck;
+              // In batched mode, the cost function changes have already been calculated in parallel for all
+              //   candidates in the batch; as these do not share fixels, each is exact other than the change in mu
+              //   resulting from the removal of preceding candidates in the same batch
+              double this_actual_cf_change, quantisation;
+              if (batched) {
+                this_actual_cf_change = batch->get_cf_change();
+                quantisation = batch->get_quantisation();
+              } else {
+                calc_removal (candidate_index, current_roc_cf, this_actual_cf_change, quantisation);
               }
 
               const double required_cf_change_quantisation = enforce_quantisation ? (-0.5 * quantisation) : 0.0;
@@ -219,14 +321,16 @@ namespace MR
               if (this_actual_cf_change < std::min ( {required_cf_change_ratio, required_cf_change_quantisation, this_nonlinearity })) {
 
                 // Candidate streamline removal meets all criteria; remove from reconstruction
-                for (size_t f = 0; f != candidate_contribution.dim(); ++f) {
-                  const Track_fixel_contribution& fixel_cont = candidate_contribution[f];
+                for (const auto& fixel_cont : candidate_contribution)
                   fixels[fixel_cont.get_fixel_index()] -= fixel_cont.get_length();
-                }
                 TD_sum -= candidate_contribution.get_total_contribution();
                 contributing_length_removed += candidate_contribution.get_total_length();
-                delete contributions[candidate_index];
-                contributions[candidate_index] = nullptr;
+                if (batched) {
+                  for (const auto& fixel_cont : candidate_contribution)
+                    fixel_modified[fixel_cont.get_fixel_index()] = true;
+                  track_gradients[candidate_index].set (num_tracks(), 0.0, 0.0);
+                }
+                contributions.erase (candidate_index);
                 ++removed_this_iteration;
                 --tracks_remaining;
 
@@ -240,7 +344,15 @@ namespace MR
                   recalculate = TERM_RATIO;
                 else
                   recalculate = QUANTISATION;
-                if (!removed_this_iteration) {
+                // The gradient of this candidate must be re-calculated before it is considered again
+                if (batched && !track_stale[candidate_index]) {
+                  track_stale[candidate_index] = true;
+                  stale_tracks.push_back (candidate_index);
+                }
+                if (!removed_this_iteration && !gradients_exact) {
+                  // Only conclude that filtering has converged based on exact gradients
+                  recalculate_all = true;
+                } else if (!removed_this_iteration) {
                   // If filtering has been completed to convergence, but the user does not want to filter to convergence
                   //   (i.e. they have defined a desired termination criterion but it has not yet been met), disable
                   //   the quantisation check to give the algorithm a chance to meet the user's termination request
@@ -321,7 +433,7 @@ namespace MR
         ProgressBar progress ("Writing filtered tracks output file", contributions.size());
         Tractography::Streamline<> empty_tck;
         while (reader (tck) && tck_counter < contributions.size()) {
-          if (contributions[tck_counter++])
+          if (contributions.exists (tck_counter++))
             writer (tck);
           else
             writer (empty_tck);
@@ -338,7 +450,7 @@ namespace MR
       {
         File::OFStream out (path, std::ios_base::out | std::ios_base::trunc);
         for (track_t i = 0; i != contributions.size(); ++i) {
-          if (contributions[i])
+          if (contributions.exists (i))
             out << "1\n";
           else
             out << "0\n";
@@ -424,19 +536,40 @@ namespace MR
         return roc_cost;
       }
 
+      void SIFTer::calc_removal (const track_t index, const double current_roc_cost, double& cf_change, double& quantisation) const
+      {
+        const TrackContribution tck_cont (contributions[index]);
+        const double old_mu = mu();
+        const double new_mu = FOD_sum / (TD_sum - tck_cont.get_total_contribution());
+        const double mu_change = new_mu - old_mu;
+
+        // Initial estimate of cost change knowing only the change to the normalisation coefficient
+        cf_change = current_roc_cost * mu_change;
+        quantisation = 0.0;
+
+        for (const auto& c : tck_cont) {
+          const float length = c.get_length();
+          const Fixel& fixel = fixels[c.get_fixel_index()];
+          quantisation += fixel.calc_quantisation (old_mu, length);
+          const double undo_change_mu_only = fixel.get_d_cost_d_mu (old_mu) * mu_change;
+          const double change_remove_tck = fixel.get_cost_wo_track (new_mu, length) - fixel.get_cost (old_mu);
+          cf_change = cf_change - undo_change_mu_only + change_remove_tck;
+        }
+      }
+
       double SIFTer::calc_gradient (const track_t index, const double current_mu, const double current_roc_cost) const
       {
-        if (!contributions[index])
+        if (!contributions.exists (index))
           return std::numeric_limits<double>::max();
-        const TrackContribution& tck_cont = *contributions[index];
+        const TrackContribution tck_cont (contributions[index]);
         const double TD_sum_if_removed = TD_sum - tck_cont.get_total_contribution();
         const double mu_if_removed = FOD_sum / TD_sum_if_removed;
         const double mu_change_if_removed = mu_if_removed - current_mu;
         double gradient = current_roc_cost * mu_change_if_removed;
-        for (size_t f = 0; f != tck_cont.dim(); ++f) {
-          const Fixel& fixel = fixels[tck_cont[f].get_fixel_index()];
+        for (const auto& c : tck_cont) {
+          const Fixel& fixel = fixels[c.get_fixel_index()];
           const double undo_gradient_mu_only = fixel.get_d_cost_d_mu (current_mu) * mu_change_if_removed;
-          const double gradient_remove_tck = fixel.get_cost_wo_track (mu_if_removed, tck_cont[f].get_length()) - fixel.get_cost (current_mu);
+          const double gradient_remove_tck = fixel.get_cost_wo_track (mu_if_removed, c.get_length()) - fixel.get_cost (current_mu);
           gradient = gradient - undo_gradient_mu_only + gradient_remove_tck;
         }
         return gradient;
@@ -449,10 +582,12 @@ namespace MR
 
       bool SIFTer::TrackGradientCalculator::operator() (const TrackIndexRange& in) const
       {
-        for (track_t track_index = in.first; track_index != in.second; ++track_index) {
-          if (master.contributions[track_index]) {
+        for (track_t i = in.first; i != in.second; ++i) {
+          const track_t track_index = subset ? (*subset)[i] : i;
+          if (master.contributions.exists (track_index)) {
             const double gradient = master.calc_gradient (track_index, current_mu, current_roc_cost);
-            const double grad_per_unit_length = master.contributions[track_index]->get_total_contribution() ? (gradient / master.contributions[track_index]->get_total_contribution()) : 0.0;
+            const double total_contribution = master.contributions[track_index].get_total_contribution();
+            const double grad_per_unit_length = total_contribution ? (gradient / total_contribution) : 0.0;
             gradient_vector[track_index].set (track_index, gradient, grad_per_unit_length);
           } else {
             gradient_vector[track_index].set (master.num_tracks(), 0.0, 0.0);
@@ -465,6 +600,93 @@ namespace MR
 
 
 
+      SIFTer::CandidateBatch::VecItType SIFTer::CandidateBatch::get (MT_gradient_vector_sorter& sorter, const double current_roc_cost)
+      {
+        if (next == candidates.size())
+          fill (sorter, current_roc_cost);
+        return candidates[next++].it;
+      }
+
+
+
+      bool SIFTer::CandidateBatch::claim (const track_t index)
+      {
+        const TrackContribution tck_cont (master.contributions[index]);
+        for (const auto& c : tck_cont) {
+          if (claimed[c.get_fixel_index()] == stamp)
+            return false;
+        }
+        for (const auto& c : tck_cont)
+          claimed[c.get_fixel_index()] = stamp;
+        return true;
+      }
+
+
+
+      void SIFTer::CandidateBatch::fill (MT_gradient_vector_sorter& sorter, const double current_roc_cost)
+      {
+        candidates.clear();
+        next = 0;
+        current_size = std::min (2 * current_size, size);
+        if (!++stamp) {
+          std::fill (claimed.begin(), claimed.end(), 0);
+          stamp = 1;
+        }
+
+        // Candidates deferred from the previous batch were drawn from the sorter first, so take precedence
+        std::vector<VecItType> still_deferred;
+        for (auto it : deferred) {
+          if (candidates.size() < current_size && claim (it->get_tck_index()))
+            candidates.push_back ({ it, 0.0, 0.0 });
+          else
+            still_deferred.push_back (it);
+        }
+        std::swap (deferred, still_deferred);
+
+        while (!terminal_found && candidates.size() < current_size && deferred.size() < SIFT_BATCH_MAX_DEFERRED) {
+          const VecItType it = sorter.get();
+          if (it->get_cost_gradient() >= 0.0) {
+            terminal = it;
+            terminal_found = true;
+          } else if (claim (it->get_tck_index())) {
+            candidates.push_back ({ it, 0.0, 0.0 });
+          } else {
+            deferred.push_back (it);
+          }
+        }
+
+        // Once all candidates with a negative gradient have been exhausted, provide the
+        //   terminating candidate so that the iteration ends in the same way as unbatched filtering
+        if (candidates.empty()) {
+          assert (terminal_found);
+          candidates.push_back ({ terminal, 0.0, 0.0 });
+          return;
+        }
+
+        class Evaluator {
+          public:
+            const SIFTer& master;
+            std::vector<Candidate>& candidates;
+            const double current_roc_cost;
+            std::atomic<size_t>& counter;
+            void execute () {
+              size_t n;
+              while ((n = counter++) < candidates.size())
+                master.calc_removal (candidates[n].it->get_tck_index(), current_roc_cost, candidates[n].cf_change, candidates[n].quantisation);
+            }
+        };
+        std::atomic<size_t> counter (0);
+        Evaluator evaluator = { master, candidates, current_roc_cost, counter };
+        if (candidates.size() < SIFT_BATCH_MIN_THREADED_SIZE)
+          evaluator.execute();
+        else
+          Thread::run (Thread::multi (evaluator), "SIFT candidate evaluation").wait();
+      }
+
+
+
+
+
       }
     }
   }
@@ -33,6 +33,21 @@
 #include "dwi/tractography/SIFT/types.h"
 
 
+// In batched filtering, gradients of streamlines not affected by removals are re-used
+//   until the proportionality coefficient has changed by more than this fraction
+#define SIFT_BATCH_MU_TOLERANCE 0.05
+
+// Size of the first batch of candidates drawn in each iteration of batched filtering
+#define SIFT_BATCH_INITIAL_SIZE 16
+
+// Maximum number of conflicting candidates held over for subsequent batches; once reached, the
+//   current batch is closed, to limit the cost of repeatedly testing these for conflicts
+#define SIFT_BATCH_MAX_DEFERRED 16
+
+// Batches smaller than this are evaluated without multi-threading
+#define SIFT_BATCH_MIN_THREADED_SIZE 256
+
+
 
 namespace MR
 {
@@ -60,6 +75,7 @@ namespace MR
             term_number (0),
             term_ratio (0.0),
             term_mu (0.0),
+            batch_size (1),
             enforce_quantisation (true) { }
 
         SIFTer (const SIFTer& that) = delete;
@@ -77,6 +93,7 @@ namespace MR
         void set_term_ratio  (const float i)        { term_ratio = i; }
         void set_term_mu     (const float i)        { term_mu = i; }
         void set_csv_path    (const std::string& i) { csv_path = i; }
+        void set_batch_size  (const size_t i)       { batch_size = i; }
 
         void set_regular_outputs (const std::vector<int>&, const bool);
 
@@ -102,6 +119,7 @@ namespace MR
         track_t term_number;
         float   term_ratio;
         double  term_mu;
+        size_t  batch_size;
         bool    enforce_quantisation;
         std::string csv_path;
 
@@ -109,6 +127,7 @@ namespace MR
         // Convenience functions
         double calc_roc_cost_function() const;
         double calc_gradient (const track_t, const double, const double) const;
+        void   calc_removal  (const track_t, const double, double&, double&) const;
 
 
 
@@ -116,13 +135,58 @@ namespace MR
         class TrackGradientCalculator
         {
           public:
-            TrackGradientCalculator (const SIFTer& sifter, std::vector<Cost_fn_gradient_sort>& v, const double mu, const double r) :
-                master (sifter), gradient_vector (v), current_mu (mu), current_roc_cost (r) { }
+            TrackGradientCalculator (const SIFTer& sifter, std::vector<Cost_fn_gradient_sort>& v, const double mu, const double r, const std::vector<track_t>* subset = nullptr) :
+                master (sifter), gradient_vector (v), current_mu (mu), current_roc_cost (r), subset (subset) { }
             bool operator() (const TrackIndexRange&) const;
           private:
             const SIFTer& master;
             std::vector<Cost_fn_gradient_sort>& gradient_vector;
             const double current_mu, current_roc_cost;
+            // If provided, the index ranges refer to positions within this list of streamlines
+            const std::vector<track_t>* subset;
+        };
+
+
+        // For batched filtering: candidate streamlines are drawn from the sorter in groups that do not
+        //   share any fixels, such that the cost function change resulting from the removal of each
+        //   can be calculated in parallel; candidates that conflict with the current batch are
+        //   deferred to the next batch. As few candidates may be accepted before the gradients need to
+        //   be re-calculated, the batch size starts small within each iteration and grows geometrically.
+        class CandidateBatch
+        {
+            typedef std::vector<Cost_fn_gradient_sort>::iterator VecItType;
+          public:
+            CandidateBatch (const SIFTer& sifter, const size_t size) :
+                master (sifter), size (size), current_size (0), next (0), terminal_found (false),
+                claimed (sifter.fixels.size(), 0), stamp (0) { }
+
+            void reset() { candidates.clear(); deferred.clear(); current_size = SIFT_BATCH_INITIAL_SIZE / 2; next = 0; terminal_found = false; }
+            VecItType get (MT_gradient_vector_sorter&, const double);
+
+            double get_cf_change()    const { assert (next); return candidates[next-1].cf_change; }
+            double get_quantisation() const { assert (next); return candidates[next-1].quantisation; }
+
+          private:
+            class Candidate
+            {
+              public:
+                VecItType it;
+                double cf_change, quantisation;
+            };
+
+            const SIFTer& master;
+            const size_t size;
+            size_t current_size;
+            std::vector<Candidate> candidates;
+            std::vector<VecItType> deferred;
+            size_t next;
+            VecItType terminal;
+            bool terminal_found;
+            std::vector<uint32_t> claimed;
+            uint32_t stamp;
+
+            bool claim (const track_t);
+            void fill (MT_gradient_vector_sorter&, const double);
         };
 
 
@@ -15,6 +15,9 @@
 
 #include "dwi/tractography/SIFT/track_contribution.h"
 
+// size of each of the chunks of memory used to store the streamline contributions
+#define SIFT_TRACK_CONTRIBUTION_CHUNK_SIZE (16*1024*1024)
+
 namespace MR
 {
   namespace DWI
@@ -30,6 +33,109 @@ namespace MR
         float Track_fixel_contribution::min_length_for_storage = 0.0;
 
 
+
+
+        constexpr uint64_t TrackContributions::invalid;
+
+
+
+        namespace {
+
+          inline size_t varint_size (uint64_t value)
+          {
+            size_t size = 1;
+            while (value >= 0x80) {
+              value >>= 7;
+              ++size;
+            }
+            return size;
+          }
+
+          inline void write_varint (uint8_t*& ptr, uint64_t value)
+          {
+            while (value >= 0x80) {
+              *ptr++ = uint8_t (value) | 0x80;
+              value >>= 7;
+            }
+            *ptr++ = uint8_t (value);
+          }
+
+          inline uint64_t zigzag (const uint32_t from, const uint32_t to)
+          {
+            const int64_t delta = int64_t (to) - int64_t (from);
+            return (uint64_t (delta) << 1) ^ uint64_t (delta >> 63);
+          }
+
+        }
+
+
+
+        void TrackContributions::assign (const size_t count)
+        {
+          offsets.assign (count, invalid);
+          chunks.clear();
+          used = chunk_size = allocated = 0;
+        }
+
+
+
+        void TrackContributions::swap (TrackContributions& that)
+        {
+          offsets.swap (that.offsets);
+          chunks.swap (that.chunks);
+          std::swap (used, that.used);
+          std::swap (chunk_size, that.chunk_size);
+          std::swap (allocated, that.allocated);
+        }
+
+
+
+        void TrackContributions::set (const size_t index, const std::vector<Track_fixel_contribution>& contributions, const float total_contribution, const float total_length)
+        {
+          size_t size = varint_size (contributions.size()) + 2 * sizeof (float);
+          uint32_t previous = 0;
+          for (const auto& c : contributions) {
+            size += varint_size (zigzag (previous, c.fixel)) + 1;
+            previous = c.fixel;
+          }
+
+          uint8_t* ptr;
+          uint64_t offset;
+          {
+            std::lock_guard<std::mutex> lock (mutex);
+            if (used + size > chunk_size) {
+              chunk_size = std::max (size_t (SIFT_TRACK_CONTRIBUTION_CHUNK_SIZE), size);
+              chunks.push_back (std::unique_ptr<uint8_t[]> (new uint8_t [chunk_size]));
+              allocated += chunk_size;
+              used = 0;
+            }
+            ptr = chunks.back().get() + used;
+            offset = (uint64_t (chunks.size() - 1) << 32) | used;
+            used += size;
+          }
+
+          write_varint (ptr, contributions.size());
+          memcpy (ptr, &total_contribution, sizeof (float));
+          memcpy (ptr + sizeof (float), &total_length, sizeof (float));
+          ptr += 2 * sizeof (float);
+          previous = 0;
+          for (const auto& c : contributions) {
+            write_varint (ptr, zigzag (previous, c.fixel));
+            *ptr++ = uint8_t (c.length);
+            previous = c.fixel;
+          }
+
+          offsets[index] = offset;
+        }
+
+
+
+        size_t TrackContributions::memory_usage () const
+        {
+          return offsets.size() * sizeof (uint64_t) + allocated;
+        }
+
+
       }
     }
   }
@@ -20,9 +20,12 @@
 
 
 #include <stdint.h>
+#include <cstring>
+#include <limits>
+#include <mutex>
 
 #include "header.h"
-#include "min_mem_array.h"
+#include "memory.h"
 
 #include "math/math.h"
 
@@ -42,17 +45,16 @@ namespace MR
       class Track_fixel_contribution
       {
         public:
-          Track_fixel_contribution (const uint32_t fixel_index, const float length)
-          {
-            const uint32_t length_as_int = std::min (uint32_t(255), uint32_t(std::round (scale_to_storage * length)));
-            data = (fixel_index & 0x00FFFFFF) | (length_as_int << 24);
-          }
+          Track_fixel_contribution (const uint32_t fixel_index, const float length) :
+              fixel (fixel_index),
+              length (std::min (uint32_t(255), uint32_t(std::round (scale_to_storage * length)))) { }
 
           Track_fixel_contribution() :
-            data (0) { }
+              fixel (0),
+              length (0) { }
 
-          uint32_t get_fixel_index() const { return (data & 0x00FFFFFF); }
-          float    get_length()      const { return (uint32_t((data & 0xFF000000) >> 24) * scale_from_storage); }
+          uint32_t get_fixel_index() const { return fixel; }
+          float    get_length()      const { return (length * scale_from_storage); }
 
 
           bool add (const float length)
@@ -60,10 +62,9 @@ namespace MR
             // Allow summing of multiple contributions to a fixel, UNLESS it would cause truncation, in which
             //   case keep them separate
             const uint32_t increment = std::round (scale_to_storage * length);
-            const uint32_t existing = (data & 0xFF000000) >> 24;
-            if (existing + increment > 255)
+            if (this->length + increment > 255)
               return false;
-            data = (data & 0x00FFFFFF) | ((existing + increment) << 24);
+            this->length += increment;
             return true;
           }
 
@@ -79,77 +80,150 @@ namespace MR
           }
 
 
-          // Minimum length that will be non-zero once converted to an integer for word-sharing storage
+          // Minimum length that will be non-zero once converted to an integer for byte storage
           static float min() { return min_length_for_storage; }
 
 
         private:
-          uint32_t data;
+          uint32_t fixel;
+          uint32_t length;
 
           static float scale_to_storage, scale_from_storage, min_length_for_storage;
 
+          friend class TrackContribution;
+          friend class TrackContributions;
+
       };
 
 
 
 
-/*
-// This is a 'safe' version of Track_fixel_contribution that does not use byte-sharing, but requires double the RAM
-// Simply comment the class above and un-comment this one to use
-class Track_fixel_contribution
-{
-  public:
-    Track_fixel_contribution (const uint32_t fixel_index, const float length) :
-      fixel (fixel_index),
-      length (length) { }
+      //! A read-only view of the fixel contributions of a single streamline
+      /*! The contributions are stored by TrackContributions as: the number of
+       * fixels traversed (as a varint), the total contribution & total length
+       * (as floats), followed for each fixel traversed by the difference in
+       * fixel index relative to the previous fixel (as a zigzag-encoded
+       * varint) and the quantised length (as a byte). The contributions can
+       * therefore only be accessed sequentially, in the order in which they
+       * were stored. */
+      class TrackContribution
+      {
+        public:
+          class const_iterator
+          {
+            public:
+              const_iterator (const uint8_t* data, const size_t remaining) :
+                  data (data),
+                  remaining (remaining) { decode(); }
+
+              const Track_fixel_contribution& operator*  () const { return value; }
+              const Track_fixel_contribution* operator-> () const { return &value; }
+              const_iterator& operator++ () { --remaining; decode(); return *this; }
+              bool operator!= (const const_iterator& that) const { return remaining != that.remaining; }
+
+            private:
+              const uint8_t* data;
+              size_t remaining;
+              Track_fixel_contribution value;
+
+              void decode ()
+              {
+                if (!remaining)
+                  return;
+                const uint64_t zigzag = read_varint (data);
+                value.fixel += uint32_t ((zigzag >> 1) ^ -(zigzag & 1));
+                value.length = *data++;
+              }
+          };
+
+
+          TrackContribution (const uint8_t* record) :
+              data (record),
+              num_fixels (read_varint (data))
+          {
+            memcpy (&total_contribution, data, sizeof (float));
+            memcpy (&total_length, data + sizeof (float), sizeof (float));
+            data += 2 * sizeof (float);
+          }
+
+          size_t dim() const { return num_fixels; }
 
-    Track_fixel_contribution() :
-      fixel (0),
-      length (0.0) { }
+          float get_total_contribution() const { return total_contribution; }
+          float get_total_length      () const { return total_length; }
 
+          const_iterator begin() const { return const_iterator (data, num_fixels); }
+          const_iterator end()   const { return const_iterator (nullptr, 0); }
 
-    bool add (const float length) { value += length; return true; }
+          static uint64_t read_varint (const uint8_t*& ptr)
+          {
+            uint64_t value = 0;
+            for (size_t shift = 0; ; shift += 7) {
+              const uint8_t byte = *ptr++;
+              value |= uint64_t (byte & 0x7F) << shift;
+              if (!(byte & 0x80))
+                return value;
+            }
+          }
 
-    uint32_t get_fixel_index() const { return fixel; }
-    float    get_length()      const { return length; }
+        private:
+          const uint8_t* data;
+          const size_t num_fixels;
+          float total_contribution, total_length;
 
+      };
 
-    static void set_scaling (const Image::Info& in) { min_length_for_storage = 0.0; }
-    static float min() { return min_length_for_storage; }
 
 
-  private:
-    uint32_t fixel;
-    float length;
 
-    static float scale_to_storage, scale_from_storage, min_length_for_storage;
+      //! Storage for the fixel contributions of all streamlines
+      /*! Rather than allocating memory separately for each streamline, the
+       * contributions of all streamlines are encoded into large
+       * contiguous chunks of memory (see TrackContribution for the format),
+       * with a single offset stored per streamline.
+       *
+       * set() may be called concurrently from multiple threads (for different
+       * streamlines), but not concurrently with any other method. */
+      class TrackContributions
+      {
+        public:
+          TrackContributions () :
+              used (0),
+              chunk_size (0),
+              allocated (0) { }
 
-};
-*/
+          TrackContributions (const TrackContributions&) = delete;
 
+          //! reset to hold \a count streamlines, none of which have been set
+          void assign (const size_t count);
+          void resize (const size_t count) { offsets.resize (count, invalid); }
+          void swap (TrackContributions&);
 
+          size_t size() const { return offsets.size(); }
 
-      class TrackContribution : public Min_mem_array<Track_fixel_contribution>
-      {
+          //! whether the contribution of streamline \a index has been set (and not subsequently erased)
+          bool exists (const size_t index) const { return offsets[index] != invalid; }
 
-        public:
-        TrackContribution (const std::vector<Track_fixel_contribution>& in, const float c, const float l) :
-            Min_mem_array<Track_fixel_contribution> (in),
-            total_contribution (c),
-            total_length       (l) { }
+          TrackContribution operator[] (const size_t index) const
+          {
+            assert (exists (index));
+            return TrackContribution (chunks[offsets[index] >> 32].get() + (offsets[index] & 0xFFFFFFFF));
+          }
 
-        TrackContribution () :
-            Min_mem_array<Track_fixel_contribution> (),
-            total_contribution (0.0),
-            total_length       (0.0) { }
+          void set (const size_t index, const std::vector<Track_fixel_contribution>& contributions, const float total_contribution, const float total_length);
 
-        ~TrackContribution() { }
+          // Note that the memory used by the erased streamline is not freed
+          void erase (const size_t index) { offsets[index] = invalid; }
 
-        float get_total_contribution() const { return total_contribution; }
-        float get_total_length      () const { return total_length; }
+          //! the total amount of memory used (in bytes)
+          size_t memory_usage () const;
 
         private:
-          const float total_contribution, total_length;
+          std::vector<uint64_t> offsets;
+          std::vector<std::unique_ptr<uint8_t[]>> chunks;
+          size_t used, chunk_size, allocated;
+          std::mutex mutex;
+
+          static constexpr uint64_t invalid = std::numeric_limits<uint64_t>::max();
 
       };
 
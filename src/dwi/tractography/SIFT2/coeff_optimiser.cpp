@@ -136,7 +136,7 @@ namespace MR {
           // Update the stats
           local_stats_steps += dFs;
           local_stats_coefficients += new_coefficient;
-          if (master.contributions[track_index] && master.contributions[track_index]->dim() && new_coefficient > master.min_coeff)
+          if (master.contributions.exists (track_index) && master.contributions[track_index].dim() && new_coefficient > master.min_coeff)
             ++local_nonzero_count;
 
 #ifdef STREAMLINE_OF_INTEREST
@@ -171,15 +171,15 @@ namespace MR {
 
       double CoefficientOptimiserBase::do_fixel_exclusion (const SIFT::track_t track_index)
       {
-        const SIFT::TrackContribution& this_contribution (*(master.contributions[track_index]));
+        const SIFT::TrackContribution this_contribution (master.contributions[track_index]);
 
         // Task 1: Identify the fixel that should be excluded
         size_t index_to_exclude = 0.0;
         float cost_to_exclude = 0.0;
 
-        for (size_t j = 0; j != this_contribution.dim(); ++j) {
-          const size_t fixel_index = this_contribution[j].get_fixel_index();
-          const float length = this_contribution[j].get_length();
+        for (const auto& fixel_cont : this_contribution) {
+          const size_t fixel_index = fixel_cont.get_fixel_index();
+          const float length = fixel_cont.get_length();
           const Fixel& fixel = master.fixels[fixel_index];
           if (!fixel.is_excluded() && (fixel.get_diff (mu) < 0.0)) {
 
@@ -200,9 +200,9 @@ namespace MR {
         // Task 2: Calculate a new coefficient for this streamline
         double weighted_sum = 0.0, sum_weights = 0.0;
 
-        for (size_t j = 0; j != this_contribution.dim(); ++j) {
-          const size_t fixel_index = this_contribution[j].get_fixel_index();
-          const float length = this_contribution[j].get_length();
+        for (const auto& fixel_cont : this_contribution) {
+          const size_t fixel_index = fixel_cont.get_fixel_index();
+          const float length = fixel_cont.get_length();
           const Fixel& fixel = master.fixels[fixel_index];
           if (!fixel.is_excluded() && (fixel_index != index_to_exclude)) {
 
@@ -54,11 +54,11 @@ namespace MR {
       {
         for (SIFT::track_t track_index = range.first; track_index != range.second; ++track_index) {
           const double coefficient = master.coefficients[track_index];
-          const SIFT::TrackContribution& this_contribution (*(master.contributions[track_index]));
+          const SIFT::TrackContribution this_contribution (master.contributions[track_index]);
           const double weighting_factor = (coefficient > master.min_coeff) ? std::exp (coefficient) : 0.0;
-          for (size_t j = 0; j != this_contribution.dim(); ++j) {
-            const size_t fixel_index = this_contribution[j].get_fixel_index();
-            const float length = this_contribution[j].get_length();
+          for (const auto& fixel_cont : this_contribution) {
+            const size_t fixel_index = fixel_cont.get_fixel_index();
+            const float length = fixel_cont.get_length();
             fixel_coeff_sums[fixel_index] += length * coefficient;
             fixel_TDs       [fixel_index] += length * weighting_factor;
             fixel_counts    [fixel_index]++;
@@ -35,13 +35,13 @@ namespace MR {
         reg_tik (tckfactor.reg_multiplier_tikhonov),
         // Pre-scale reg_tv by total streamline contribution; each fixel then contributes (PM * length),
         //   and the whole thing is appropriately normalised
-        reg_tv  (tckfactor.reg_multiplier_tv / tckfactor.contributions[track_index]->get_total_contribution())
+        reg_tv  (tckfactor.reg_multiplier_tv / tckfactor.contributions[track_index].get_total_contribution())
       {
-        const SIFT::TrackContribution& track_contribution = *tckfactor.contributions[track_index];
-        for (size_t i = 0; i != track_contribution.dim(); ++i) {
-          const SIFT2::Fixel& fixel (tckfactor.fixels[track_contribution[i].get_fixel_index()]);
+        const SIFT::TrackContribution track_contribution (tckfactor.contributions[track_index]);
+        for (const auto& fixel_cont : track_contribution) {
+          const SIFT2::Fixel& fixel (tckfactor.fixels[fixel_cont.get_fixel_index()]);
           if (!fixel.is_excluded())
-            fixels.push_back (Fixel (track_contribution[i], tckfactor, Fs, fixel.get_mean_coeff()));
+            fixels.push_back (Fixel (fixel_cont, tckfactor, Fs, fixel.get_mean_coeff()));
         }
       }
 
@@ -54,13 +54,13 @@ namespace MR {
         for (SIFT::track_t track_index = range.first; track_index != range.second; ++track_index) {
           const double coefficient = master.coefficients[track_index];
           tikhonov_sum += Math::pow2 (coefficient);
-          const SIFT::TrackContribution& this_contribution (*(master.contributions[track_index]));
+          const SIFT::TrackContribution this_contribution (master.contributions[track_index]);
           const double contribution_multiplier = 1.0 / this_contribution.get_total_contribution();
           double this_tv_sum = 0.0;
-          for (size_t j = 0; j != this_contribution.dim(); ++j) {
-            const Fixel& fixel (master.fixels[this_contribution[j].get_fixel_index()]);
+          for (const auto& fixel_cont : this_contribution) {
+            const Fixel& fixel (master.fixels[fixel_cont.get_fixel_index()]);
             const double fixel_coeff_cost = SIFT2::tvreg (coefficient, fixel.get_mean_coeff());
-            this_tv_sum += fixel.get_weight() * this_contribution[j].get_length() * contribution_multiplier * fixel_coeff_cost;
+            this_tv_sum += fixel.get_weight() * fixel_cont.get_length() * contribution_multiplier * fixel_coeff_cost;
           }
           tv_sum += this_tv_sum;
         }
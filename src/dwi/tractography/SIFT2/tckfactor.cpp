@@ -115,11 +115,11 @@ namespace MR {
         TD_sum = 0.0;
 
         for (SIFT::track_t track_index = 0; track_index != num_tracks(); ++track_index) {
-          const SIFT::TrackContribution& tck_cont (*contributions[track_index]);
+          const SIFT::TrackContribution tck_cont (contributions[track_index]);
           const double weight = 1.0 / tck_cont.get_total_length();
           coefficients[track_index] = std::log (weight);
-          for (size_t i = 0; i != tck_cont.dim(); ++i)
-            fixels[tck_cont[i].get_fixel_index()] += weight * tck_cont[i].get_length();
+          for (const auto& fixel_cont : tck_cont)
+            fixels[fixel_cont.get_fixel_index()] += weight * fixel_cont.get_length();
           TD_sum += weight * tck_cont.get_total_contribution();
         }
 
@@ -152,12 +152,12 @@ namespace MR {
 
         // Just do single-threaded for now
         for (SIFT::track_t i = 0; i != num_tracks(); ++i) {
-          const SIFT::TrackContribution& tckcont = *contributions[i];
+          const SIFT::TrackContribution tckcont (contributions[i]);
           double sum_afd = 0.0;
-          for (size_t f = 0; f != tckcont.dim(); ++f) {
-            const size_t fixel_index = tckcont[f].get_fixel_index();
+          for (const auto& fixel_cont : tckcont) {
+            const size_t fixel_index = fixel_cont.get_fixel_index();
             const Fixel& fixel = fixels[fixel_index];
-            const float length = tckcont[f].get_length();
+            const float length = fixel_cont.get_length();
             sum_afd += fixel.get_weight() * fixel.get_FOD() * (length / fixel.get_orig_TD());
           }
           const double afcsa = sum_afd / tckcont.get_total_contribution();
@@ -199,7 +199,7 @@ namespace MR {
 
         unsigned int nonzero_streamlines = 0;
         for (SIFT::track_t i = 0; i != num_tracks(); ++i) {
-          if (contributions[i] && contributions[i]->dim())
+          if (contributions.exists (i) && contributions[i].dim())
             ++nonzero_streamlines;
         }
 
@@ -359,18 +359,18 @@ namespace MR {
           ProgressBar progress ("Generating streamline coefficient statistic images", num_tracks());
           for (SIFT::track_t i = 0; i != num_tracks(); ++i) {
             const double coeff = coefficients[i];
-            const SIFT::TrackContribution& this_contribution (*contributions[i]);
+            const SIFT::TrackContribution this_contribution (contributions[i]);
             if (coeff > min_coeff) {
-              for (size_t j = 0; j != this_contribution.dim(); ++j) {
-                const size_t fixel_index = this_contribution[j].get_fixel_index();
+              for (const auto& fixel_cont : this_contribution) {
+                const size_t fixel_index = fixel_cont.get_fixel_index();
                 const double mean_coeff = fixels[fixel_index].get_mean_coeff();
                 mins  [fixel_index] = std::min (mins[fixel_index], coeff);
                 stdevs[fixel_index] += Math::pow2 (coeff - mean_coeff);
                 maxs  [fixel_index] = std::max (maxs[fixel_index], coeff);
               }
             } else {
-              for (size_t j = 0; j != this_contribution.dim(); ++j)
-                ++zeroed[this_contribution[j].get_fixel_index()];
+              for (const auto& fixel_cont : this_contribution)
+                ++zeroed[fixel_cont.get_fixel_index()];
             }
             ++progress;
           }
@@ -46,6 +46,22 @@ namespace MR {
 
             bool operator() (Streamline<>&);
 
+            //! skip over up to the first \a number streamlines of the first input file
+            /*! This only takes place if the file has a streamline index, and
+             * stops at the first empty streamline, since these are not
+             * counted as skipped by the Receiver. Returns the number of
+             * streamlines actually skipped. */
+            size_t skip (size_t number) {
+              if (!reader->has_index())
+                return 0;
+              number = std::min (number, reader->num_indexed());
+              size_t n = 0;
+              while (n < number && reader->indexed_size (n))
+                ++n;
+              reader->seek (n);
+              return n;
+            }
+
 
           private:
             const std::vector<std::string>& file_list;
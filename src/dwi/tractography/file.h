@@ -24,12 +24,17 @@
 #include "memory.h"
 #include "file/config.h"
 #include "file/key_value.h"
+#include "file/mmap.h"
 #include "file/ofstream.h"
+#include "file/utils.h"
+#include "raw.h"
 #include "dwi/tractography/file_base.h"
 #include "dwi/tractography/properties.h"
 #include "dwi/tractography/streamline.h"
 
 
+#define TCK_WEIGHTS_CHUNK_SIZE 1048576
+
 namespace MR
 {
   namespace DWI
@@ -57,6 +62,13 @@ namespace MR
 
 
       //! A class to read streamlines data
+      /*! The track data are memory-mapped, and each streamline is located
+       * by scanning for its delimiter, then copied into the Streamline in
+       * one go (with byte-swapping and type conversion only if required).
+       *
+       * If a valid streamline index sidecar is found alongside the file
+       * (see index_path()), seek() can jump directly to any streamline;
+       * otherwise it will scan through the file. */
       template <class ValueType = float>
       class Reader : public __ReaderBase__, public ReaderInterface<ValueType>
       {
@@ -64,13 +76,27 @@ namespace MR
 
           //! open the \c file for reading and load header into \c properties
           Reader (const std::string& file, Properties& properties) :
-            current_index (0) {
+            current_index (0),
+            current (nullptr),
+            end (nullptr),
+            index_count (0),
+            weights_pos (0) {
               open (file, "tracks", properties);
+              in.close();
+              point_size = 3 * dtype.bytes();
+              struct stat sbuf;
+              if (stat (data_filename.c_str(), &sbuf))
+                throw Exception ("cannot stat track data file \"" + data_filename + "\": " + strerror (errno));
+              if (sbuf.st_size > data_offset) {
+                mmap.reset (new File::MMap (File::Entry (data_filename, data_offset)));
+                current = mmap->address();
+                end = current + mmap->size();
+                load_index (file);
+              }
               auto opt = App::get_options ("tck_weights_in");
               if (opt.size()) {
-                weights_file.reset (new std::ifstream (str(opt[0][0]).c_str(), std::ios_base::in));
-                if (!weights_file->good())
-                  throw Exception ("Unable to open streamlines weights file " + str(opt[0][0]));
+                weights_path = str(opt[0][0]);
+                open_weights();
               }
             }
 
@@ -79,94 +105,228 @@ namespace MR
             bool operator() (Streamline<ValueType>& tck) {
               tck.clear();
 
-              if (!in.is_open())
+              if (!mmap)
                 return false;
 
-              do {
-                auto p = get_next_point();
-                if (std::isinf (p[0])) {
-                  in.close();
-                  check_excess_weights();
-                  return false;
-                }
-                if (in.eof()) {
-                  in.close();
-                  check_excess_weights();
+              const uint8_t* delimiter = find_delimiter (current);
+              if (!delimiter) {
+                current = end;
+                check_excess_weights();
+                return false;
+              }
+
+              load_points (tck, current, (delimiter - current) / point_size);
+              current = delimiter + point_size;
+              tck.index = current_index++;
+
+              if (weights_file) {
+                if (!get_next_weight (tck.weight)) {
+                  WARN ("Streamline weights file contains less entries than .tck file; only read " + str(current_index-1) + " streamlines");
+                  close();
+                  tck.clear();
                   return false;
                 }
+              } else {
+                tck.weight = 1.0;
+              }
 
-                if (std::isnan (p[0])) {
-                  tck.index = current_index++;
+              return true;
+            }
 
-                  if (weights_file) {
 
-                    (*weights_file) >> tck.weight;
-                    if (weights_file->fail()) {
-                      WARN ("Streamline weights file contains less entries than .tck file; only read " + str(current_index-1) + " streamlines");
-                      in.close();
-                      tck.clear();
-                      return false;
-                    }
+            //! whether a valid streamline index was found for this file
+            bool has_index () const { return bool (index_map); }
+            //! the number of streamlines listed in the index
+            size_t num_indexed () const { return index_count; }
+            //! the number of points in streamline \a n, as listed in the index
+            size_t indexed_size (size_t n) const { assert (n < index_count); return index_entry (n, 1); }
+
+            //! position the reader such that the next streamline read will be that at \a index
+            /*! This is immediate if the file has a streamline index;
+             * otherwise, the file is scanned from the current position (or
+             * from the start if \a index precedes it). */
+            void seek (size_t index) {
+              if (!mmap)
+                return;
+              if (index < current_index) {
+                current = mmap->address();
+                current_index = 0;
+                open_weights();
+              }
 
-                  } else {
-                    tck.weight = 1.0;
-                  }
+              if (has_index()) {
+                const uint64_t target = std::min<uint64_t> (index, index_count);
+                current = target < index_count ? mmap->address() + index_entry (target, 0) : end;
+                skip_weights (target - current_index);
+                current_index = target;
+                return;
+              }
 
-                  return true;
+              while (current_index < index) {
+                const uint8_t* delimiter = find_delimiter (current);
+                if (!delimiter) {
+                  current = end;
+                  return;
                 }
-
-                tck.push_back (p);
-              } while (in.good());
-
-              in.close();
-              return false;
+                current = delimiter + point_size;
+                ++current_index;
+                skip_weights (1);
+              }
             }
 
+            //! release the memory-mapping of the track data
+            void close () {
+              mmap.reset();
+              index_map.reset();
+              current = end = nullptr;
+            }
 
 
         protected:
           using __ReaderBase__::in;
           using __ReaderBase__::dtype;
+          using __ReaderBase__::data_filename;
+          using __ReaderBase__::data_offset;
 
           uint64_t current_index;
+          std::unique_ptr<File::MMap> mmap, index_map;
+          const uint8_t* current;
+          const uint8_t* end;
+          size_t point_size, index_count;
+          std::string weights_path;
           std::unique_ptr<std::ifstream> weights_file;
+          std::string weights_buffer;
+          size_t weights_pos;
+
+          //! map the streamline index for track file \a file, if present and up to date
+          void load_index (const std::string& file)
+          {
+            const std::string path = index_path (file);
+            if (!Path::is_file (path))
+              return;
+            try {
+              std::unique_ptr<File::MMap> map (new File::MMap (File::Entry (path, 0)));
+              if (map->size() >= TCK_INDEX_HEADER_SIZE && !memcmp (map->address(), TCK_INDEX_MAGIC, 8)) {
+                const uint64_t count = Raw::fetch_LE<uint64_t> (map->address(), 1);
+                const uint64_t size = Raw::fetch_LE<uint64_t> (map->address(), 2);
+                if (size == uint64_t (mmap->size()) && uint64_t (map->size()) >= TCK_INDEX_HEADER_SIZE + 2*sizeof(uint64_t)*count) {
+                  DEBUG ("using streamline index \"" + path + "\" (" + str(count) + " streamlines)");
+                  index_map = std::move (map);
+                  index_count = count;
+                  return;
+                }
+              }
+            }
+            catch (Exception&) { }
+            INFO ("ignoring invalid or out of date streamline index \"" + path + "\"");
+          }
+
+          //! entry \a field (0: byte offset, 1: number of points) of streamline \a n in the index
+          uint64_t index_entry (size_t n, size_t field) const
+          {
+            return Raw::fetch_LE<uint64_t> (index_map->address() + TCK_INDEX_HEADER_SIZE, 2*n + field);
+          }
+
+          //! the address of the next delimiter at or after \a address, or nullptr if the end of the data is reached
+          const uint8_t* find_delimiter (const uint8_t* address) const
+          {
+            for (; address + point_size <= end; address += point_size) {
+              const ValueType x = get_value (address);
+              if (std::isinf (x))
+                return nullptr;
+              if (std::isnan (x))
+                return address;
+            }
+            return nullptr;
+          }
+
+          //! the first coordinate of the point at \a address, taking care of byte ordering issues
+          ValueType get_value (const uint8_t* address) const
+          {
+            switch (dtype()) {
+              case DataType::Float32LE: return ValueType (Raw::fetch_LE<float> (address));
+              case DataType::Float32BE: return ValueType (Raw::fetch_BE<float> (address));
+              case DataType::Float64LE: return ValueType (Raw::fetch_LE<double> (address));
+              case DataType::Float64BE: return ValueType (Raw::fetch_BE<double> (address));
+              default: assert (0); break;
+            }
+            return NaN;
+          }
+
+          //! copy \a num_points points starting at \a address into \a tck
+          void load_points (Streamline<ValueType>& tck, const uint8_t* address, size_t num_points) const
+          {
+            tck.resize (num_points);
+            if (!num_points)
+              return;
+            if (dtype == DataType::from<ValueType>()) {
+              memcpy (&tck[0][0], address, num_points * point_size);
+              return;
+            }
+            ValueType* p = &tck[0][0];
+            const size_t num_values = 3 * num_points;
+            switch (dtype()) {
+              case DataType::Float32LE: for (size_t n = 0; n < num_values; ++n) p[n] = ValueType (Raw::fetch_LE<float> (address, n)); break;
+              case DataType::Float32BE: for (size_t n = 0; n < num_values; ++n) p[n] = ValueType (Raw::fetch_BE<float> (address, n)); break;
+              case DataType::Float64LE: for (size_t n = 0; n < num_values; ++n) p[n] = ValueType (Raw::fetch_LE<double> (address, n)); break;
+              case DataType::Float64BE: for (size_t n = 0; n < num_values; ++n) p[n] = ValueType (Raw::fetch_BE<double> (address, n)); break;
+              default: assert (0); break;
+            }
+          }
 
-          //! takes care of byte ordering issues
-
-            Eigen::Matrix<ValueType,3,1> get_next_point ()
-            { 
-              using namespace ByteOrder;
-              switch (dtype()) {
-                case DataType::Float32LE: 
-                  {
-                    float p[3];
-                    in.read ((char*) p, sizeof (p));
-                    return { ValueType(LE(p[0])), ValueType(LE(p[1])), ValueType(LE(p[2])) };
-                  }
-                case DataType::Float32BE:
-                  {
-                    float p[3];
-                    in.read ((char*) p, sizeof (p));
-                    return { ValueType(BE(p[0])), ValueType(BE(p[1])), ValueType(BE(p[2])) };
-                  }
-                case DataType::Float64LE:
-                  {
-                    double p[3];
-                    in.read ((char*) p, sizeof (p));
-                    return { ValueType(LE(p[0])), ValueType(LE(p[1])), ValueType(LE(p[2])) };
-                  }
-                case DataType::Float64BE:
-                  {
-                    double p[3];
-                    in.read ((char*) p, sizeof (p));
-                    return { ValueType(BE(p[0])), ValueType(BE(p[1])), ValueType(BE(p[2])) };
-                  }
-                default:
-                  assert (0);
-                  break;
+          //! read the next entry from the weights file
+          /*! The file is read in large chunks, and the entries parsed
+           * directly from the buffer, avoiding the overhead of formatted
+           * stream input for each entry. */
+          bool get_next_weight (float& weight)
+          {
+            while (true) {
+              while (weights_pos < weights_buffer.size() && std::isspace (weights_buffer[weights_pos]))
+                ++weights_pos;
+              size_t token_end = weights_pos;
+              while (token_end < weights_buffer.size() && !std::isspace (weights_buffer[token_end]))
+                ++token_end;
+
+              if (token_end < weights_buffer.size() || !weights_file->good()) {
+                if (token_end == weights_pos)
+                  return false;
+                char* parse_end;
+                weight = std::strtof (weights_buffer.c_str() + weights_pos, &parse_end);
+                if (parse_end != weights_buffer.c_str() + token_end)
+                  return false;
+                weights_pos = token_end;
+                return true;
               }
-              return { NaN, NaN, NaN };
+
+              weights_buffer.erase (0, weights_pos);
+              weights_pos = 0;
+              const size_t previous_size = weights_buffer.size();
+              weights_buffer.resize (previous_size + TCK_WEIGHTS_CHUNK_SIZE);
+              weights_file->read (&weights_buffer[previous_size], TCK_WEIGHTS_CHUNK_SIZE);
+              weights_buffer.resize (previous_size + weights_file->gcount());
             }
+          }
+
+          void open_weights ()
+          {
+            if (weights_path.empty())
+              return;
+            weights_file.reset (new std::ifstream (weights_path.c_str(), std::ios_base::in | std::ios_base::binary));
+            if (!weights_file->good())
+              throw Exception ("Unable to open streamlines weights file " + weights_path);
+            weights_buffer.clear();
+            weights_pos = 0;
+          }
+
+          void skip_weights (size_t number)
+          {
+            if (!weights_file)
+              return;
+            float temp;
+            for (size_t n = 0; n < number; ++n)
+              if (!get_next_weight (temp))
+                return;
+          }
 
           //! Check that the weights file does not contain excess entries
           void check_excess_weights()
@@ -174,9 +334,9 @@ namespace MR
             if (!weights_file)
               return;
             float temp;
-            (*weights_file) >> temp;
-            if (!weights_file->fail())
+            if (get_next_weight (temp))
               WARN ("Streamline weights file contains more entries than .tck file");
+            weights_file.reset();
           }
 
           Reader (const Reader&) = delete;
@@ -217,8 +377,18 @@ namespace MR
           typedef Eigen::Matrix<ValueType,3,1> vector_type;
 
           //! create a new track file with the specified properties
+          //CONF option: TrackWriterIndex
+          //CONF default: 0 (false)
+          //CONF A boolean value to indicate whether an index of the
+          //CONF streamlines (holding the location and number of points of
+          //CONF each streamline) should be written alongside each track
+          //CONF file, with the additional suffix '.idx'. This allows
+          //CONF subsequent commands to jump directly to any given
+          //CONF streamline.
           WriterUnbuffered (const std::string& file, const Properties& properties) :
-              __WriterBase__<ValueType> (file) {
+              __WriterBase__<ValueType> (file),
+              points_written (0),
+              streamlines_indexed (0) {
 
             if (!Path::has_suffix (name, ".tck"))
               throw Exception ("output track files must use the .tck suffix");
@@ -243,6 +413,16 @@ namespace MR
               throw Exception ("error writing tracks file \"" + name + "\": " + strerror (errno));
             open_success = true;
 
+            const std::string index = index_path (name);
+            if (Path::exists (index))
+              File::unlink (index);
+            if (File::Config::get_bool ("TrackWriterIndex", false)) {
+              index_name = index;
+              File::OFStream index_out (index_name, std::ios::out | std::ios::binary | std::ios::trunc);
+              index_out.write (TCK_INDEX_MAGIC, 8);
+              update_index (index_out);
+            }
+
             auto opt = App::get_options ("tck_weights_out");
             if (opt.size())
               set_weights_path (opt[0][0]);
@@ -257,6 +437,7 @@ namespace MR
                 format_point (tck[n], buffer[n]);
               format_point (delimiter(), buffer[tck.size()]);
 
+              add_index_entry (points_written, tck.size());
               commit (buffer, tck.size()+1);
 
               if (weights_name.size()) 
@@ -279,8 +460,10 @@ namespace MR
           }
 
         protected:
-          std::string weights_name;
+          std::string weights_name, index_name;
           int64_t barrier_addr;
+          uint64_t points_written, streamlines_indexed;
+          std::vector<uint64_t> index_buffer;
 
           //! indicates end of track and start of new track
           vector_type delimiter () const { return { ValueType(NaN), ValueType(NaN), ValueType(NaN) }; }
@@ -323,6 +506,33 @@ namespace MR
             out.write (reinterpret_cast<const char* const> (data), sizeof(vector_type));
             verify_stream (out);
             update_counts (out);
+            points_written += num_points;
+
+            if (index_name.size()) {
+              File::OFStream index_out (index_name, std::ios::in | std::ios::out | std::ios::binary | std::ios::ate);
+              index_out.write (reinterpret_cast<const char*> (index_buffer.data()), index_buffer.size() * sizeof (uint64_t));
+              streamlines_indexed += index_buffer.size() / 2;
+              update_index (index_out);
+              index_buffer.clear();
+            }
+          }
+
+
+          //! record the location of a streamline of \a num_points points, starting \a offset points into the track data
+          void add_index_entry (uint64_t offset, uint64_t num_points) {
+            if (index_name.empty())
+              return;
+            index_buffer.push_back (ByteOrder::LE (uint64_t (offset * sizeof (vector_type))));
+            index_buffer.push_back (ByteOrder::LE (num_points));
+          }
+
+          //! write the number of streamlines and size of the track data into the index header
+          void update_index (File::OFStream& out) {
+            const uint64_t header[] = { ByteOrder::LE (streamlines_indexed), ByteOrder::LE (uint64_t ((points_written + 1) * sizeof (vector_type))) };
+            out.seekp (8);
+            out.write (reinterpret_cast<const char*> (header), sizeof (header));
+            if (!out.good())
+              throw Exception ("error writing streamline index file \"" + index_name + "\": " + strerror (errno));
           }
 
 
@@ -358,6 +568,8 @@ namespace MR
           using WriterUnbuffered<ValueType>::format_point;
           using WriterUnbuffered<ValueType>::weights_name;
           using WriterUnbuffered<ValueType>::write_weights;
+          using WriterUnbuffered<ValueType>::points_written;
+          using WriterUnbuffered<ValueType>::add_index_entry;
           typedef typename WriterUnbuffered<ValueType>::vector_type vector_type;
 
           //! create new RAM-buffered track file with specified properties
@@ -390,6 +602,8 @@ namespace MR
               if (buffer_size + tck.size() + 2 > buffer_capacity)
                 commit ();
 
+              add_index_entry (points_written + buffer_size, tck.size());
+
               for (const auto& i : tck)
                 add_point (i);
               add_point (delimiter());
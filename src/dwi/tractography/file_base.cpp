@@ -75,6 +75,9 @@ namespace MR {
         else
           fname = file;
 
+        data_filename = fname;
+        data_offset = offset;
+
         in.open (fname.c_str(), std::ios::in | std::ios::binary);
         if (!in)
           throw Exception ("error opening " + type  + " data file \"" + fname + "\": " + strerror(errno));
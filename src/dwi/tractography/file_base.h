@@ -28,6 +28,9 @@
 
 
 
+#define TCK_INDEX_MAGIC "MRTCKIDX"
+#define TCK_INDEX_HEADER_SIZE 24
+
 namespace MR
 {
   namespace DWI
@@ -35,6 +38,16 @@ namespace MR
     namespace Tractography
     {
 
+      //! the path of the streamline index sidecar for track file \a path
+      /*! The index is a binary file, holding the magic string
+       * TCK_INDEX_MAGIC, followed by the number of streamlines and the size
+       * in bytes of the track data (to detect out of date indices), then
+       * the byte offset (relative to the start of the track data) and
+       * number of points of each streamline. All values are stored as
+       * little-endian 64-bit unsigned integers. */
+      inline std::string index_path (const std::string& path) { return path + ".idx"; }
+
+
       //! \cond skip
       class __ReaderBase__
       {
@@ -52,6 +65,8 @@ namespace MR
 
           std::ifstream  in;
           DataType  dtype;
+          std::string data_filename;
+          int64_t data_offset;
       };
 
 
@@ -154,60 +154,52 @@ namespace MR {
 
 
 
-          class SetVoxel : public std::set<Voxel>, public Mapping::SetVoxelExtras
+          class SetVoxel : public MappedSet<Voxel>, public Mapping::SetVoxelExtras
           {
             public:
               typedef Voxel VoxType;
               inline void insert (const Eigen::Vector3i& v, const float l, const float f)
               {
                 const Voxel temp (v, l, f);
-                iterator existing = std::set<Voxel>::find (temp);
-                if (existing == std::set<Voxel>::end())
-                  std::set<Voxel>::insert (temp);
-                else
-                  (*existing).add (l, f);
+                const Voxel* existing = insert_or_find (temp);
+                if (existing)
+                  existing->add (l, f);
               }
           };
-          class SetVoxelDEC : public std::set<VoxelDEC>, public Mapping::SetVoxelExtras
+          class SetVoxelDEC : public MappedSet<VoxelDEC>, public Mapping::SetVoxelExtras
           {
             public:
               typedef VoxelDEC VoxType;
               inline void insert (const Eigen::Vector3i& v, const Eigen::Vector3f& d, const float l, const float f)
               {
                 const VoxelDEC temp (v, d, l, f);
-                iterator existing = std::set<VoxelDEC>::find (temp);
-                if (existing == std::set<VoxelDEC>::end())
-                  std::set<VoxelDEC>::insert (temp);
-                else
-                  (*existing).add (d, l, f);
+                const VoxelDEC* existing = insert_or_find (temp);
+                if (existing)
+                  existing->add (d, l, f);
               }
           };
-          class SetDixel : public std::set<Dixel>, public Mapping::SetVoxelExtras
+          class SetDixel : public MappedSet<Dixel>, public Mapping::SetVoxelExtras
           {
             public:
               typedef Dixel VoxType;
               inline void insert (const Eigen::Vector3i& v, const size_t d, const float l, const float f)
               {
                 const Dixel temp (v, d, l, f);
-                iterator existing = std::set<Dixel>::find (temp);
-                if (existing == std::set<Dixel>::end())
-                  std::set<Dixel>::insert (temp);
-                else
-                  (*existing).add (l, f);
+                const Dixel* existing = insert_or_find (temp);
+                if (existing)
+                  existing->add (l, f);
               }
           };
-          class SetVoxelTOD : public std::set<VoxelTOD>, public Mapping::SetVoxelExtras
+          class SetVoxelTOD : public MappedSet<VoxelTOD>, public Mapping::SetVoxelExtras
           {
             public:
               typedef VoxelTOD VoxType;
               inline void insert (const Eigen::Vector3i& v, const Eigen::VectorXf& t, const float l, const float f)
               {
                 const VoxelTOD temp (v, t, l, f);
-                iterator existing = std::set<VoxelTOD>::find (temp);
-                if (existing == std::set<VoxelTOD>::end())
-                  std::set<VoxelTOD>::insert (temp);
-                else
-                  (*existing).add (t, l, f);
+                const VoxelTOD* existing = insert_or_find (temp);
+                if (existing)
+                  existing->add (t, l, f);
               }
           };
 
@@ -21,9 +21,12 @@
 #include "progressbar.h"
 #include "thread_queue.h"
 #include "dwi/tractography/file.h"
+#include "dwi/tractography/sharded_reader.h"
 #include "dwi/tractography/streamline.h"
 
 
+#define TRACK_LOADER_PROGRESS_INTERVAL 256
+
 namespace MR {
   namespace DWI {
     namespace Tractography {
@@ -65,6 +68,68 @@ namespace MR {
         };
 
 
+
+        //! a multi-threaded equivalent of TrackLoader
+        /*! This should be wrapped in Thread::multi() at the head of the
+         * pipeline; each copy reads different shards of the track file (see
+         * ShardedReader). Streamlines are therefore not delivered in order,
+         * and those beyond \a to_load are skipped rather than terminating
+         * the read. */
+        class ShardedTrackLoader
+        {
+
+          public:
+            ShardedTrackLoader (ShardedReader<>& file, const size_t to_load = 0, const std::string& msg = "mapping tracks to image") :
+              reader (file),
+              tracks_to_load (to_load),
+              progress (msg.size() ? new Progress (msg, tracks_to_load) : nullptr),
+              pending (0) { }
+
+            ShardedTrackLoader (const ShardedTrackLoader& that) :
+              reader (that.reader),
+              tracks_to_load (that.tracks_to_load),
+              progress (that.progress),
+              pending (0) { }
+
+            ~ShardedTrackLoader () { update_progress(); }
+
+            bool operator() (Streamline<>& out)
+            {
+              do {
+                if (!reader (out)) {
+                  update_progress();
+                  return false;
+                }
+              } while (tracks_to_load && out.index >= tracks_to_load);
+              if (progress && ++pending == TRACK_LOADER_PROGRESS_INTERVAL)
+                update_progress();
+              return true;
+            }
+
+          protected:
+            class Progress {
+              public:
+                Progress (const std::string& msg, size_t target) : bar (msg, target) { }
+                ProgressBar bar;
+                std::mutex mutex;
+            };
+
+            ShardedReader<> reader;
+            const size_t tracks_to_load;
+            std::shared_ptr<Progress> progress;
+            size_t pending;
+
+            void update_progress () {
+              if (!progress || !pending)
+                return;
+              std::lock_guard<std::mutex> lock (progress->mutex);
+              for (; pending; --pending)
+                ++progress->bar;
+            }
+
+        };
+
+
       }
     }
   }
@@ -18,11 +18,16 @@
 
 
 
-#include <set>
+#include <algorithm>
+#include <vector>
 
 #include "image.h"
 
 
+// the minimum size of the hash table used to locate elements in a MappedSet:
+#define MAPPED_SET_MIN_TABLE_SIZE 64
+
+
 namespace MR {
   namespace DWI {
     namespace Tractography {
@@ -252,6 +257,105 @@ namespace MR {
 
 
 
+        // Hash functions used to locate elements in a MappedSet; these must be
+        //   consistent with the corresponding operator== of each class
+        inline size_t hash (const Voxel& v)
+        {
+          return (size_t(v[0]) * 73856093) ^ (size_t(v[1]) * 19349663) ^ (size_t(v[2]) * 83492791);
+        }
+        inline size_t hash (const Dixel& d)
+        {
+          return hash (static_cast<const Voxel&> (d)) ^ (d.get_dir() * 2654435761);
+        }
+
+
+
+
+        //! a set of mapped elements (voxels, dixels, ...), held in a contiguous vector
+        /*! This provides the subset of the std::set interface needed for
+         * streamline mapping. Elements are appended to a vector in order of
+         * insertion, with a small open-addressing hash table of indices into
+         * that vector used to find any existing entry for the same element,
+         * so that contributions are merged exactly as they would be in a
+         * std::set. The elements are sorted when the set is next iterated
+         * over, so that they are also presented in the same order.
+         *
+         * Unlike std::set, this does not perform a heap allocation per
+         * element: the storage is retained when the set is cleared, and since
+         * the same set objects are reused for every streamline processed by
+         * a given thread (they are recycled by the thread queues, or held as
+         * members of the relevant functor), steady-state mapping performs no
+         * heap allocation at all. */
+        template <class ElementType>
+          class MappedSet
+          {
+            public:
+              typedef typename std::vector<ElementType>::const_iterator const_iterator;
+              // as with std::set, elements can only be modified through their mutable members:
+              typedef const_iterator iterator;
+
+              MappedSet () : sorted (true), indexed (true) { }
+
+              const_iterator begin () const { sort(); return elements.cbegin(); }
+              const_iterator end () const { sort(); return elements.cend(); }
+              size_t size () const { return elements.size(); }
+              bool empty () const { return elements.empty(); }
+              void clear () { elements.clear(); table.clear(); sorted = indexed = true; }
+
+              //! insert \a element if not already present; otherwise return the existing entry
+              const ElementType* insert_or_find (const ElementType& element)
+              {
+                if (!indexed || 2 * (elements.size()+1) > table.size())
+                  reindex (2 * (elements.size()+1));
+                const size_t mask = table.size() - 1;
+                for (size_t slot = hash (element) & mask; ; slot = (slot+1) & mask) {
+                  if (!table[slot]) {
+                    elements.push_back (element);
+                    table[slot] = elements.size();
+                    sorted = false;
+                    return nullptr;
+                  }
+                  const ElementType& existing (elements[table[slot]-1]);
+                  if (existing == element)
+                    return &existing;
+                }
+              }
+
+            private:
+              mutable std::vector<ElementType> elements;
+              std::vector<uint32_t> table; // 1 + index into elements, or 0 if empty
+              mutable bool sorted, indexed;
+
+              void sort () const
+              {
+                if (sorted)
+                  return;
+                std::sort (elements.begin(), elements.end());
+                sorted = true;
+                indexed = false;
+              }
+
+              void reindex (size_t min_size)
+              {
+                size_t size = MAPPED_SET_MIN_TABLE_SIZE;
+                while (size < min_size)
+                  size *= 2;
+                table.assign (size, 0);
+                for (size_t n = 0; n < elements.size(); ++n) {
+                  size_t slot = hash (elements[n]) & (size-1);
+                  while (table[slot])
+                    slot = (slot+1) & (size-1);
+                  table[slot] = n+1;
+                }
+                indexed = true;
+              }
+          };
+
+
+
+
+
+
         class SetVoxelExtras
         {
           public:
@@ -267,16 +371,14 @@ namespace MR {
 
         // Set classes that give sensible behaviour to the insert() function depending on the base voxel class
 
-        class SetVoxel : public std::set<Voxel>, public SetVoxelExtras
+        class SetVoxel : public MappedSet<Voxel>, public SetVoxelExtras
         {
           public:
             typedef Voxel VoxType;
             inline void insert (const Voxel& v)
             {
-              iterator existing = std::set<Voxel>::find (v);
-              if (existing == std::set<Voxel>::end())
-                std::set<Voxel>::insert (v);
-              else
+              const Voxel* existing = insert_or_find (v);
+              if (existing)
                 (*existing) += v.get_length();
             }
             inline void insert (const Eigen::Vector3i& v, const float l)
@@ -290,16 +392,14 @@ namespace MR {
 
 
 
-        class SetVoxelDEC : public std::set<VoxelDEC>, public SetVoxelExtras
+        class SetVoxelDEC : public MappedSet<VoxelDEC>, public SetVoxelExtras
         {
           public:
             typedef VoxelDEC VoxType;
             inline void insert (const VoxelDEC& v)
             {
-              iterator existing = std::set<VoxelDEC>::find (v);
-              if (existing == std::set<VoxelDEC>::end())
-                std::set<VoxelDEC>::insert (v);
-              else
+              const VoxelDEC* existing = insert_or_find (v);
+              if (existing)
                 existing->add (v.get_colour(), v.get_length());
             }
             inline void insert (const Eigen::Vector3i& v, const Eigen::Vector3f& d)
@@ -317,16 +417,14 @@ namespace MR {
 
 
 
-        class SetVoxelDir : public std::set<VoxelDir>, public SetVoxelExtras
+        class SetVoxelDir : public MappedSet<VoxelDir>, public SetVoxelExtras
         {
           public:
             typedef VoxelDir VoxType;
             inline void insert (const VoxelDir& v)
             {
-              iterator existing = std::set<VoxelDir>::find (v);
-              if (existing == std::set<VoxelDir>::end())
-                std::set<VoxelDir>::insert (v);
-              else
+              const VoxelDir* existing = insert_or_find (v);
+              if (existing)
                 existing->add (v.get_dir(), v.get_length());
             }
             inline void insert (const Eigen::Vector3i& v, const Eigen::Vector3f& d)
@@ -342,16 +440,14 @@ namespace MR {
         };
 
 
-        class SetDixel : public std::set<Dixel>, public SetVoxelExtras
+        class SetDixel : public MappedSet<Dixel>, public SetVoxelExtras
         {
           public:
             typedef Dixel VoxType;
             inline void insert (const Dixel& v)
             {
-              iterator existing = std::set<Dixel>::find (v);
-              if (existing == std::set<Dixel>::end())
-                std::set<Dixel>::insert (v);
-              else
+              const Dixel* existing = insert_or_find (v);
+              if (existing)
                 (*existing) += v.get_length();
             }
             inline void insert (const Eigen::Vector3i& v, const size_t d)
@@ -370,16 +466,14 @@ namespace MR {
 
 
 
-        class SetVoxelTOD : public std::set<VoxelTOD>, public SetVoxelExtras
+        class SetVoxelTOD : public MappedSet<VoxelTOD>, public SetVoxelExtras
         {
           public:
             typedef VoxelTOD VoxType;
             inline void insert (const VoxelTOD& v)
             {
-              iterator existing = std::set<VoxelTOD>::find (v);
-              if (existing == std::set<VoxelTOD>::end())
-                std::set<VoxelTOD>::insert (v);
-              else
+              const VoxelTOD* existing = insert_or_find (v);
+              if (existing)
                 (*existing) += v.get_tod();
             }
             inline void insert (const Eigen::Vector3i& v, const Eigen::VectorXf& t)
@@ -14,8 +14,14 @@
  */
 
 
+#include <atomic>
+#include <numeric>
+
+#include "file/config.h"
 #include "dwi/tractography/mapping/writer.h"
 
+#define LOCAL_MAP_BUFFER_MIN_TABLE_SIZE 1024
+
 
 namespace MR {
 namespace DWI {
@@ -28,6 +34,214 @@ const char* writer_dims[] = { "undefined", "greyscale", "DEC", "dixel", "TOD", N
 
 
 
+
+
+
+namespace {
+
+  inline size_t hash_index (size_t index)
+  {
+    index *= 0x9E3779B97F4A7C15ULL;
+    return index ^ (index >> 32);
+  }
+
+  bool use_sparse_buffers (size_t bytes_per_buffer)
+  {
+    //CONF option: TckmapLocalBufferMemory
+    //CONF default: 1024
+    //CONF The maximum amount of memory (in MB) to be used for the dense
+    //CONF thread-local buffers of tckmap -local_buffers, summed over all
+    //CONF threads; sparse buffers are used if this would be exceeded.
+    const size_t budget = File::Config::get_int ("TckmapLocalBufferMemory", 1024);
+    const size_t num_buffers = std::max (Thread::number_of_threads(), size_t(1));
+    const bool sparse = num_buffers * bytes_per_buffer > budget * 1024 * 1024;
+    INFO (std::string ("using ") + (sparse ? "sparse" : "dense") + " thread-local buffers for track mapping");
+    return sparse;
+  }
+
+}
+
+
+
+LocalMapBuffers::LocalMapBuffers (const Header& header, const vox_stat_t voxel_statistic, const writer_dim type) :
+    voxel_statistic (voxel_statistic),
+    type (type),
+    dims {{ size_t (header.size(0)), size_t (header.size(1)), size_t (header.size(2)) }},
+    elements_per_voxel (type == DIXEL ? header.size(3) : 1),
+    num_values ((type == DEC || type == TOD) ? header.size(3) : 1),
+    // Entry for the MapWriter counts buffer: same conditions as in the MapWriter constructor
+    stride (num_values + (((type != DEC && voxel_statistic == V_MEAN) ||
+                           (type == TOD && (voxel_statistic == V_MIN || voxel_statistic == V_MAX)) ||
+                           (type == DEC && voxel_statistic == V_SUM)) ? 1 : 0)),
+    sparse (use_sparse_buffers (dims[0] * dims[1] * dims[2] * elements_per_voxel * stride * sizeof(float))),
+    identity (stride, 0.0f)
+{
+  // Initial values as per the MapWriter buffer
+  if (voxel_statistic == V_MIN)
+    std::fill (identity.begin(), identity.begin() + num_values, std::numeric_limits<float>::max());
+  else if (voxel_statistic == V_MAX && (type == GREYSCALE || type == DIXEL))
+    identity[0] = std::numeric_limits<float>::lowest();
+}
+
+
+
+LocalMapBuffer& LocalMapBuffers::create ()
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  buffers.push_back (std::unique_ptr<LocalMapBuffer> (new LocalMapBuffer (*this)));
+  return *buffers.back();
+}
+
+
+
+void LocalMapBuffers::sort ()
+{
+  if (!sparse)
+    return;
+  class Sorter {
+    public:
+      std::vector<std::unique_ptr<LocalMapBuffer>>& buffers;
+      std::atomic<size_t>& next;
+      void execute () {
+        size_t n;
+        while ((n = next++) < buffers.size())
+          buffers[n]->sort();
+      }
+  };
+  std::atomic<size_t> next (0);
+  Sorter sorter = { buffers, next };
+  Thread::run (Thread::multi (sorter), "sorting thread-local buffers").wait();
+}
+
+
+
+void LocalMapBuffers::reduce (size_t first, size_t last, std::vector<float>& data) const
+{
+  data.resize ((last - first) * stride);
+  for (size_t n = 0; n < data.size(); n += stride)
+    std::copy (identity.begin(), identity.end(), data.begin() + n);
+  for (const auto& buffer : buffers)
+    buffer->for_each (first, last, [&] (size_t index, const float* in) { combine (&data[(index-first)*stride], in); });
+}
+
+
+
+bool LocalMapBuffers::modified (const float* data) const
+{
+  for (size_t n = 0; n != stride; ++n)
+    if (data[n] != identity[n])
+      return true;
+  return false;
+}
+
+
+
+void LocalMapBuffers::combine (float* data, const float* in) const
+{
+  switch (voxel_statistic) {
+    case V_SUM:
+    case V_MEAN:
+      for (size_t n = 0; n != stride; ++n)
+        data[n] += in[n];
+      break;
+    case V_MIN:
+      if (type == DEC) {
+        if (Eigen::Map<const Eigen::Vector3f> (in).squaredNorm() < Eigen::Map<const Eigen::Vector3f> (data).squaredNorm())
+          std::copy (in, in + stride, data);
+      } else if (type == TOD) {
+        if (in[num_values] < data[num_values])
+          std::copy (in, in + stride, data);
+      } else {
+        data[0] = std::min (data[0], in[0]);
+      }
+      break;
+    case V_MAX:
+      if (type == DEC) {
+        if (Eigen::Map<const Eigen::Vector3f> (in).squaredNorm() > Eigen::Map<const Eigen::Vector3f> (data).squaredNorm())
+          std::copy (in, in + stride, data);
+      } else if (type == TOD) {
+        if (in[num_values] > data[num_values])
+          std::copy (in, in + stride, data);
+      } else {
+        data[0] = std::max (data[0], in[0]);
+      }
+      break;
+    default:
+      throw Exception ("Unknown / unhandled voxel statistic in LocalMapBuffers::combine()");
+  }
+}
+
+
+
+
+
+
+void LocalMapBuffer::sort ()
+{
+  if (!parent.sparse)
+    return;
+  table = std::vector<uint32_t>();
+  std::vector<uint32_t> order (keys.size());
+  std::iota (order.begin(), order.end(), 0);
+  std::sort (order.begin(), order.end(), [&] (uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+  std::vector<size_t> sorted_keys (keys.size());
+  std::vector<float> sorted_data (data.size());
+  for (size_t n = 0; n != order.size(); ++n) {
+    sorted_keys[n] = keys[order[n]];
+    std::copy (data.begin() + order[n]*parent.stride, data.begin() + (order[n]+1)*parent.stride, sorted_data.begin() + n*parent.stride);
+  }
+  keys.swap (sorted_keys);
+  data.swap (sorted_data);
+}
+
+
+
+float* LocalMapBuffer::get (size_t index)
+{
+  if (!parent.sparse)
+    return &data[index * parent.stride];
+
+  if (2 * (keys.size() + 1) > table.size()) {
+    table.assign (std::max (2 * table.size(), size_t (LOCAL_MAP_BUFFER_MIN_TABLE_SIZE)), 0);
+    for (size_t n = 0; n != keys.size(); ++n) {
+      size_t slot = hash_index (keys[n]) & (table.size() - 1);
+      while (table[slot])
+        slot = (slot + 1) & (table.size() - 1);
+      table[slot] = n + 1;
+    }
+  }
+
+  for (size_t slot = hash_index (index) & (table.size() - 1);; slot = (slot + 1) & (table.size() - 1)) {
+    if (!table[slot]) {
+      keys.push_back (index);
+      table[slot] = keys.size();
+      data.insert (data.end(), parent.identity.begin(), parent.identity.end());
+      return &data[data.size() - parent.stride];
+    }
+    if (keys[table[slot]-1] == index)
+      return &data[(table[slot]-1) * parent.stride];
+  }
+}
+
+
+
+void LocalMapBuffer::receive_scalar (float* data, const float factor, const float weight) const
+{
+  switch (parent.voxel_statistic) {
+    case V_SUM:  data[0] += weight * factor;                break;
+    case V_MIN:  data[0] = std::min (data[0], factor);      break;
+    case V_MAX:  data[0] = std::max (data[0], factor);      break;
+    case V_MEAN:
+                 data[0] += weight * factor;
+                 data[1] += weight;
+                 break;
+    default:
+                 throw Exception ("Unknown / unhandled voxel statistic in LocalMapBuffer::receive_scalar()");
+  }
+}
+
+
+
 }
 }
 }
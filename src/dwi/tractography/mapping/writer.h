@@ -21,14 +21,17 @@
 #include "file/utils.h"
 #include "image.h"
 #include "algo/loop.h"
+#include "algo/threaded_loop.h"
 #include "thread_queue.h"
 
+#include "dwi/tractography/streamline.h"
 #include "dwi/tractography/mapping/twi_stats.h"
 #include "dwi/tractography/mapping/voxel.h"
 #include "dwi/tractography/mapping/gaussian/voxel.h"
 
 
 
+#include <mutex>
 #include <typeinfo>
 
 
@@ -44,6 +47,180 @@ namespace MR {
 
 
 
+        // These acquire the TWI factor at any point along the streamline;
+        //   For the standard SetVoxel classes, this is a single value 'factor' for the set as
+        //     stored in SetVoxelExtras
+        //   For the Gaussian SetVoxel classes, there is a factor per mapped element
+        inline float get_factor (const Voxel&    element, const SetVoxel&    set) { return set.factor; }
+        inline float get_factor (const VoxelDEC& element, const SetVoxelDEC& set) { return set.factor; }
+        inline float get_factor (const Dixel&    element, const SetDixel&    set) { return set.factor; }
+        inline float get_factor (const VoxelTOD& element, const SetVoxelTOD& set) { return set.factor; }
+        inline float get_factor (const Gaussian::Voxel&    element, const Gaussian::SetVoxel&    set) { return element.get_factor(); }
+        inline float get_factor (const Gaussian::VoxelDEC& element, const Gaussian::SetVoxelDEC& set) { return element.get_factor(); }
+        inline float get_factor (const Gaussian::Dixel&    element, const Gaussian::SetDixel&    set) { return element.get_factor(); }
+        inline float get_factor (const Gaussian::VoxelTOD& element, const Gaussian::SetVoxelTOD& set) { return element.get_factor(); }
+
+
+
+
+        class LocalMapBuffer;
+
+        //! The thread-local buffers used by MapAccumulator
+        /*! Rather than passing every mapped streamline to a single MapWriter,
+         * each MapAccumulator thread accumulates the contributions of the
+         * streamlines it maps into its own LocalMapBuffer; these are then
+         * combined into the MapWriter using MapWriterBase::reduce() once all
+         * streamlines have been mapped.
+         *
+         * Each element of the output image (a voxel, or a dixel) is stored as
+         * the values to be written to the output (1 for greyscale & dixel, 3
+         * for DEC, the number of SH coefficients for TOD), followed by the
+         * corresponding value of the MapWriter counts buffer where this is
+         * required for the voxel statistic.
+         *
+         * The buffers are dense (one entry for every element of the output) if
+         * their total size fits within the TckmapLocalBufferMemory config file
+         * entry, and sparse (entries only created for the elements traversed)
+         * otherwise. */
+        class LocalMapBuffers
+        {
+          public:
+            LocalMapBuffers (const Header& header, const vox_stat_t voxel_statistic, const writer_dim type);
+
+            LocalMapBuffers (const LocalMapBuffers&) = delete;
+
+            //! provide a new buffer for use by a single thread
+            LocalMapBuffer& create ();
+
+            //! prepare the buffers for reduction once mapping has completed
+            void sort ();
+
+            //! combine the values from all buffers for elements [first, last) into \a data
+            void reduce (size_t first, size_t last, std::vector<float>& data) const;
+
+            //! whether the element at \a data (as filled by reduce()) received any contributions
+            bool modified (const float* data) const;
+
+            size_t index (const Eigen::Vector3i& voxel) const { return voxel[0] + dims[0] * (voxel[1] + dims[1] * size_t(voxel[2])); }
+
+            const vox_stat_t voxel_statistic;
+            const writer_dim type;
+            const std::array<size_t,3> dims;
+            const size_t elements_per_voxel, num_values, stride;
+            const bool sparse;
+
+            // the initial value for each entry of an element:
+            std::vector<float> identity;
+
+          private:
+            std::vector<std::unique_ptr<LocalMapBuffer>> buffers;
+            std::mutex mutex;
+
+            void combine (float* data, const float* in) const;
+
+        };
+
+
+
+        class LocalMapBuffer
+        {
+          public:
+            LocalMapBuffer (const LocalMapBuffers& parent) :
+                parent (parent),
+                data (parent.sparse ? 0 : parent.stride * parent.dims[0] * parent.dims[1] * parent.dims[2] * parent.elements_per_voxel) {
+              if (!parent.sparse) {
+                for (size_t n = 0; n < data.size(); n += parent.stride)
+                  std::copy (parent.identity.begin(), parent.identity.end(), data.begin() + n);
+              }
+            }
+
+            bool operator() (const SetVoxel& in)    { receive_greyscale (in); return true; }
+            bool operator() (const SetVoxelDEC& in) { receive_dec       (in); return true; }
+            bool operator() (const SetDixel& in)    { receive_dixel     (in); return true; }
+            bool operator() (const SetVoxelTOD& in) { receive_tod       (in); return true; }
+
+            bool operator() (const Gaussian::SetVoxel& in)    { receive_greyscale (in); return true; }
+            bool operator() (const Gaussian::SetVoxelDEC& in) { receive_dec       (in); return true; }
+            bool operator() (const Gaussian::SetDixel& in)    { receive_dixel     (in); return true; }
+            bool operator() (const Gaussian::SetVoxelTOD& in) { receive_tod       (in); return true; }
+
+            //! sort the entries of a sparse buffer by element index
+            void sort ();
+
+            //! invoke \a functor (index, data) for all stored elements in [first, last)
+            template <class Functor>
+              void for_each (size_t first, size_t last, Functor&& functor) const
+              {
+                if (!parent.sparse) {
+                  for (size_t n = first; n < last; ++n)
+                    functor (n, &data[n*parent.stride]);
+                  return;
+                }
+                assert (table.empty());
+                for (size_t n = std::lower_bound (keys.begin(), keys.end(), first) - keys.begin(); n < keys.size() && keys[n] < last; ++n)
+                  functor (keys[n], &data[n*parent.stride]);
+              }
+
+          private:
+            const LocalMapBuffers& parent;
+            std::vector<float> data;
+
+            // for sparse buffers: the element index of each entry, and an
+            // open-addressing hash table from element index to (1 + entry)
+            std::vector<size_t> keys;
+            std::vector<uint32_t> table;
+
+            float* get (size_t index);
+
+            template <class Cont> void receive_greyscale (const Cont&);
+            template <class Cont> void receive_dec       (const Cont&);
+            template <class Cont> void receive_dixel     (const Cont&);
+            template <class Cont> void receive_tod       (const Cont&);
+
+            void receive_scalar (float* data, const float factor, const float weight) const;
+
+        };
+
+
+
+        //! map streamlines and accumulate the results into thread-local buffers
+        /*! This is used in place of separate mapping and MapWriter stages in
+         * the pipeline, and should be wrapped in Thread::multi(). Once all
+         * streamlines have been processed, the buffers should be combined
+         * using MapWriterBase::reduce(). */
+        template <class MapperType, class SetType>
+          class MapAccumulator
+        {
+          public:
+            MapAccumulator (const MapperType& mapper, LocalMapBuffers& buffers) :
+              mapper (mapper),
+              buffers (buffers),
+              buffer (nullptr) { }
+
+            MapAccumulator (const MapAccumulator& that) :
+              mapper (that.mapper),
+              buffers (that.buffers),
+              buffer (nullptr) { }
+
+            bool operator() (Streamline<>& in)
+            {
+              // buffers are only allocated by those copies that are run:
+              if (!buffer)
+                buffer = &buffers.create();
+              mapper (in, set);
+              return (*buffer) (set);
+            }
+
+          private:
+            MapperType mapper;
+            LocalMapBuffers& buffers;
+            LocalMapBuffer* buffer;
+            SetType set;
+        };
+
+
+
+
         class MapWriterBase
         {
 
@@ -65,6 +242,10 @@ namespace MR {
             // std::terminate() with no further ado).
             virtual void finalise() { }
 
+            // combine the thread-local buffers filled by MapAccumulator;
+            //   to be called prior to finalise()
+            virtual void reduce (LocalMapBuffers&) { throw Exception ("Thread-local buffers not supported by this writer"); }
+
 
 
             virtual bool operator() (const SetVoxel&)    { return false; }
@@ -169,7 +350,7 @@ namespace MR {
                 break;
 
               case V_MIN:
-                for (auto l = loop (buffer); l; ++l ) {
+                for (auto l = Loop (buffer) (buffer); l; ++l ) {
                   if (buffer.value() == std::numeric_limits<value_type>::max())
                     buffer.value() = value_type(0);
                 }
@@ -241,6 +422,8 @@ namespace MR {
           bool operator() (const Gaussian::SetDixel& in)    { receive_dixel     (in); return true; }
           bool operator() (const Gaussian::SetVoxelTOD& in) { receive_tod       (in); return true; }
 
+          void reduce (LocalMapBuffers&);
+
 
           private:
           Image<value_type> buffer;
@@ -252,20 +435,6 @@ namespace MR {
           template <class Cont> void receive_dixel     (const Cont&);
           template <class Cont> void receive_tod       (const Cont&);
 
-          // These acquire the TWI factor at any point along the streamline;
-          //   For the standard SetVoxel classes, this is a single value 'factor' for the set as
-          //     stored in SetVoxelExtras
-          //   For the Gaussian SetVoxel classes, there is a factor per mapped element
-          float get_factor (const Voxel&    element, const SetVoxel&    set) const { return set.factor; }
-          float get_factor (const VoxelDEC& element, const SetVoxelDEC& set) const { return set.factor; }
-          float get_factor (const Dixel&    element, const SetDixel&    set) const { return set.factor; }
-          float get_factor (const VoxelTOD& element, const SetVoxelTOD& set) const { return set.factor; }
-          float get_factor (const Gaussian::Voxel&    element, const Gaussian::SetVoxel&    set) const { return element.get_factor(); }
-          float get_factor (const Gaussian::VoxelDEC& element, const Gaussian::SetVoxelDEC& set) const { return element.get_factor(); }
-          float get_factor (const Gaussian::Dixel&    element, const Gaussian::SetDixel&    set) const { return element.get_factor(); }
-          float get_factor (const Gaussian::VoxelTOD& element, const Gaussian::SetVoxelTOD& set) const { return element.get_factor(); }
-
-
           // Convenience functions for Directionally-Encoded Colour processing
           Eigen::Vector3f get_dec ();
           void            set_dec (const Eigen::Vector3f&);
@@ -433,6 +602,152 @@ namespace MR {
 
 
 
+        template <typename value_type>
+          void MapWriter<value_type>::reduce (LocalMapBuffers& buffers)
+          {
+            buffers.sort();
+            const size_t slice = buffers.dims[0] * buffers.dims[1] * buffers.elements_per_voxel;
+            auto out = buffer;
+            auto out_counts = counts ? *counts : Image<float>();
+            std::vector<float> data;
+
+            ThreadedLoop ("combining thread-local buffers", buffer, { 2 }, { 0, 1 }).run_outer (
+              [&buffers, slice, out, out_counts, data] (const Iterator& pos) mutable
+              {
+                const size_t first = pos.index(2) * slice;
+                buffers.reduce (first, first + slice, data);
+                const float* p = data.data();
+                out.index(2) = pos.index(2);
+                for (out.index(1) = 0; out.index(1) != out.size(1); ++out.index(1)) {
+                  for (out.index(0) = 0; out.index(0) != out.size(0); ++out.index(0)) {
+                    for (size_t element = 0; element != buffers.elements_per_voxel; ++element, p += buffers.stride) {
+                      if (!buffers.modified (p))
+                        continue;
+                      if (buffers.type == DEC || buffers.type == TOD) {
+                        for (size_t n = 0; n != buffers.num_values; ++n) {
+                          out.index(3) = n;
+                          out.value() = value_type (p[n]);
+                        }
+                      } else {
+                        if (buffers.type == DIXEL)
+                          out.index(3) = element;
+                        out.value() = value_type (p[0]);
+                      }
+                      if (out_counts.valid()) {
+                        assign_pos_of (out, 0, 3).to (out_counts);
+                        if (buffers.type == DIXEL)
+                          out_counts.index(3) = element;
+                        out_counts.value() = p[buffers.num_values];
+                      }
+                    }
+                  }
+                }
+              });
+          }
+
+
+
+
+
+        template <class Cont>
+          void LocalMapBuffer::receive_greyscale (const Cont& in)
+          {
+            assert (parent.type == GREYSCALE);
+            for (const auto& i : in)
+              receive_scalar (get (parent.index (i)), get_factor (i, in), in.weight * i.get_length());
+          }
+
+
+
+        template <class Cont>
+          void LocalMapBuffer::receive_dixel (const Cont& in)
+          {
+            assert (parent.type == DIXEL);
+            for (const auto& i : in)
+              receive_scalar (get (parent.index (i) * parent.elements_per_voxel + i.get_dir()), get_factor (i, in), in.weight * i.get_length());
+          }
+
+
+
+        template <class Cont>
+          void LocalMapBuffer::receive_dec (const Cont& in)
+          {
+            assert (parent.type == DEC);
+            for (const auto& i : in) {
+              float* p = get (parent.index (i));
+              Eigen::Map<Eigen::Vector3f> value (p);
+              const float factor = get_factor (i, in);
+              const float weight = in.weight * i.get_length();
+              auto scaled_colour = i.get_colour();
+              scaled_colour *= factor;
+              switch (parent.voxel_statistic) {
+                case V_SUM:
+                  value += scaled_colour * weight;
+                  p[3] += weight;
+                  break;
+                case V_MIN:
+                  if (scaled_colour.squaredNorm() < value.squaredNorm())
+                    value = scaled_colour;
+                  break;
+                case V_MEAN:
+                  value += scaled_colour * weight;
+                  break;
+                case V_MAX:
+                  if (scaled_colour.squaredNorm() > value.squaredNorm())
+                    value = scaled_colour;
+                  break;
+                default:
+                  throw Exception ("Unknown / unhandled voxel statistic in LocalMapBuffer::receive_dec()");
+              }
+            }
+          }
+
+
+
+        template <class Cont>
+          void LocalMapBuffer::receive_tod (const Cont& in)
+          {
+            assert (parent.type == TOD);
+            const size_t N = parent.num_values;
+            for (const auto& i : in) {
+              float* p = get (parent.index (i));
+              const float factor = get_factor (i, in);
+              const float weight = in.weight * i.get_length();
+              switch (parent.voxel_statistic) {
+                case V_SUM:
+                  for (size_t index = 0; index != N; ++index)
+                    p[index] += i.get_tod()[index] * weight * factor;
+                  break;
+                  // As in MapWriter, the last entry holds the min/max factor
+                case V_MIN:
+                  if (factor < p[N]) {
+                    p[N] = factor;
+                    for (size_t index = 0; index != N; ++index)
+                      p[index] = i.get_tod()[index] * factor;
+                  }
+                  break;
+                case V_MAX:
+                  if (factor > p[N]) {
+                    p[N] = factor;
+                    for (size_t index = 0; index != N; ++index)
+                      p[index] = i.get_tod()[index] * factor;
+                  }
+                  break;
+                case V_MEAN:
+                  for (size_t index = 0; index != N; ++index)
+                    p[index] += i.get_tod()[index] * weight * factor;
+                  p[N] += weight;
+                  break;
+                default:
+                  throw Exception ("Unknown / unhandled voxel statistic in LocalMapBuffer::receive_tod()");
+              }
+            }
+          }
+
+
+
+
+
         template <typename value_type>
           Eigen::Vector3f MapWriter<value_type>::get_dec ()
           {
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#ifndef __dwi_tractography_sharded_reader_h__
+#define __dwi_tractography_sharded_reader_h__
+
+#include <atomic>
+#include <vector>
+
+#include "memory.h"
+#include "thread.h"
+#include "dwi/tractography/file.h"
+#include "dwi/tractography/properties.h"
+#include "dwi/tractography/streamline.h"
+
+
+#define TCK_SHARDS_PER_THREAD 16
+
+
+namespace MR
+{
+  namespace DWI
+  {
+    namespace Tractography
+    {
+
+
+      //! A class to read streamlines data from multiple threads concurrently
+      /*! This is intended to be used as the source of a Thread::run_queue()
+       * pipeline, wrapped in Thread::multi(). The track data are split into
+       * a number of shards, and each copy of the reader claims the next
+       * available shard whenever it has exhausted its current one.
+       * Streamlines are therefore \e not returned in file order; however,
+       * the index of each streamline within the file is preserved in
+       * Streamline::index, and any weights supplied via the
+       * -tck_weights_in option are assigned accordingly.
+       *
+       * If the file has a streamline index (see index_path()), the shards
+       * are defined from it directly. Otherwise, shard boundaries are placed
+       * at the first delimiter following evenly-spaced offsets into the
+       * track data, and the streamlines in each shard are counted (using
+       * multiple threads) on construction to establish their indices. */
+      template <class ValueType = float>
+      class ShardedReader
+      {
+        public:
+
+          //! open the \c file for reading and load header into \c properties
+          ShardedReader (const std::string& file, Properties& properties) :
+            shared (new Shared (file, properties)),
+            current (nullptr),
+            last (nullptr),
+            current_index (0) { }
+
+          //! copies share the same file & shards, but read different shards
+          ShardedReader (const ShardedReader& that) :
+            shared (that.shared),
+            current (nullptr),
+            last (nullptr),
+            current_index (0) { }
+
+
+          //! fetch next track from the current shard, claiming a new shard as required
+          bool operator() (Streamline<ValueType>& tck) {
+            tck.clear();
+
+            while (true) {
+              while (current >= last) {
+                if (!shared->next (current, last, current_index))
+                  return false;
+              }
+
+              const uint8_t* delimiter = shared->find_delimiter (current);
+              if (!delimiter || delimiter >= last) {
+                current = last;
+                continue;
+              }
+
+              const uint64_t index = current_index++;
+              if (shared->weights_path.size() && index >= shared->weights.size()) {
+                current = delimiter + shared->point_size;
+                continue;
+              }
+
+              shared->load_points (tck, current, (delimiter - current) / shared->point_size);
+              current = delimiter + shared->point_size;
+              tck.index = index;
+              tck.weight = shared->weights_path.size() ? shared->weights[index] : 1.0;
+              return true;
+            }
+          }
+
+
+          //! the total number of streamlines in the file
+          size_t num_streamlines () const { return shared->total_count; }
+
+
+        protected:
+
+          class Shared : public Reader<ValueType>
+          {
+            public:
+              Shared (const std::string& file, Properties& properties) :
+                Reader<ValueType> (file, properties),
+                next_shard (0),
+                total_count (0) {
+                  if (mmap) {
+                    if (has_index())
+                      shards_from_index();
+                    else
+                      shards_from_data();
+                  }
+                  if (weights_file) {
+                    float weight;
+                    while (get_next_weight (weight))
+                      weights.push_back (weight);
+                    weights_file.reset();
+                    if (weights.size() < total_count) {
+                      WARN ("Streamline weights file contains less entries than .tck file; only read " + str(weights.size()) + " streamlines");
+                    } else if (weights.size() > total_count) {
+                      WARN ("Streamline weights file contains more entries than .tck file");
+                    }
+                  }
+                }
+
+              //! claim the next available shard
+              bool next (const uint8_t*& first, const uint8_t*& last, uint64_t& first_index) {
+                const size_t n = next_shard++;
+                if (n >= shards.size())
+                  return false;
+                first = shards[n].first;
+                last = shards[n].last;
+                first_index = shards[n].first_index;
+                return true;
+              }
+
+              using Reader<ValueType>::find_delimiter;
+              using Reader<ValueType>::load_points;
+              using Reader<ValueType>::point_size;
+              using Reader<ValueType>::weights_path;
+
+              class Shard {
+                public:
+                  const uint8_t* first;
+                  const uint8_t* last;
+                  uint64_t first_index, count;
+              };
+
+              std::vector<Shard> shards;
+              std::atomic<size_t> next_shard;
+              std::vector<float> weights;
+              uint64_t total_count;
+
+            protected:
+              using Reader<ValueType>::mmap;
+              using Reader<ValueType>::end;
+              using Reader<ValueType>::index_count;
+              using Reader<ValueType>::weights_file;
+              using Reader<ValueType>::has_index;
+              using Reader<ValueType>::index_entry;
+              using Reader<ValueType>::get_next_weight;
+
+              size_t num_shards () const {
+                return std::max (Thread::number_of_threads(), size_t(1)) * TCK_SHARDS_PER_THREAD;
+              }
+
+              void shards_from_index ()
+              {
+                const size_t num = std::min<size_t> (num_shards(), index_count);
+                for (size_t n = 0; n < num; ++n) {
+                  const uint64_t first_index = index_count * n / num;
+                  const uint64_t last_index = index_count * (n+1) / num;
+                  if (first_index == last_index)
+                    continue;
+                  shards.push_back ({
+                      mmap->address() + index_entry (first_index, 0),
+                      last_index < index_count ? mmap->address() + index_entry (last_index, 0) : end,
+                      first_index, last_index - first_index });
+                }
+                total_count = index_count;
+              }
+
+              void shards_from_data ()
+              {
+                const uint8_t* start = mmap->address();
+                const size_t num_points = (end - start) / point_size;
+                const size_t num = num_shards();
+
+                const uint8_t* first = start;
+                for (size_t n = 1; n <= num && first < end; ++n) {
+                  const uint8_t* last = end;
+                  if (n < num) {
+                    const uint8_t* delimiter = find_delimiter (std::max (first, start + point_size * (num_points * n / num)));
+                    if (delimiter)
+                      last = delimiter + point_size;
+                  }
+                  shards.push_back ({ first, last, 0, 0 });
+                  first = last;
+                }
+
+                // count streamlines in each shard:
+                class Counter {
+                  public:
+                    Shared& S;
+                    void execute () {
+                      size_t n;
+                      while ((n = S.next_shard++) < S.shards.size()) {
+                        auto& shard (S.shards[n]);
+                        const uint8_t* delimiter = shard.first;
+                        while ((delimiter = S.find_delimiter (delimiter)) && delimiter < shard.last) {
+                          delimiter += S.point_size;
+                          ++shard.count;
+                        }
+                      }
+                    }
+                } counter = { *this };
+                Thread::run (Thread::multi (counter), "track shard counting").wait();
+                next_shard = 0;
+
+                for (auto& shard : shards) {
+                  shard.first_index = total_count;
+                  total_count += shard.count;
+                }
+              }
+          };
+
+          std::shared_ptr<Shared> shared;
+          const uint8_t* current;
+          const uint8_t* last;
+          uint64_t current_index;
+
+      };
+
+
+    }
+  }
+}
+
+
+#endif
+
@@ -36,6 +36,7 @@
 #define MAX_NUM_SEED_ATTEMPTS 100000
 
 #define TRACKING_BATCH_SIZE 10
+#define TRACKING_MAX_BATCH_SIZE 1000
 
 
 
@@ -63,7 +64,7 @@ namespace MR
                 typename Method::Shared shared (diff_path, properties);
                 WriteKernel writer (shared, destination, properties);
                 Exec<Method> tracker (shared);
-                Thread::run_queue (Thread::multi (tracker), Thread::batch (GeneratedTrack(), TRACKING_BATCH_SIZE), writer);
+                Thread::run_queue (Thread::multi (tracker), Thread::adaptive_batch (GeneratedTrack(), TRACKING_BATCH_SIZE, TRACKING_MAX_BATCH_SIZE), writer);
 
               } else {
 
@@ -94,7 +95,7 @@ namespace MR
 
                 Thread::run_queue (
                     Thread::multi (tracker), 
-                    Thread::batch (GeneratedTrack(), TRACKING_BATCH_SIZE),
+                    Thread::adaptive_batch (GeneratedTrack(), TRACKING_BATCH_SIZE, TRACKING_MAX_BATCH_SIZE),
                     writer, 
                     Thread::batch (Streamline<>(), TRACKING_BATCH_SIZE),
                     Thread::multi (mapper), 
@@ -76,8 +76,7 @@ namespace MR
               {
                 if (!source.scanner (position))
                   return false;
-                for (auto l = Loop (3) (source); l; ++l)
-                  values[source.index(3)] = source.value();
+                values = source.row (3);
                 return !std::isnan (values[0]);
               }
 
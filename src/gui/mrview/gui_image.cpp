@@ -435,10 +435,14 @@ namespace MR
             } 
             FORCE_INLINE ValueType value () const {
               ssize_t nseg = data_offset / buffer->get_io()->segment_size();
+              if (buffer->get_io()->segment_cache()) {
+                ImageIO::SegmentCache::Lock segment (*buffer->get_io()->segment_cache(), nseg);
+                return fetch_func (segment.address(), data_offset - nseg*buffer->get_io()->segment_size(), buffer->intensity_offset(), buffer->intensity_scale());
+              }
               return fetch_func (buffer->get_io()->segment (nseg), data_offset - nseg*buffer->get_io()->segment_size(), buffer->intensity_offset(), buffer->intensity_scale());
             }
-            std::function<ValueType(const void*,size_t,default_type,default_type)> fetch_func;
-            std::function<void(ValueType,void*,size_t,default_type,default_type)> store_func;
+            FetchFunc<ValueType> fetch_func;
+            StoreFunc<ValueType> store_func;
           } V (image);
 
           const size_t N = ( format == gl::RED ? 1 : 3 );
@@ -176,8 +176,12 @@ namespace MR
                                   "Default: l2")
         + Argument ("type").type_choice (linear_robust_estimator_choices)
 
-      // + Option ("rigid_loop_density", "density of gradient descent 1 (batch) to 0.0 (max stochastic) (Default: 1.0)")
-      //   + Argument ("num").type_sequence_float () // TODO
+      + Option ("rigid_loop_density", "the fraction of voxels in which the metric is evaluated, between 0 (exclusive) and 1 (all voxels). "
+                                 "The voxels are selected pseudo-randomly, and the same subset is used throughout each multi-resolution level. "
+                                 "If less than 1 at the final level, the result is refined using all voxels. "
+                                 "This can be specified either as a single number for all multi-resolution levels, "
+                                 "or a single value for each level. (Default: 1.0)")
+        + Argument ("num").type_sequence_float ()
 
       // + Option ("rigid_repetitions", " ")
       //   + Argument ("num").type_sequence_int () // TODO
@@ -244,8 +248,12 @@ namespace MR
                                   "Default: l2")
         + Argument ("type").type_choice (linear_robust_estimator_choices)
 
-      // + Option ("affine_loop_density", "density of gradient descent 1 (batch) to 0.0 (max stochastic) (Default: 1.0)")
-      //   + Argument ("num").type_sequence_float () // TODO
+      + Option ("affine_loop_density", "the fraction of voxels in which the metric is evaluated, between 0 (exclusive) and 1 (all voxels). "
+                                 "The voxels are selected pseudo-randomly, and the same subset is used throughout each multi-resolution level. "
+                                 "If less than 1 at the final level, the result is refined using all voxels. "
+                                 "This can be specified either as a single number for all multi-resolution levels, "
+                                 "or a single value for each level. (Default: 1.0)")
+        + Argument ("num").type_sequence_float ()
 
       // + Option ("affine_repetitions", " ")
       //   + Argument ("num").type_sequence_int () // TODO
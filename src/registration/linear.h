@@ -123,8 +123,8 @@ namespace MR
 
         void set_loop_density (const std::vector<default_type>& loop_density_){
           for (size_t d = 0; d < loop_density_.size(); ++d)
-            if (loop_density_[d] < 0.0 or loop_density_[d] > 1.0 )
-              throw Exception ("loop density must be between 0.0 and 1.0");
+            if (loop_density_[d] <= 0.0 or loop_density_[d] > 1.0 )
+              throw Exception ("loop density must be greater than 0.0 and at most 1.0");
           loop_density = loop_density_;
         }
 
@@ -362,7 +362,22 @@ namespace MR
                 evaluate.set_directions (aPSF_directions);
 
               INFO("linear registration...");
-              for (auto gd_iteration = 0; gd_iteration < gd_repetitions[level]; ++gd_iteration){
+              // if the metric was evaluated in a subset of the voxels only, refine the estimate
+              // at the final multi-resolution level using all voxels:
+              const bool refine = loop_density[level] < 1.0 && level == scale_factor.size() - 1;
+              for (auto gd_iteration = 0; gd_iteration < gd_repetitions[level] + (refine ? 1 : 0); ++gd_iteration){
+                if (gd_iteration == gd_repetitions[level]) {
+                  INFO ("refining using all voxels");
+                  evaluate.set_loop_density (1.0);
+                  // the estimate is already close to the optimum: restrict the step size
+                  // such that the gradient descent does not overshoot on its first iteration
+                  //CONF option: reg_refine_coherence_len
+                  //CONF default: 0.02
+                  //CONF Linear registration: maximum step (in voxels) of the final refinement
+                  //CONF using all voxels, if the metric was evaluated in a subset of the voxels
+                  transform.get_gradient_descent_updator()->set_control_points(
+                    parameters.control_points, spacing * File::Config::get_float ("reg_refine_coherence_len", 0.02), stop, spacing);
+                }
                 if (reg_bbgd) {
                   Math::GradientDescentBB<Metric::Evaluate<MetricType, ParamType>, typename TransformType::UpdateType>
                     optim (evaluate, *transform.get_gradient_descent_updator());
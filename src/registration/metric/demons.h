@@ -25,6 +25,8 @@ namespace MR
     namespace Metric
     {
 
+      // The update is symmetric: only the update for im1 is written out,
+      // the update for im2 is its negation.
       template <class Im1ImageType, class Im2ImageType, class Im1MaskType, class Im2MaskType>
       class Demons {
         public:
@@ -62,14 +64,12 @@ namespace MR
 
           void operator() (const Im1ImageType& im1_image,
                            const Im2ImageType& im2_image,
-                           Image<default_type>& im1_update,
-                           Image<default_type>& im2_update) {
+                           Image<default_type>& update) {
 
             if (im1_image.index(0) == 0 || im1_image.index(0) == im1_image.size(0) - 1 ||
                 im1_image.index(1) == 0 || im1_image.index(1) == im1_image.size(1) - 1 ||
                 im1_image.index(2) == 0 || im1_image.index(2) == im1_image.size(2) - 1) {
-              im1_update.row(3).setZero();
-              im2_update.row(3).setZero();
+              update.row(3).setZero();
               return;
             }
 
@@ -78,8 +78,7 @@ namespace MR
               assign_pos_of (im1_image, 0, 3).to (im1_mask);
               im1_mask_value = im1_mask.value();
               if (im1_mask_value < 0.1) {
-                im1_update.row(3).setZero();
-                im2_update.row(3).setZero();
+                update.row(3).setZero();
                 return;
               }
             }
@@ -89,8 +88,7 @@ namespace MR
               assign_pos_of (im2_image, 0, 3).to (im2_mask);
               im2_mask_value = im2_mask.value();
               if (im2_mask_value < 0.1) {
-                im1_update.row(3).setZero();
-                im2_update.row(3).setZero();
+                update.row(3).setZero();
                 return;
               }
             }
@@ -109,11 +107,9 @@ namespace MR
             Eigen::Matrix<typename Im1ImageType::value_type, 3, 1> grad = (im2_gradient.value() + im1_gradient.value()).array() / 2.0;
             default_type denominator = speed_squared / normaliser + grad.squaredNorm();
             if (std::abs (speed) < intensity_difference_threshold || denominator < denominator_threshold) {
-              im1_update.row(3).setZero();
-              im2_update.row(3).setZero();
+              update.row(3).setZero();
             } else {
-              im1_update.row(3) = speed * grad.array() / denominator;
-              im2_update.row(3) = -im1_update.row(3);
+              update.row(3) = speed * grad.array() / denominator;
             }
           }
 
@@ -16,12 +16,11 @@
 #ifndef __registration_metric_evaluate_h__
 #define __registration_metric_evaluate_h__
 
-#include "algo/random_threaded_loop.h"
-#include "algo/random_loop.h"
 #include "registration/metric/thread_kernel.h"
 #include "algo/threaded_loop.h"
 #include "registration/transform/reorient.h"
 #include "image.h"
+#include "math/rng.h"
 
 namespace MR
 {
@@ -55,6 +54,17 @@ namespace MR
         struct metric_requires_initialisation<MetricType, typename Void2<typename MetricType::requires_initialisation>::type> {
           typedef int yes;
         };
+
+        // hash of the voxel position, used to select a fixed pseudo-random subset of voxels:
+        inline uint32_t voxel_hash (uint64_t x, uint64_t y, uint64_t z, uint64_t seed) {
+          uint64_t h = seed ^ (x * 0x9E3779B97F4A7C15ULL) ^ (y * 0xC2B2AE3D27D4EB4FULL) ^ (z * 0x165667B19E3779F9ULL);
+          h ^= h >> 33;
+          h *= 0xFF51AFD7ED558CCDULL;
+          h ^= h >> 33;
+          h *= 0xC4CEB9FE1A85EC53ULL;
+          h ^= h >> 33;
+          return uint32_t (h);
+        }
       }
       //! \endcond
 
@@ -69,7 +79,8 @@ namespace MR
             Evaluate (const MetricType& metric_, ParamType& parameters, typename metric_requires_initialisation<U>::yes = 0) :
               metric (metric_),
               params (parameters),
-              iteration (1) {
+              iteration (1),
+              sampling_seed (Math::RNG::get_seed()) {
                 // update number of volumes
                 metric.init (parameters.im1_image, parameters.im2_image);
             }
@@ -78,7 +89,8 @@ namespace MR
             Evaluate (const MetricType& metric, ParamType& parameters, typename metric_requires_initialisation<U>::no = 0) :
               metric (metric),
               params (parameters),
-              iteration (1) { }
+              iteration (1),
+              sampling_seed (Math::RNG::get_seed()) { }
 
             //  metric_requires_precompute<U>::yes: operator() loops over processed_image instead of midway_image
             template <class U = MetricType>
@@ -111,58 +123,30 @@ namespace MR
               return overall_cost_function(0);
             }
 
-            struct ThreadFunctor {
+            // evaluate the metric only in a pseudo-random subset of the voxels. The subset
+            // is fixed for the lifetime of this object (i.e. for each multi-resolution level),
+            // so that the cost function remains consistent over the course of the gradient descent.
+            struct SampledThreadKernel {
               public:
-                ThreadFunctor (
-                    const std::vector<size_t>& inner_axes,
-                    const default_type density,
-                    const MetricType& metric,
-                    const ParamType& parameters,
-                    Eigen::VectorXd& overall_cost_function,
-                    Eigen::VectorXd& overall_grad,
-                    Math::RNG& rng_engine) :
-                  inner_axes (inner_axes),
-                  density (density),
-                  metric (metric),
-                  params (parameters),
-                  cost_function (overall_cost_function.size()),
-                  gradient (overall_grad.size()),
-                  overall_cost_function (overall_cost_function),
-                  overall_gradient (overall_grad),
-                  rng (rng_engine)  {
-                    gradient.setZero();
-                    cost_function.setZero();
-                    assert(inner_axes.size() >= 2);
-                    assert(overall_cost_function.size() == 1);
-                  }
-
-                ~ThreadFunctor () {
-                  overall_cost_function += cost_function;
-                  overall_gradient += gradient;
-                }
+                SampledThreadKernel (const MetricType& metric,
+                                     const ParamType& parameters,
+                                     Eigen::VectorXd& overall_cost_function,
+                                     Eigen::VectorXd& overall_gradient,
+                                     const default_type density,
+                                     const uint64_t seed) :
+                  kernel (metric, parameters, overall_cost_function, overall_gradient),
+                  threshold (density * std::numeric_limits<uint32_t>::max()),
+                  seed (seed) { }
 
                 void operator() (const Iterator& iter) {
-                  auto engine = std::default_random_engine{static_cast<std::default_random_engine::result_type>(rng.get_seed())};
-                  auto kern = ThreadKernel<MetricType, ParamType> (metric, params, cost_function, gradient);
-                  Iterator iterator (iter);
-                  assign_pos_of(iter).to(iterator);
-                  auto inner_loop = Random_loop<Iterator, std::default_random_engine>(iterator, engine, inner_axes[1], (float) iterator.size(inner_axes[1]) * density);
-                  for (auto j = inner_loop; j; ++j)
-                    for (auto k = Loop (inner_axes[0]) (iterator); k; ++k){
-                      DEBUG (str(iterator));
-                      kern (iterator);
-                    }
+                  if (voxel_hash (iter.index(0), iter.index(1), iter.index(2), seed) < threshold)
+                    kernel (iter);
                 }
+
               protected:
-                std::vector<size_t> inner_axes;
-                default_type density;
-                MetricType metric;
-                ParamType params;
-                Eigen::VectorXd cost_function;
-                Eigen::VectorXd gradient;
-                Eigen::VectorXd& overall_cost_function;
-                Eigen::VectorXd& overall_gradient;
-                Math::RNG rng;
+                ThreadKernel<MetricType, ParamType> kernel;
+                const default_type threshold;
+                const uint64_t seed;
             };
 
             template <class TransformType_>
@@ -179,11 +163,13 @@ namespace MR
                   if (params.robust_estimate){
                     throw Exception ("TODO robust estimate not implemented");
                   } else {
-                    Math::RNG rng;
-                    gradient.setZero();
-                    auto loop = ThreadedLoop (params.midway_image, 0, 3, 2);
-                    ThreadFunctor functor (loop.inner_axes, params.loop_density, metric, params, cost, gradient, rng);
-                    loop.run_outer (functor);
+                    {
+                      SampledThreadKernel kernel (metric, params, cost, gradient, params.loop_density, sampling_seed);
+                      ThreadedLoop (params.midway_image, 0, 3).run (kernel);
+                    }
+                    // scale to match the full evaluation:
+                    cost /= params.loop_density;
+                    gradient /= params.loop_density;
                   }
                 }
                 else {
@@ -232,12 +218,17 @@ namespace MR
               directions = dir;
             }
 
+            void set_loop_density (const default_type density) {
+              params.loop_density = density;
+            }
+
           protected:
               MetricType metric;
               ParamType params;
               std::vector<size_t> extent;
               size_t iteration;
               Eigen::MatrixXd directions;
+              uint64_t sampling_seed;
 
       };
     }
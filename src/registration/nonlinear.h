@@ -19,6 +19,9 @@
 
 #include <vector>
 #include "image.h"
+#include "memory.h"
+#include "transform.h"
+#include "interp/linear.h"
 #include "filter/warp.h"
 #include "filter/resize.h"
 #include "registration/transform/reorient.h"
@@ -40,6 +43,89 @@ namespace MR
     extern const App::OptionGroup nonlinear_options;
 
 
+    //! warp both images (and their masks) onto the midway space in a single pass
+    /*! The deformation at each voxel is computed on the fly from the linear
+     * transform and the current displacement field of each image, rather than
+     * being written out to a deformation field and read back for each warp.
+     * The deformation fields are only stored if supplied (for FOD reorientation). */
+    template <class Im1ImageType, class Im2ImageType, class Im1MaskType, class Im2MaskType>
+    class MidwayWarpKernel {
+      public:
+        MidwayWarpKernel (const transform_type& im1_linear, const transform_type& im2_linear,
+                          const Image<default_type>& field,
+                          const Im1ImageType& im1_image, const Im2ImageType& im2_image,
+                          const Im1MaskType& im1_mask, const Im2MaskType& im2_mask,
+                          Im1MaskType& im1_mask_warped, Im2MaskType& im2_mask_warped,
+                          Image<default_type>& im1_deform, Image<default_type>& im2_deform) :
+            im1_linear (im1_linear),
+            im2_linear (im2_linear),
+            field_transform (field),
+            im1_interp (im1_image, 0.0),
+            im2_interp (im2_image, 0.0),
+            im1_mask_interp (im1_mask.valid() ? new Interp::Linear<Im1MaskType> (im1_mask, 0.0) : nullptr),
+            im2_mask_interp (im2_mask.valid() ? new Interp::Linear<Im2MaskType> (im2_mask, 0.0) : nullptr),
+            im1_mask_warped (im1_mask_warped),
+            im2_mask_warped (im2_mask_warped),
+            im1_deform (im1_deform),
+            im2_deform (im2_deform),
+            is_4D (im1_image.ndim() == 4) { }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW  // avoid memory alignment errors in Eigen3;
+
+        void operator() (Image<default_type>& im1_disp, Image<default_type>& im2_disp,
+                         Image<default_type>& im1_warped, Image<default_type>& im2_warped) {
+          const Eigen::Vector3 voxel_position = field_transform.voxel2scanner * Eigen::Vector3 (im1_disp.index(0), im1_disp.index(1), im1_disp.index(2));
+          const Eigen::Vector3 im1_position = im1_linear * (voxel_position + im1_disp.row(3));
+          const Eigen::Vector3 im2_position = im2_linear * (voxel_position + im2_disp.row(3));
+
+          if (im1_deform.valid()) {
+            assign_pos_of (im1_disp, 0, 3).to (im1_deform, im2_deform);
+            im1_deform.row(3) = im1_position;
+            im2_deform.row(3) = im2_position;
+          }
+
+          warp (im1_interp, im1_position, im1_warped);
+          warp (im2_interp, im2_position, im2_warped);
+
+          if (im1_mask_interp) {
+            assign_pos_of (im1_disp, 0, 3).to (im1_mask_warped);
+            im1_mask_interp->scanner (im1_position);
+            im1_mask_warped.value() = im1_mask_interp->value();
+          }
+          if (im2_mask_interp) {
+            assign_pos_of (im1_disp, 0, 3).to (im2_mask_warped);
+            im2_mask_interp->scanner (im2_position);
+            im2_mask_warped.value() = im2_mask_interp->value();
+          }
+        }
+
+      protected:
+        template <class InterpType>
+        void warp (InterpType& interp, const Eigen::Vector3& position, Image<default_type>& warped) {
+          if (std::isnan (position[0]) || std::isnan (position[1]) || std::isnan (position[2])) {
+            if (is_4D) warped.row(3).setZero();
+            else warped.value() = 0.0;
+            return;
+          }
+          interp.scanner (position);
+          if (is_4D) warped.row(3) = interp.row(3);
+          else warped.value() = interp.value();
+        }
+
+        const transform_type im1_linear, im2_linear;
+        const MR::Transform field_transform;
+        Interp::Linear<Im1ImageType> im1_interp;
+        Interp::Linear<Im2ImageType> im2_interp;
+        copy_ptr<Interp::Linear<Im1MaskType>> im1_mask_interp;
+        copy_ptr<Interp::Linear<Im2MaskType>> im2_mask_interp;
+        Im1MaskType im1_mask_warped;
+        Im2MaskType im2_mask_warped;
+        Image<default_type> im1_deform, im2_deform;
+        const bool is_4D;
+    };
+
+
+
     class NonLinear
     {
 
@@ -154,12 +240,28 @@ namespace MR
               field_header.ndim() = 4;
               field_header.size(3) = 3;
 
+              // all buffers are allocated once per level and reused (swapped) across iterations.
+              // The update for im2 is the negation of that for im1, so only the latter is stored.
               im1_to_mid_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
               im2_to_mid_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
               im1_update = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im2_update = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
               im1_update_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
-              im2_update_new = std::make_shared<Image<default_type>>(Image<default_type>::scratch (field_header));
+              auto squaring_scratch1 = Image<default_type>::scratch (field_header);
+              auto squaring_scratch2 = Image<default_type>::scratch (field_header);
+
+              // the deformation fields are only needed for reorientation:
+              Image<default_type> im1_deform_field, im2_deform_field;
+              if (do_reorientation && fod_lmax[level]) {
+                im1_deform_field = Image<default_type>::scratch (field_header);
+                im2_deform_field = Image<default_type>::scratch (field_header);
+              }
+
+              Im1MaskType im1_mask_warped;
+              if (im1_mask.valid())
+                im1_mask_warped = Im1MaskType::scratch (midway_image_header_resized);
+              Im2MaskType im2_mask_warped;
+              if (im2_mask.valid())
+                im2_mask_warped = Im2MaskType::scratch (midway_image_header_resized);
 
               if (!is_initialised) {
                 if (level == 0) {
@@ -186,40 +288,32 @@ namespace MR
 
               while (!converged) {
                 if (iteration > 1) {
-                  DEBUG ("smoothing update fields");
+                  DEBUG ("smoothing update field");
                   Filter::Smooth smooth_filter (*im1_update);
                   smooth_filter.set_stdev (update_smoothing_mm);
                   smooth_filter (*im1_update, *im1_update);
-                  smooth_filter (*im2_update, *im2_update);
-                }
-
-                Image<default_type> im1_deform_field = Image<default_type>::scratch (field_header);
-                Image<default_type> im2_deform_field = Image<default_type>::scratch (field_header);
 
-                if (iteration > 1) {
                   DEBUG ("updating displacement field field");
-                  Warp::update_displacement_scaling_and_squaring (*im1_to_mid, *im1_update, *im1_to_mid_new, grad_step_altered);
-                  Warp::update_displacement_scaling_and_squaring (*im2_to_mid, *im2_update, *im2_to_mid_new, grad_step_altered);
+                  Warp::update_displacement_scaling_and_squaring (*im1_to_mid, *im1_update, *im1_to_mid_new, squaring_scratch1, squaring_scratch2, grad_step_altered);
+                  Warp::update_displacement_scaling_and_squaring (*im2_to_mid, *im1_update, *im2_to_mid_new, squaring_scratch1, squaring_scratch2, -grad_step_altered);
 
                   DEBUG ("smoothing displacement field");
-                  Filter::Smooth smooth_filter (*im1_to_mid_new);
-                  smooth_filter.set_stdev (disp_smoothing_mm);
-                  smooth_filter.set_zero_boundary (true);
-                  smooth_filter (*im1_to_mid_new, *im1_to_mid_new);
-                  smooth_filter (*im2_to_mid_new, *im2_to_mid_new);
-
-                  Registration::Warp::compose_linear_displacement (im1_to_mid_linear, *im1_to_mid_new, im1_deform_field);
-                  Registration::Warp::compose_linear_displacement (im2_to_mid_linear, *im2_to_mid_new, im2_deform_field);
-                } else {
-                  Registration::Warp::compose_linear_displacement (im1_to_mid_linear, *im1_to_mid, im1_deform_field);
-                  Registration::Warp::compose_linear_displacement (im2_to_mid_linear, *im2_to_mid, im2_deform_field);
+                  Filter::Smooth disp_smooth_filter (*im1_to_mid_new);
+                  disp_smooth_filter.set_stdev (disp_smoothing_mm);
+                  disp_smooth_filter.set_zero_boundary (true);
+                  disp_smooth_filter (*im1_to_mid_new, *im1_to_mid_new);
+                  disp_smooth_filter (*im2_to_mid_new, *im2_to_mid_new);
                 }
 
-                DEBUG ("warping input images");
+                DEBUG ("warping input images and masks");
                 {
-                  LogLevelLatch level (0);
-                  Filter::warp<Interp::Linear> (im1_smoothed, im1_warped, im1_deform_field, 0.0);
-                  Filter::warp<Interp::Linear> (im2_smoothed, im2_warped, im2_deform_field, 0.0);
+                  Image<default_type>& im1_disp (iteration > 1 ? *im1_to_mid_new : *im1_to_mid);
+                  Image<default_type>& im2_disp (iteration > 1 ? *im2_to_mid_new : *im2_to_mid);
+                  MidwayWarpKernel<Im1ImageType, Im2ImageType, Im1MaskType, Im2MaskType> warp_kernel (im1_to_mid_linear, im2_to_mid_linear, im1_disp,
+                                                                                                        im1_smoothed, im2_smoothed, im1_mask, im2_mask,
+                                                                                                        im1_mask_warped, im2_mask_warped,
+                                                                                                        im1_deform_field, im2_deform_field);
+                  ThreadedLoop (im1_disp, 0, 3).run (warp_kernel, im1_disp, im2_disp, im1_warped, im2_warped);
                 }
 
                 if (do_reorientation && fod_lmax[level]) {
@@ -228,30 +322,16 @@ namespace MR
                   Registration::Transform::reorient_warp (im2_warped, im2_deform_field, aPSF_directions);
                 }
 
-                DEBUG ("warping mask images");
-                Im1MaskType im1_mask_warped;
-                if (im1_mask.valid()) {
-                  im1_mask_warped = Im1MaskType::scratch (midway_image_header_resized);
-                  LogLevelLatch level (0);
-                  Filter::warp<Interp::Linear> (im1_mask, im1_mask_warped, im1_deform_field, 0.0);
-                }
-                Im1MaskType im2_mask_warped;
-                if (im2_mask.valid()) {
-                  im2_mask_warped = Im1MaskType::scratch (midway_image_header_resized);
-                  LogLevelLatch level (0);
-                  Filter::warp<Interp::Linear> (im2_mask, im2_mask_warped, im2_deform_field, 0.0);
-                }
-
                 DEBUG ("evaluating metric and computing update field");
                 default_type cost_new = 0.0;
                 size_t voxel_count = 0;
 
                 if (im1_image.ndim() == 4) {
                   Metric::Demons4D<Im1ImageType, Im2ImageType, Im1MaskType, Im2MaskType> metric (cost_new, voxel_count, im1_warped, im2_warped, im1_mask_warped, im2_mask_warped);
-                  ThreadedLoop (im1_warped, 0, 3).run (metric, im1_warped, im2_warped, *im1_update_new, *im2_update_new);
+                  ThreadedLoop (im1_warped, 0, 3).run (metric, im1_warped, im2_warped, *im1_update_new);
                 } else {
                   Metric::Demons<Im1ImageType, Im2ImageType, Im1MaskType, Im2MaskType> metric (cost_new, voxel_count, im1_warped, im2_warped, im1_mask_warped, im2_mask_warped);
-                  ThreadedLoop (im1_warped, 0, 3).run (metric, im1_warped, im2_warped, *im1_update_new, *im2_update_new);
+                  ThreadedLoop (im1_warped, 0, 3).run (metric, im1_warped, im2_warped, *im1_update_new);
                 }
 
                 cost_new /= static_cast<default_type>(voxel_count);
@@ -264,7 +344,6 @@ namespace MR
                     std::swap (im2_to_mid_new, im2_to_mid);
                   }
                   std::swap (im1_update_new, im1_update);
-                  std::swap (im2_update_new, im2_update);
 
                   DEBUG ("inverting displacement field");
                   {
@@ -491,9 +570,7 @@ namespace MR
           std::shared_ptr<Image<default_type> > mid_to_im2;
 
           std::shared_ptr<Image<default_type> > im1_update;
-          std::shared_ptr<Image<default_type> > im2_update;
           std::shared_ptr<Image<default_type> > im1_update_new;
-          std::shared_ptr<Image<default_type> > im2_update_new;
 
     };
   }
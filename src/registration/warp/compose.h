@@ -159,7 +159,10 @@ namespace MR
       }
 
       // Compose two displacement fields and output a displacement field using scaling and squaring.  The input and output can be the same image.
-      FORCE_INLINE  void update_displacement_scaling_and_squaring (Image<default_type>& input, Image<default_type>& update, Image<default_type>& output, const default_type step = 1.0)
+      // The two scratch images must match the update field; they are only used if scaling and squaring is required,
+      // and allow the caller to reuse the same buffers across iterations. A negative step applies the inverse of the update.
+      FORCE_INLINE  void update_displacement_scaling_and_squaring (Image<default_type>& input, Image<default_type>& update, Image<default_type>& output,
+                                                                   Image<default_type>& scratch1, Image<default_type>& scratch2, const default_type step = 1.0)
       {
         check_dimensions (input, output, 0, 3);
 
@@ -175,13 +178,15 @@ namespace MR
         // if the maximum update is larger than half a voxel, perform scaling and squaring to ensure the displacement field remains diffeomorphic
 
         default_type scale_factor = 1.0;
-        if (max_norm * step < min_vox_size / 2.0) {
+        if (max_norm * std::abs (step) < min_vox_size / 2.0) {
           update_displacement (input, update, output, step);
         } else {
-          scale_factor = std::pow (2, std::ceil (std::log ((max_norm * step) / (min_vox_size / 2.0)) / std::log (2.0)));
+          scale_factor = std::pow (2, std::ceil (std::log ((max_norm * std::abs (step)) / (min_vox_size / 2.0)) / std::log (2.0)));
 
-          std::shared_ptr<Image<default_type>> scaled_update = std::make_shared<Image<default_type> >(Image<default_type>::scratch (update));
-          std::shared_ptr<Image<default_type>> composed = std::make_shared<Image<default_type> >(Image<default_type>::scratch (update));
+          check_dimensions (update, scratch1);
+          check_dimensions (update, scratch2);
+          Image<default_type>* scaled_update = &scratch1;
+          Image<default_type>* composed = &scratch2;
 
           // Scaling
           default_type scaled_step = step / scale_factor; // apply the step size and scale factor at once
@@ -15,6 +15,9 @@
 #ifndef __stats_cfe_h__
 #define __stats_cfe_h__
 
+#include <algorithm>
+#include <mutex>
+
 #include "math/math.h"
 #include "image.h"
 #include "dwi/tractography/mapping/mapper.h"
@@ -27,6 +30,9 @@ namespace MR
     {
 
       typedef float value_type;
+
+      // number of fixel pairs buffered by each TrackProcessor thread before merging:
+#define CFE_CONNECTIVITY_BUFFER_SIZE 1048576
       typedef DWI::Tractography::Mapping::SetVoxelDir SetVoxelDir;
 
 
@@ -34,10 +40,163 @@ namespace MR
       @{ */
 
 
-      class connectivity {
+      //! fixel-fixel connectivity, in compressed sparse row (CSR) format
+      /*! Each row holds the indices of the fixels connected to a given fixel,
+       * along with the associated connectivity value, stored contiguously.
+       * Rows must be filled in order, using push_back() followed by
+       * end_row() once per row. */
+      class ConnectivityMatrix {
+        public:
+          class Entry {
+            public:
+              uint32_t index;
+              value_type value;
+          };
+
+          ConnectivityMatrix () : row_offsets (1, 0) { }
+          ConnectivityMatrix (std::vector<size_t>&& row_offsets, std::vector<Entry>&& entries) :
+            row_offsets (std::move (row_offsets)),
+            entries (std::move (entries)) { }
+
+          size_t rows () const { return row_offsets.size() - 1; }
+          size_t nonzeros () const { return entries.size(); }
+
+          const Entry* begin (size_t row) const { return entries.data() + row_offsets[row]; }
+          const Entry* end (size_t row) const { return entries.data() + row_offsets[row+1]; }
+          Entry* begin (size_t row) { return entries.data() + row_offsets[row]; }
+          Entry* end (size_t row) { return entries.data() + row_offsets[row+1]; }
+
+          void reserve (size_t num_rows, size_t num_entries) {
+            row_offsets.reserve (num_rows + 1);
+            entries.reserve (num_entries);
+          }
+          void push_back (uint32_t index, value_type value) { entries.push_back ({ index, value }); }
+          void end_row () { row_offsets.push_back (entries.size()); }
+
+        protected:
+          std::vector<size_t> row_offsets;
+          std::vector<Entry> entries;
+      };
+
+
+
+
+      //! accumulates fixel-fixel connectivity from multiple TrackProcessor threads
+      /*! Each thread accumulates its own list of fixel pairs and associated
+       * streamline counts, sorted and with duplicates merged, which is handed
+       * over on completion. Once all threads have finished, finalise()
+       * merges these into a ConnectivityMatrix holding the (symmetric)
+       * number of streamlines shared by each pair of fixels. */
+      class ConnectivityBuilder {
         public:
-          connectivity () : value (0.0) { }
-          value_type value;
+          class Pair {
+            public:
+              uint32_t first, second, count;
+              bool operator< (const Pair& that) const {
+                return first < that.first || (first == that.first && second < that.second);
+              }
+              bool operator== (const Pair& that) const {
+                return first == that.first && second == that.second;
+              }
+          };
+
+          ConnectivityBuilder (size_t num_fixels) :
+            fixel_TDI (num_fixels, 0) { }
+
+          //! merge a thread's (sorted) lists of pairs and track density into the totals
+          void add (std::vector<std::vector<Pair>>&& pairs, const std::vector<uint32_t>& TDI) {
+            std::lock_guard<std::mutex> lock (mutex);
+            for (auto& run : pairs)
+              runs.push_back (std::move (run));
+            for (size_t n = 0; n < TDI.size(); ++n)
+              fixel_TDI[n] += TDI[n];
+          }
+
+          //! sort & merge duplicate entries in place
+          static void reduce (std::vector<Pair>& pairs) {
+            if (pairs.empty())
+              return;
+            std::sort (pairs.begin(), pairs.end());
+            auto out = pairs.begin();
+            for (auto in = pairs.begin()+1; in != pairs.end(); ++in) {
+              if (*in == *out)
+                out->count += in->count;
+              else
+                *(++out) = *in;
+            }
+            pairs.erase (++out, pairs.end());
+          }
+
+          //! merge two sorted lists of pairs, summing the counts of duplicate entries
+          static std::vector<Pair> merge (const std::vector<Pair>& A, const std::vector<Pair>& B) {
+            std::vector<Pair> merged;
+            merged.reserve (A.size() + B.size());
+            auto a = A.begin(), b = B.begin();
+            while (a != A.end() && b != B.end()) {
+              if (*a < *b)
+                merged.push_back (*a++);
+              else if (*b < *a)
+                merged.push_back (*b++);
+              else {
+                merged.push_back ({ a->first, a->second, a->count + b->count });
+                ++a; ++b;
+              }
+            }
+            merged.insert (merged.end(), a, A.end());
+            merged.insert (merged.end(), b, B.end());
+            return merged;
+          }
+
+          //! the number of streamlines traversing each fixel
+          const std::vector<uint32_t>& TDI () const { return fixel_TDI; }
+
+          //! merge the contributions of all threads into \a matrix
+          void finalise (ConnectivityMatrix& matrix) {
+            // merge the smallest runs first, to keep peak memory usage down:
+            while (runs.size() > 1) {
+              std::sort (runs.begin(), runs.end(),
+                  [] (const std::vector<Pair>& a, const std::vector<Pair>& b) { return a.size() > b.size(); });
+              auto merged = merge (runs[runs.size()-2], runs.back());
+              runs.pop_back();
+              runs.back().swap (merged);
+            }
+            std::vector<Pair> pairs;
+            if (runs.size())
+              pairs.swap (runs[0]);
+            runs.clear();
+
+            // each pair is stored once (first <= second), but needs to appear in both rows:
+            std::vector<size_t> row_sizes (fixel_TDI.size(), 0);
+            for (const auto& pair : pairs) {
+              ++row_sizes[pair.first];
+              if (pair.second != pair.first)
+                ++row_sizes[pair.second];
+            }
+            std::vector<size_t> row_start (fixel_TDI.size() + 1, 0);
+            for (size_t n = 0; n < row_sizes.size(); ++n)
+              row_start[n+1] = row_start[n] + row_sizes[n];
+
+            // since the pairs are sorted, this leaves the entries in each row
+            // sorted by fixel index:
+            std::vector<ConnectivityMatrix::Entry> entries (row_start.back());
+            std::vector<size_t> next (row_start.begin(), row_start.end()-1);
+            for (const auto& pair : pairs) {
+              if (pair.first == pair.second) {
+                entries[next[pair.first]++] = { pair.first, value_type (2 * pair.count) };
+                continue;
+              }
+              entries[next[pair.first]++] = { pair.second, value_type (pair.count) };
+              entries[next[pair.second]++] = { pair.first, value_type (pair.count) };
+            }
+            std::vector<Pair>().swap (pairs);
+
+            matrix = ConnectivityMatrix (std::move (row_start), std::move (entries));
+          }
+
+        protected:
+          std::vector<std::vector<Pair>> runs;
+          std::vector<uint32_t> fixel_TDI;
+          std::mutex mutex;
       };
 
 
@@ -45,26 +204,43 @@ namespace MR
 
       /**
        * Process each track by converting each streamline to a set of dixels, and map these to fixels.
+       * This can be run in multiple threads (using Thread::multi()): each copy
+       * accumulates its own contributions, which are passed to the
+       * ConnectivityBuilder once the thread completes.
        */
       class TrackProcessor {
 
         public:
           TrackProcessor (Image<int32_t>& fixel_indexer,
                           const std::vector<Eigen::Matrix<value_type, 3, 1> >& fixel_directions,
-                          std::vector<uint16_t>& fixel_TDI,
-                          std::vector<std::map<int32_t, connectivity> >& connectivity_matrix,
+                          ConnectivityBuilder& builder,
                           value_type angular_threshold):
                           fixel_indexer (fixel_indexer) ,
                           fixel_directions (fixel_directions),
-                          fixel_TDI (fixel_TDI),
-                          connectivity_matrix (connectivity_matrix) {
+                          builder (builder) {
             angular_threshold_dp = cos (angular_threshold * (Math::pi/180.0));
           }
 
+          TrackProcessor (const TrackProcessor& that) :
+            fixel_indexer (that.fixel_indexer),
+            fixel_directions (that.fixel_directions),
+            builder (that.builder),
+            angular_threshold_dp (that.angular_threshold_dp) { }
+
+          ~TrackProcessor () {
+            if (fixel_TDI.empty())
+              return;
+            flush();
+            builder.add (std::move (runs), fixel_TDI);
+          }
+
           bool operator() (SetVoxelDir& in)
           {
+            if (fixel_TDI.empty())
+              fixel_TDI.resize (fixel_directions.size(), 0);
+
             // For each voxel tract tangent, assign to a fixel
-            std::vector<int32_t> tract_fixel_indices;
+            tract_fixel_indices.clear();
             for (SetVoxelDir::const_iterator i = in.begin(); i != in.end(); ++i) {
               assign_pos_of (*i).to (fixel_indexer);
               fixel_indexer.index(3) = 0;
@@ -93,10 +269,12 @@ namespace MR
             try {
               for (size_t i = 0; i < tract_fixel_indices.size(); i++) {
                 for (size_t j = i + 1; j < tract_fixel_indices.size(); j++) {
-                  connectivity_matrix[tract_fixel_indices[i]][tract_fixel_indices[j]].value++;
-                  connectivity_matrix[tract_fixel_indices[j]][tract_fixel_indices[i]].value++;
+                  const uint32_t a = tract_fixel_indices[i], b = tract_fixel_indices[j];
+                  buffer.push_back ({ std::min (a, b), std::max (a, b), 1 });
                 }
               }
+              if (buffer.size() >= CFE_CONNECTIVITY_BUFFER_SIZE)
+                flush();
               return true;
             } catch (...) {
               throw Exception ("Error assigning memory for CFE connectivity matrix");
@@ -105,11 +283,31 @@ namespace MR
           }
 
         private:
+          typedef ConnectivityBuilder::Pair Pair;
+
           Image<int32_t> fixel_indexer;
           const std::vector<Eigen::Vector3f>& fixel_directions;
-          std::vector<uint16_t>& fixel_TDI;
-          std::vector<std::map<int32_t, connectivity> >& connectivity_matrix;
+          ConnectivityBuilder& builder;
           value_type angular_threshold_dp;
+
+          std::vector<uint32_t> tract_fixel_indices;
+          std::vector<uint32_t> fixel_TDI;
+          std::vector<Pair> buffer;
+          std::vector<std::vector<Pair>> runs;
+
+          // sort the buffered pairs into a new run, then merge runs of
+          // similar size, so that each pair is only merged a logarithmic
+          // number of times:
+          void flush () {
+            ConnectivityBuilder::reduce (buffer);
+            runs.push_back (std::move (buffer));
+            buffer = std::vector<Pair>();
+            while (runs.size() > 1 && runs[runs.size()-2].size() <= 2*runs.back().size()) {
+              auto merged = ConnectivityBuilder::merge (runs[runs.size()-2], runs.back());
+              runs.pop_back();
+              runs.back().swap (merged);
+            }
+          }
       };
 
 
@@ -117,9 +315,9 @@ namespace MR
 
       class Enhancer {
         public:
-          Enhancer (const std::vector<std::map<int32_t, connectivity> >& connectivity_map,
+          Enhancer (const ConnectivityMatrix& connectivity_matrix,
                     const value_type dh, const value_type E, const value_type H) :
-                    connectivity_map (connectivity_map), dh (dh), E (E), H (H) { }
+                    connectivity_matrix (connectivity_matrix), dh (dh), E (E), H (H) { }
 
           value_type operator() (const value_type max_stat, const std::vector<value_type>& stats,
                                  std::vector<value_type>& enhanced_stats) const
@@ -127,13 +325,13 @@ namespace MR
             enhanced_stats.resize (stats.size());
             std::fill (enhanced_stats.begin(), enhanced_stats.end(), 0.0);
             value_type max_enhanced_stat = 0.0;
-            for (size_t fixel = 0; fixel < connectivity_map.size(); ++fixel) {
-              std::map<int32_t, connectivity>::const_iterator connected_fixel;
+            for (size_t fixel = 0; fixel < connectivity_matrix.rows(); ++fixel) {
+              const auto first = connectivity_matrix.begin (fixel), last = connectivity_matrix.end (fixel);
               for (value_type h = this->dh; h < stats[fixel]; h +=  this->dh) {
                 value_type extent = 0.0;
-                for (connected_fixel = connectivity_map[fixel].begin(); connected_fixel != connectivity_map[fixel].end(); ++connected_fixel)
-                  if (stats[connected_fixel->first] > h)
-                    extent += connected_fixel->second.value;
+                for (auto connected_fixel = first; connected_fixel != last; ++connected_fixel)
+                  if (stats[connected_fixel->index] > h)
+                    extent += connected_fixel->value;
                 enhanced_stats[fixel] += std::pow (extent, E) * std::pow (h, H);
               }
               if (enhanced_stats[fixel] > max_enhanced_stat)
@@ -144,7 +342,7 @@ namespace MR
           }
 
         protected:
-          const std::vector<std::map<int32_t, connectivity> >& connectivity_map;
+          const ConnectivityMatrix& connectivity_matrix;
           const value_type dh, E, H;
       };
 
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+#include "app.h"
+#include "raw.h"
+#include "file/config.h"
+#include "file/key_value.h"
+#include "stats/permtest.h"
+
+// fixed seed used to generate the permutations when running a shard,
+// so that the permutations are identical across all shards:
+#define PERMTEST_SHARD_SEED 1
+
+
+namespace MR
+{
+  namespace Stats
+  {
+    namespace PermTest
+    {
+
+      using namespace App;
+
+      const OptionGroup Options = OptionGroup ("Options for checkpointing and distributing permutation testing")
+
+        + Option ("checkpoint", "save the state of the permutation testing to this file at regular intervals "
+                                "(as set by the PermTestCheckpointInterval config file entry), "
+                                "and resume from it if it already exists.")
+        + Argument ("path").type_text()
+
+        + Option ("shard", "only process the permutations in the specified subset: the permutations are split "
+                           "into 'count' equal subsets, of which the subset 'index' (counting from zero) is processed. "
+                           "This requires the -checkpoint option, and the resulting checkpoint files from all subsets "
+                           "should then be combined using the permtestmerge command. Running the command again with "
+                           "the merged checkpoint file will generate the statistical inference outputs. All subsets "
+                           "must be run with the same inputs & options; the permutations are generated using a fixed "
+                           "random seed to ensure they are identical across subsets.")
+        + Argument ("index").type_integer (0)
+        + Argument ("count").type_integer (1);
+
+
+
+      std::string checkpoint_path ()
+      {
+        auto opt = get_options ("checkpoint");
+        if (opt.size())
+          return opt[0][0];
+        return std::string();
+      }
+
+
+
+      std::pair<size_t, size_t> permutation_range (size_t num_permutations)
+      {
+        auto opt = get_options ("shard");
+        if (!opt.size())
+          return { 0, num_permutations };
+        const size_t index = opt[0][0], count = opt[0][1];
+        if (index >= count)
+          throw Exception ("shard index must be less than the number of shards");
+        if (!checkpoint_path().size())
+          throw Exception ("the -shard option requires the -checkpoint option");
+        return { num_permutations * index / count, num_permutations * (index+1) / count };
+      }
+
+
+
+      void generate_permutations (size_t num_permutations, size_t num_subjects,
+                                  std::vector<std::vector<size_t> >& permutations, bool include_default)
+      {
+        if (!get_options ("shard").size()) {
+          Math::Stats::generate_permutations (num_permutations, num_subjects, permutations, include_default);
+          return;
+        }
+        std::mt19937 rng (PERMTEST_SHARD_SEED);
+        Math::Stats::generate_permutations (num_permutations, num_subjects, permutations, include_default,
+            [&] (std::vector<size_t>& labelling) { std::shuffle (labelling.begin(), labelling.end(), rng); });
+      }
+
+
+
+
+
+
+      namespace {
+
+        template <typename StoredType, class ContainerType>
+          void write (std::ostream& out, const ContainerType& data)
+          {
+            for (size_t i = 0; i < size_t (data.size()); ++i) {
+              const StoredType value = ByteOrder::LE (StoredType (data[i]));
+              out.write (reinterpret_cast<const char*> (&value), sizeof (StoredType));
+            }
+          }
+
+        template <typename StoredType, class ContainerType>
+          void read (std::istream& in, ContainerType& data)
+          {
+            for (size_t i = 0; i < size_t (data.size()); ++i) {
+              StoredType value;
+              in.read (reinterpret_cast<char*> (&value), sizeof (StoredType));
+              data[i] = ByteOrder::LE (value);
+            }
+          }
+
+      }
+
+
+
+      State::State (std::vector<std::vector<size_t> >&& permutations, size_t num_elements, bool negative) :
+        permutations (std::move (permutations)),
+        completed (this->permutations.size(), false),
+        perm_dist_pos (vector_type::Zero (this->permutations.size())),
+        uncorrected_pvalue_count (num_elements, 0),
+        num_subjects (this->permutations.size() ? this->permutations[0].size() : 0),
+        negative (negative)
+      {
+        if (negative) {
+          perm_dist_neg = vector_type::Zero (num_permutations());
+          uncorrected_pvalue_count_neg.assign (num_elements, 0);
+        }
+      }
+
+
+
+      void State::load (const std::string& path)
+      {
+        size_t num_perms = 0, num_elements = 0;
+        bool nonstationary = false;
+        std::string data_file;
+        num_subjects = 0;
+        negative = false;
+
+        File::KeyValue kv (path, "mrtrix permutation test");
+        while (kv.next()) {
+          const std::string key = lowercase (kv.key());
+          if (key == "num_permutations") num_perms = to<size_t> (kv.value());
+          else if (key == "num_subjects") num_subjects = to<size_t> (kv.value());
+          else if (key == "num_elements") num_elements = to<size_t> (kv.value());
+          else if (key == "negative") negative = to<bool> (kv.value());
+          else if (key == "nonstationary") nonstationary = to<bool> (kv.value());
+          else if (key == "file") data_file = kv.value();
+        }
+        kv.close();
+
+        if (!num_perms || !num_subjects || !num_elements || data_file.empty())
+          throw Exception ("incomplete header in permutation test file \"" + path + "\"");
+
+        std::istringstream files_stream (data_file);
+        std::string fname;
+        int64_t offset = 0;
+        files_stream >> fname >> offset;
+        if (fname != ".")
+          throw Exception ("permutation test file \"" + path + "\" must contain its own data");
+
+        std::ifstream in (path.c_str(), std::ios::in | std::ios::binary);
+        if (!in)
+          throw Exception ("error opening permutation test file \"" + path + "\": " + strerror(errno));
+        in.seekg (offset);
+
+        permutations.assign (num_perms, std::vector<size_t> (num_subjects));
+        for (auto& permutation : permutations)
+          read<uint32_t> (in, permutation);
+        completed.resize (num_perms);
+        read<uint8_t> (in, completed);
+        perm_dist_pos.resize (num_perms);
+        read<float> (in, perm_dist_pos);
+        uncorrected_pvalue_count.resize (num_elements);
+        read<uint32_t> (in, uncorrected_pvalue_count);
+        perm_dist_neg.resize (0);
+        uncorrected_pvalue_count_neg.clear();
+        if (negative) {
+          perm_dist_neg.resize (num_perms);
+          read<float> (in, perm_dist_neg);
+          uncorrected_pvalue_count_neg.resize (num_elements);
+          read<uint32_t> (in, uncorrected_pvalue_count_neg);
+        }
+        empirical_statistic.clear();
+        if (nonstationary) {
+          empirical_statistic.resize (num_elements);
+          read<double> (in, empirical_statistic);
+        }
+
+        if (!in)
+          throw Exception ("unexpected end of data in permutation test file \"" + path + "\"");
+      }
+
+
+
+      void State::save (const std::string& path) const
+      {
+        std::string header = "mrtrix permutation test\n"
+          "num_permutations: " + str(num_permutations()) + "\n"
+          "num_subjects: " + str(num_subjects) + "\n"
+          "num_elements: " + str(num_elements()) + "\n"
+          "negative: " + str(negative) + "\n"
+          "nonstationary: " + str(empirical_statistic.size() ? true : false) + "\n"
+          "completed: " + str(num_completed()) + "\n";
+        // allow space for the file entry itself:
+        const int64_t data_offset = header.size() + 64;
+        header += "file: . " + str(data_offset) + "\nEND\n";
+        header.resize (data_offset, '\0');
+
+        // write to a temporary file first, so that an existing checkpoint is
+        // only replaced once the new one has been written in full:
+        const std::string temp_path = path + ".tmp";
+        {
+          std::ofstream out (temp_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+          if (!out)
+            throw Exception ("error creating permutation test file \"" + temp_path + "\": " + strerror(errno));
+          out.write (header.c_str(), header.size());
+          for (const auto& permutation : permutations)
+            write<uint32_t> (out, permutation);
+          write<uint8_t> (out, completed);
+          write<float> (out, perm_dist_pos);
+          write<uint32_t> (out, uncorrected_pvalue_count);
+          if (negative) {
+            write<float> (out, perm_dist_neg);
+            write<uint32_t> (out, uncorrected_pvalue_count_neg);
+          }
+          write<double> (out, empirical_statistic);
+          if (!out)
+            throw Exception ("error writing permutation test file \"" + temp_path + "\": " + strerror(errno));
+        }
+        if (std::rename (temp_path.c_str(), path.c_str()))
+          throw Exception ("error renaming permutation test file \"" + temp_path + "\" to \"" + path + "\": " + strerror(errno));
+        DEBUG ("permutation test state saved to \"" + path + "\" (" + str(num_completed()) + " permutations completed)");
+      }
+
+
+
+      void State::check (size_t num_perms, size_t num_subj, size_t num_elem, bool neg, bool nonstationary) const
+      {
+        if (num_perms != num_permutations())
+          throw Exception ("mismatched number of permutations in permutation test file (" + str(num_permutations()) + ", expected " + str(num_perms) + ")");
+        if (num_subj != num_subjects)
+          throw Exception ("mismatched number of subjects in permutation test file (" + str(num_subjects) + ", expected " + str(num_subj) + ")");
+        if (num_elem != num_elements())
+          throw Exception ("mismatched number of elements in permutation test file (" + str(num_elements()) + ", expected " + str(num_elem) + ")");
+        if (neg != negative)
+          throw Exception (std::string ("permutation test file was ") + (negative ? "" : "not ") + "generated with the negative contrast");
+        if (nonstationary != bool (empirical_statistic.size()))
+          throw Exception (std::string ("permutation test file was ") + (nonstationary ? "not " : "") + "generated with nonstationarity adjustment");
+      }
+
+
+
+      void State::merge (const State& other)
+      {
+        other.check (num_permutations(), num_subjects, num_elements(), negative, empirical_statistic.size());
+        if (other.permutations != permutations)
+          throw Exception ("permutation test files hold different sets of permutations");
+        for (size_t i = 0; i < empirical_statistic.size(); ++i) {
+          if (std::abs (other.empirical_statistic[i] - empirical_statistic[i]) > 1.0e-4 * std::abs (empirical_statistic[i]))
+            throw Exception ("permutation test files hold different empirical statistics for nonstationarity adjustment");
+        }
+        for (size_t n = 0; n < num_permutations(); ++n) {
+          if (completed[n] && other.completed[n])
+            throw Exception ("permutation " + str(n) + " has been processed in more than one permutation test file");
+        }
+
+        for (size_t n = 0; n < num_permutations(); ++n) {
+          if (other.completed[n]) {
+            completed[n] = true;
+            perm_dist_pos[n] = other.perm_dist_pos[n];
+            if (negative)
+              perm_dist_neg[n] = other.perm_dist_neg[n];
+          }
+        }
+        for (size_t i = 0; i < num_elements(); ++i) {
+          uncorrected_pvalue_count[i] += other.uncorrected_pvalue_count[i];
+          if (negative)
+            uncorrected_pvalue_count_neg[i] += other.uncorrected_pvalue_count_neg[i];
+        }
+      }
+
+
+
+      std::vector<size_t> State::pending (size_t first, size_t last) const
+      {
+        std::vector<size_t> indices;
+        for (size_t n = first; n < std::min (last, num_permutations()); ++n)
+          if (!completed[n])
+            indices.push_back (n);
+        return indices;
+      }
+
+
+
+
+
+      Checkpoint::Checkpoint (State& state, const std::string& path) :
+        state (state),
+        path (path)
+      {
+        //CONF option: PermTestCheckpointInterval
+        //CONF default: 300
+        //CONF The interval (in seconds) at which the state of permutation
+        //CONF testing is saved to file, when the -checkpoint option is used
+        //CONF (e.g. in fixelcfestats and mrclusterstats).
+        interval = File::Config::get_float ("PermTestCheckpointInterval", 300.0);
+      }
+
+
+
+    }
+  }
+}
+
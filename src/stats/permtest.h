@@ -19,11 +19,16 @@
 
 #include "progressbar.h"
 #include "thread.h"
+#include "timer.h"
+#include "types.h"
+#include "file/path.h"
 #include "math/stats/permutation.h"
 #include "thread_queue.h"
 
 namespace MR
 {
+  namespace App { class OptionGroup; }
+
   namespace Stats
   {
     namespace PermTest
@@ -33,21 +38,197 @@ namespace MR
 
 
 
+      //! options to checkpoint permutation testing, and to distribute it across processes
+      extern const App::OptionGroup Options;
+
+
+
+      //! the path of the checkpoint file supplied using the -checkpoint option (if any)
+      std::string checkpoint_path ();
+
+      //! the range [first, last) of permutations to be processed by this process
+      /*! This is the full range, unless the -shard option has been supplied. */
+      std::pair<size_t, size_t> permutation_range (size_t num_permutations);
+
+      //! generate random permutations for permutation testing
+      /*! As Math::Stats::generate_permutations(), except that a fixed seed
+       * is used if the -shard option has been supplied, so that the
+       * permutations are identical across all processes. */
+      void generate_permutations (size_t num_permutations, size_t num_subjects,
+                                  std::vector<std::vector<size_t> >& permutations, bool include_default);
+
+
+
+      //! the state of a permutation test
+      /*! This holds the set of permutations, which of these have been
+       * processed, and the results accumulated so far: the null
+       * distribution(s) of the maximum enhanced statistic, and the counts
+       * used to compute the uncorrected p-values. This is sufficient to
+       * checkpoint permutation testing & resume it at a later stage, or to
+       * merge the results of independent processes that each processed a
+       * disjoint subset of the permutations.
+       *
+       * The state is stored in a file consisting of a key-value header
+       * (with first line "mrtrix permutation test") followed by the data in
+       * little-endian binary format. */
+      class State {
+        public:
+          typedef Eigen::Matrix<value_type, Eigen::Dynamic, 1> vector_type;
+
+          State () : num_subjects (0), negative (false) { }
+          State (std::vector<std::vector<size_t> >&& permutations, size_t num_elements, bool negative);
+          State (const std::string& path) : State () { load (path); }
+
+          void load (const std::string& path);
+          //! save to \a path, replacing any existing file once complete
+          void save (const std::string& path) const;
+
+          //! throw an exception if the state does not match the specified test
+          void check (size_t num_permutations, size_t num_subjects, size_t num_elements, bool negative, bool nonstationary) const;
+          //! add the results of those permutations completed in \a other
+          /*! The two states must hold the same permutations, and must not
+           * have processed any of the same permutations. */
+          void merge (const State& other);
+
+          size_t num_permutations () const { return permutations.size(); }
+          size_t num_elements () const { return uncorrected_pvalue_count.size(); }
+          size_t num_completed () const { return std::count (completed.begin(), completed.end(), true); }
+          bool complete () const { return num_completed() == num_permutations(); }
+
+          //! the indices of those permutations in the range [first, last) not yet completed
+          std::vector<size_t> pending (size_t first, size_t last) const;
+
+          std::vector<std::vector<size_t> > permutations;
+          std::vector<uint8_t> completed;
+          vector_type perm_dist_pos, perm_dist_neg;
+          std::vector<size_t> uncorrected_pvalue_count, uncorrected_pvalue_count_neg;
+          std::vector<double> empirical_statistic;
+          size_t num_subjects;
+          bool negative;
+      };
+
+
+
+      //! accumulates the results of each permutation into a State
+      /*! Each thread accumulates its results in its own Results object,
+       * and merges these into the State using update(). This takes place
+       * once the thread has finished, and otherwise only when the
+       * interval set by the PermTestCheckpointInterval configuration file
+       * entry has elapsed since that thread last did so (and only if a path
+       * is supplied), so that threads rarely need to synchronise. The
+       * state is saved to file whenever that interval has elapsed since it
+       * was last saved; permutations not yet merged at that point are not
+       * marked as completed, and will be processed again when resuming. */
+      class Checkpoint {
+        public:
+          //! the results of the permutations processed by one thread since its last update()
+          class Results {
+            public:
+              Results () : num_elements (0) { }
+
+              void clear () {
+                indices.clear();
+                perm_dist_pos.clear();
+                perm_dist_neg.clear();
+                uncorrected_pvalue_count.assign (num_elements, 0);
+                uncorrected_pvalue_count_neg.assign (num_elements, 0);
+              }
+
+              size_t num_elements;
+              std::vector<size_t> indices;
+              std::vector<value_type> perm_dist_pos, perm_dist_neg;
+              std::vector<size_t> uncorrected_pvalue_count, uncorrected_pvalue_count_neg;
+              Timer timer;
+          };
+
+          Checkpoint (State& state, const std::string& path);
+
+          //! prepare \a results for accumulation, as done by the thread holding them
+          void init (Results& results) const {
+            results.num_elements = state.num_elements();
+            results.clear();
+            results.timer.start();
+          }
+
+          //! whether the thread holding \a results should update() the state now
+          bool due (Results& results) const {
+            return path.size() && results.timer.elapsed() > interval;
+          }
+
+          //! merge \a results into the state, then clear them
+          void update (Results& results) {
+            {
+              std::lock_guard<std::mutex> lock (mutex);
+              for (size_t n = 0; n < results.indices.size(); ++n) {
+                const size_t index = results.indices[n];
+                state.completed[index] = true;
+                state.perm_dist_pos(index) = results.perm_dist_pos[n];
+                if (state.negative)
+                  state.perm_dist_neg(index) = results.perm_dist_neg[n];
+              }
+              for (size_t i = 0; i < state.num_elements(); ++i) {
+                state.uncorrected_pvalue_count[i] += results.uncorrected_pvalue_count[i];
+                if (state.negative)
+                  state.uncorrected_pvalue_count_neg[i] += results.uncorrected_pvalue_count_neg[i];
+              }
+              if (path.size() && timer.elapsed() > interval) {
+                state.save (path);
+                timer.start();
+              }
+            }
+            results.clear();
+            results.timer.start();
+          }
+
+          void save () {
+            if (path.size())
+              state.save (path);
+          }
+
+        protected:
+          State& state;
+          const std::string path;
+          double interval;
+          Timer timer;
+          std::mutex mutex;
+      };
+
+
+
       class PermutationStack {
         public:
           PermutationStack (size_t num_permutations, size_t num_samples, std::string msg, bool include_default = true) :
             num_permutations (num_permutations),
+            indices (num_permutations),
             current_permutation (0),
             progress (msg, num_permutations) {
-              Math::Stats::generate_permutations (num_permutations, num_samples, permutations, include_default);
+              PermTest::generate_permutations (num_permutations, num_samples, permutations, include_default);
+              for (size_t i = 0; i < num_permutations; ++i)
+                indices[i] = i;
             }
 
-          size_t next () {
+          //! process only those \a permutations listed in \a indices
+          PermutationStack (const std::vector<std::vector<size_t> >& permutations, std::vector<size_t>&& indices, std::string msg) :
+            num_permutations (permutations.size()),
+            indices (std::move (indices)),
+            current_permutation (0),
+            progress (msg, this->indices.size()),
+            permutations (permutations) { }
+
+          //! claim a block of up to \a max_size permutations, returning false if none remain
+          /*! The size of the block is also limited to an equal share of the
+           * remaining permutations across threads, so that no thread is left
+           * idle towards the end of processing. */
+          bool next (std::vector<size_t>& block, size_t max_size) {
             std::lock_guard<std::mutex> lock (permutation_mutex);
-            size_t index = current_permutation++;
-            if (index < permutations.size())
+            const size_t remaining = indices.size() - current_permutation;
+            const size_t size = std::min (remaining, std::min (max_size,
+                  std::max (size_t(1), remaining / std::max (Thread::number_of_threads(), size_t(1)))));
+            block.assign (indices.begin() + current_permutation, indices.begin() + current_permutation + size);
+            current_permutation += size;
+            for (size_t n = 0; n < size; ++n)
               ++progress;
-            return index;
+            return size;
           }
           const std::vector<size_t>& permutation (size_t index) const {
             return permutations[index];
@@ -56,6 +237,7 @@ namespace MR
           const size_t num_permutations;
 
         protected:
+          std::vector<size_t> indices;
           size_t current_permutation;
           ProgressBar progress;
           std::vector <std::vector<size_t> > permutations;
@@ -89,17 +271,25 @@ namespace MR
 
             void execute ()
             {
-              size_t index;
-              while (( index = perm_stack.next() ) < perm_stack.num_permutations)
-                process_permutation (index);
+              std::vector<size_t> block;
+              std::vector<std::vector<size_t> > labellings;
+              while (perm_stack.next (block, stats_calculator.permutation_block_size())) {
+                labellings.clear();
+                for (auto index : block)
+                  labellings.push_back (perm_stack.permutation (index));
+                stats_calculator (labellings, block_stats, block_max_stat, block_min_stat);
+                for (size_t n = 0; n < block.size(); ++n) {
+                  std::swap (stats, block_stats[n]);
+                  process_permutation (block_max_stat[n]);
+                  std::swap (stats, block_stats[n]);
+                }
+              }
             }
 
           protected:
 
-            void process_permutation (size_t index)
+            void process_permutation (value_type max_stat)
             {
-              value_type max_stat = 0.0, min_stat = 0.0;
-              stats_calculator (perm_stack.permutation (index), stats, max_stat, min_stat);
               enhancer (max_stat, stats, enhanced_stats);
               for (size_t i = 0; i < enhanced_stats.size(); ++i) {
                 if (enhanced_stats[i] > 0.0) {
@@ -118,6 +308,8 @@ namespace MR
             std::vector<size_t> enhanced_count;
             std::vector<value_type> stats;
             std::vector<value_type> enhanced_stats;
+            std::vector<std::vector<value_type> > block_stats;
+            std::vector<value_type> block_max_stat, block_min_stat;
             std::shared_ptr<std::mutex> mutex;
         };
 
@@ -131,80 +323,81 @@ namespace MR
               Processor (PermutationStack& permutation_stack, const StatsType& stats_calculator,
                          const EnhancementType& enhancer, const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistics,
                          const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
-                         Eigen::Matrix<value_type, Eigen::Dynamic, 1>& perm_dist_pos, std::shared_ptr<Eigen::Matrix<value_type, Eigen::Dynamic, 1> >& perm_dist_neg,
-                         std::vector<size_t>& global_uncorrected_pvalue_counter, std::shared_ptr<std::vector<size_t> >& global_uncorrected_pvalue_counter_neg) :
+                         Checkpoint& checkpoint) :
                            perm_stack (permutation_stack), stats_calculator (stats_calculator),
                            enhancer (enhancer), empirical_enhanced_statistics (empirical_enhanced_statistics),
                            default_enhanced_statistics (default_enhanced_statistics), default_enhanced_statistics_neg (default_enhanced_statistics_neg),
                            statistics (stats_calculator.num_elements()), enhanced_statistics (stats_calculator.num_elements()),
-                           uncorrected_pvalue_counter (stats_calculator.num_elements(), 0),
-                           perm_dist_pos (perm_dist_pos), perm_dist_neg (perm_dist_neg),
-                           global_uncorrected_pvalue_counter (global_uncorrected_pvalue_counter),
-                           global_uncorrected_pvalue_counter_neg (global_uncorrected_pvalue_counter_neg) {
-                             if (global_uncorrected_pvalue_counter_neg)
-                               uncorrected_pvalue_counter_neg.reset (new std::vector<size_t>(stats_calculator.num_elements(), 0));
+                           checkpoint (checkpoint) {
+                             if (default_enhanced_statistics_neg)
+                               enhanced_statistics_neg.resize (stats_calculator.num_elements());
               }
 
 
-              ~Processor () {
-                for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
-                  global_uncorrected_pvalue_counter[i] += uncorrected_pvalue_counter[i];
-                  if (global_uncorrected_pvalue_counter_neg)
-                    (*global_uncorrected_pvalue_counter_neg)[i] = (*uncorrected_pvalue_counter_neg)[i];
-                }
-              }
-
               void execute ()
               {
-                size_t index;
-                while (( index = perm_stack.next() ) < perm_stack.num_permutations)
-                    process_permutation (index);
+                checkpoint.init (results);
+                std::vector<size_t> block;
+                std::vector<std::vector<size_t> > labellings;
+                while (perm_stack.next (block, stats_calculator.permutation_block_size())) {
+                  labellings.clear();
+                  for (auto index : block)
+                    labellings.push_back (perm_stack.permutation (index));
+                  stats_calculator (labellings, block_statistics, block_max_stat, block_min_stat);
+                  for (size_t n = 0; n < block.size(); ++n) {
+                    std::swap (statistics, block_statistics[n]);
+                    process_permutation (block[n], block_max_stat[n], block_min_stat[n]);
+                    std::swap (statistics, block_statistics[n]);
+                  }
+                  if (checkpoint.due (results))
+                    checkpoint.update (results);
+                }
+                checkpoint.update (results);
               }
 
 
             protected:
 
-              void process_permutation (size_t index)
+              void process_permutation (size_t index, value_type max_stat, value_type min_stat)
               {
-                value_type max_stat = 0.0, min_stat = 0.0;
-                stats_calculator (perm_stack.permutation (index), statistics, max_stat, min_stat);
-                perm_dist_pos(index) = enhancer (max_stat, statistics, enhanced_statistics);
+                const value_type max_enhanced = enhance (max_stat, enhanced_statistics);
 
-                if (empirical_enhanced_statistics) {
-                  perm_dist_pos(index) = 0.0;
-                  for (size_t i = 0; i < enhanced_statistics.size(); ++i) {
-                    enhanced_statistics[i] /= (*empirical_enhanced_statistics)[i];
-                    if (enhanced_statistics[i] > perm_dist_pos(index))
-                      perm_dist_pos(index) = enhanced_statistics[i];
-                  }
+                // Compute the opposite contrast
+                value_type max_enhanced_neg = 0.0;
+                if (default_enhanced_statistics_neg) {
+                  for (size_t i = 0; i < statistics.size(); ++i)
+                    statistics[i] = -statistics[i];
+                  max_enhanced_neg = enhance (-min_stat, enhanced_statistics_neg);
                 }
 
+                results.indices.push_back (index);
+                results.perm_dist_pos.push_back (max_enhanced);
                 for (size_t i = 0; i < enhanced_statistics.size(); ++i) {
                   if (default_enhanced_statistics[i] > enhanced_statistics[i])
-                    uncorrected_pvalue_counter[i]++;
+                    results.uncorrected_pvalue_count[i]++;
                 }
-
-                // Compute the opposite contrast
-                if (perm_dist_neg) {
-                  for (size_t i = 0; i < statistics.size(); ++i)
-                    statistics[i] = -statistics[i];
-
-                  (*perm_dist_neg)(index) = enhancer (-min_stat, statistics, enhanced_statistics);
-
-                  if (empirical_enhanced_statistics) {
-                    (*perm_dist_neg)(index) = 0.0;
-                    for (size_t i = 0; i < enhanced_statistics.size(); ++i) {
-                      enhanced_statistics[i] /= (*empirical_enhanced_statistics)[i];
-                      if (enhanced_statistics[i] > (*perm_dist_neg)(index))
-                        (*perm_dist_neg)(index) = enhanced_statistics[i];
-                    }
+                if (default_enhanced_statistics_neg) {
+                  results.perm_dist_neg.push_back (max_enhanced_neg);
+                  for (size_t i = 0; i < enhanced_statistics_neg.size(); ++i) {
+                    if ((*default_enhanced_statistics_neg)[i] > enhanced_statistics_neg[i])
+                      results.uncorrected_pvalue_count_neg[i]++;
                   }
+                }
+              }
 
-                  for (size_t i = 0; i < enhanced_statistics.size(); ++i) {
-                    if ((*default_enhanced_statistics_neg)[i] > enhanced_statistics[i])
-                      (*uncorrected_pvalue_counter_neg)[i]++;
+              // enhance the current statistics, and return the maximum enhanced value
+              value_type enhance (value_type max_stat, std::vector<value_type>& enhanced)
+              {
+                value_type max_enhanced = enhancer (max_stat, statistics, enhanced);
+                if (empirical_enhanced_statistics) {
+                  max_enhanced = 0.0;
+                  for (size_t i = 0; i < enhanced.size(); ++i) {
+                    enhanced[i] /= (*empirical_enhanced_statistics)[i];
+                    if (enhanced[i] > max_enhanced)
+                      max_enhanced = enhanced[i];
                   }
                 }
+                return max_enhanced;
               }
 
 
@@ -215,13 +408,11 @@ namespace MR
               const std::vector<value_type>& default_enhanced_statistics;
               const std::shared_ptr<std::vector<value_type> > default_enhanced_statistics_neg;
               std::vector<value_type> statistics;
-              std::vector<value_type> enhanced_statistics;
-              std::vector<size_t> uncorrected_pvalue_counter;
-              std::shared_ptr<std::vector<size_t> > uncorrected_pvalue_counter_neg;
-              Eigen::Matrix<value_type, Eigen::Dynamic, 1>& perm_dist_pos;
-              std::shared_ptr<Eigen::Matrix<value_type, Eigen::Dynamic, 1> > perm_dist_neg;
-              std::vector<size_t>& global_uncorrected_pvalue_counter;
-              std::shared_ptr<std::vector<size_t> > global_uncorrected_pvalue_counter_neg;
+              std::vector<value_type> enhanced_statistics, enhanced_statistics_neg;
+              std::vector<std::vector<value_type> > block_statistics;
+              std::vector<value_type> block_max_stat, block_min_stat;
+              Checkpoint& checkpoint;
+              Checkpoint::Results results;
         };
 
 
@@ -230,6 +421,17 @@ namespace MR
           inline void precompute_empirical_stat (const StatsType& stats_calculator, const EnhancementType& enhancer,
                                                  size_t num_permutations, std::vector<double>& empirical_statistic)
           {
+            // reuse the empirical statistic stored in the checkpoint, if available:
+            const std::string path = checkpoint_path();
+            if (path.size() && Path::exists (path)) {
+              State state (path);
+              if (state.empirical_statistic.size() == empirical_statistic.size()) {
+                INFO ("using empirical statistic from checkpoint file \"" + path + "\"");
+                empirical_statistic = state.empirical_statistic;
+                return;
+              }
+            }
+
             std::vector<size_t> global_enhanced_count (empirical_statistic.size(), 0);
             PermutationStack preprocessor_permutations (num_permutations,
                                                         stats_calculator.num_subjects(),
@@ -286,38 +488,69 @@ namespace MR
 
 
 
+        //! run the permutations, and compute the null distribution(s) & uncorrected p-values
+        /*! If the -checkpoint option has been supplied, the state of the
+         * permutation testing is saved to file at regular intervals, and
+         * resumed from that file if it already exists. If the -shard option
+         * has been supplied, only the corresponding subset of the
+         * permutations is processed. This function returns false if any
+         * permutations remain to be processed, in which case the outputs
+         * are not set. */
         template <class StatsType, class EnhancementType>
-          inline void run_permutations (const StatsType& stats_calculator, const EnhancementType& enhancer, size_t num_permutations,
+          inline bool run_permutations (const StatsType& stats_calculator, const EnhancementType& enhancer, size_t num_permutations,
                                         const std::shared_ptr<std::vector<double> >& empirical_enhanced_statistic,
                                         const std::vector<value_type>& default_enhanced_statistics, const std::shared_ptr<std::vector<value_type> >& default_enhanced_statistics_neg,
                                         Eigen::Matrix<value_type, Eigen::Dynamic, 1>& perm_dist_pos, std::shared_ptr<Eigen::Matrix<value_type, Eigen::Dynamic, 1> >& perm_dist_neg,
                                         std::vector<value_type>& uncorrected_pvalues, std::shared_ptr<std::vector<value_type> >& uncorrected_pvalues_neg)
           {
-
-            std::vector<size_t> global_uncorrected_pvalue_count (stats_calculator.num_elements(), 0);
-            std::shared_ptr<std::vector<size_t> > global_uncorrected_pvalue_count_neg;
-            if (perm_dist_neg)
-              global_uncorrected_pvalue_count_neg.reset (new std::vector<size_t>  (stats_calculator.num_elements(), 0));
+            const std::string path = checkpoint_path();
+            State state;
+            if (path.size() && Path::exists (path)) {
+              state.load (path);
+              state.check (num_permutations, stats_calculator.num_subjects(), stats_calculator.num_elements(),
+                           bool (perm_dist_neg), bool (empirical_enhanced_statistic));
+              CONSOLE ("resuming from checkpoint file \"" + path + "\" (" + str(state.num_completed()) + " of " + str(num_permutations) + " permutations completed)");
+            }
+            else {
+              std::vector<std::vector<size_t> > permutations;
+              generate_permutations (num_permutations, stats_calculator.num_subjects(), permutations, true);
+              state = State (std::move (permutations), stats_calculator.num_elements(), bool (perm_dist_neg));
+              if (empirical_enhanced_statistic)
+                state.empirical_statistic = *empirical_enhanced_statistic;
+            }
 
             {
-              PermutationStack permutations (num_permutations,
-                                             stats_calculator.num_subjects(),
-                                             "running " + str(num_permutations) + " permutations...");
+              const auto range = permutation_range (num_permutations);
+              auto pending = state.pending (range.first, range.second);
+              const std::string msg = "running " + str(pending.size()) + " permutations...";
+              PermutationStack permutations (state.permutations, std::move (pending), msg);
+              Checkpoint checkpoint (state, path);
 
               Processor<StatsType, EnhancementType> processor (permutations, stats_calculator, enhancer,
                                                                empirical_enhanced_statistic,
                                                                default_enhanced_statistics, default_enhanced_statistics_neg,
-                                                               perm_dist_pos, perm_dist_neg,
-                                                               global_uncorrected_pvalue_count, global_uncorrected_pvalue_count_neg);
-              auto threads = Thread::run (Thread::multi (processor), "permutation threads");
+                                                               checkpoint);
+              {
+                auto threads = Thread::run (Thread::multi (processor), "permutation threads");
+              }
+              checkpoint.save();
             }
 
+            if (!state.complete()) {
+              CONSOLE (str(state.num_completed()) + " of " + str(num_permutations) + " permutations completed; "
+                       "statistical inference outputs will be generated once all permutations are complete");
+              return false;
+            }
+
+            perm_dist_pos = state.perm_dist_pos;
+            if (perm_dist_neg)
+              *perm_dist_neg = state.perm_dist_neg;
             for (size_t i = 0; i < stats_calculator.num_elements(); ++i) {
-              uncorrected_pvalues[i] = static_cast<value_type> (global_uncorrected_pvalue_count[i]) / static_cast<value_type> (num_permutations);
+              uncorrected_pvalues[i] = static_cast<value_type> (state.uncorrected_pvalue_count[i]) / static_cast<value_type> (num_permutations);
               if (perm_dist_neg)
-                (*uncorrected_pvalues_neg)[i] = static_cast<value_type> ((*global_uncorrected_pvalue_count_neg)[i]) / static_cast<value_type> (num_permutations);
+                (*uncorrected_pvalues_neg)[i] = static_cast<value_type> (state.uncorrected_pvalue_count_neg[i]) / static_cast<value_type> (num_permutations);
             }
-
+            return true;
           }
           //! @}
 
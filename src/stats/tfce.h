@@ -15,6 +15,9 @@
 #ifndef __stats_tfce_h__
 #define __stats_tfce_h__
 
+#include <algorithm>
+#include <limits>
+
 #include "math/stats/permutation.h"
 #include "filter/connected_components.h"
 #include "thread_queue.h"
@@ -32,6 +35,20 @@ namespace MR
       /** \addtogroup Statistics
       @{ */
 
+      //! Threshold-free cluster enhancement
+      /*! Rather than identifying the connected components afresh at each
+       * threshold, the elements are added in order of decreasing statistic
+       * while sweeping the thresholds downwards, and clusters are merged
+       * incrementally using a disjoint-set (union-find) structure.
+       *
+       * The TFCE sum is accumulated lazily for each cluster: the
+       * contribution of a cluster over the range of thresholds for which its
+       * size remains unchanged is computed in one go (from a cumulative sum
+       * of h^H over the thresholds), and is only added to the cluster when
+       * its size changes. Each element stores its contribution relative to
+       * its parent in the disjoint-set forest, so that the enhanced
+       * statistic of each element is the sum of these values along its path
+       * to the root. */
       class Enhancer {
         public:
           Enhancer (const Filter::Connector& connector, const value_type dh, const value_type E, const value_type H) :
@@ -43,14 +60,34 @@ namespace MR
             enhanced_stats.resize(stats.size());
             std::fill (enhanced_stats.begin(), enhanced_stats.end(), 0.0);
 
-            for (value_type h = this->dh; h < max_stat; h += this->dh) {
-              std::vector<Filter::cluster> clusters;
-              std::vector<uint32_t> labels (enhanced_stats.size(), 0);
-              connector.run (clusters, labels, stats, h);
-              for (size_t i = 0; i < enhanced_stats.size(); ++i)
-                if (labels[i])
-                  enhanced_stats[i] += pow (clusters[labels[i]-1].size, this->E) * pow (h, this->H);
+            // thresholds, and cumulative sum of h^H:
+            std::vector<value_type> thresholds;
+            for (value_type h = this->dh; h < max_stat; h += this->dh)
+              thresholds.push_back (h);
+            if (thresholds.empty())
+              return 0.0;
+            std::vector<double> cumulative (thresholds.size()+1, 0.0);
+            for (size_t k = 0; k < thresholds.size(); ++k)
+              cumulative[k+1] = cumulative[k] + std::pow (thresholds[k], this->H);
+
+            // elements above the lowest threshold, in order of decreasing statistic:
+            std::vector<uint32_t> order;
+            for (uint32_t i = 0; i < stats.size(); ++i)
+              if (stats[i] > thresholds[0])
+                order.push_back (i);
+            std::sort (order.begin(), order.end(), [&] (uint32_t a, uint32_t b) { return stats[a] > stats[b]; });
+
+            Clusters clusters (stats.size(), cumulative, this->E);
+            auto next = order.begin();
+            for (ssize_t k = thresholds.size()-1; k >= 0; --k) {
+              for (; next != order.end() && stats[*next] > thresholds[k]; ++next) {
+                clusters.add (*next, k);
+                for (auto neighbour : connector.adjacent_indices[*next])
+                  if (clusters.active (neighbour))
+                    clusters.merge (*next, neighbour, k);
+              }
             }
+            clusters.get (order, enhanced_stats);
 
             return *std::max_element (enhanced_stats.begin(), enhanced_stats.end());
           }
@@ -58,6 +95,88 @@ namespace MR
         protected:
           const Filter::Connector& connector;
           const value_type dh, E, H;
+
+          class Clusters {
+            public:
+              Clusters (size_t size, const std::vector<double>& cumulative, const value_type E) :
+                parent (size, inactive),
+                count (size, 0),
+                level (size, 0),
+                delta (size, 0.0),
+                cumulative (cumulative),
+                E (E) { }
+
+              bool active (uint32_t i) const { return parent[i] != inactive; }
+
+              void add (uint32_t i, ssize_t k) {
+                parent[i] = i;
+                count[i] = 1;
+                level[i] = k;
+              }
+
+              void merge (uint32_t a, uint32_t b, ssize_t k) {
+                a = root (a);
+                b = root (b);
+                if (a == b)
+                  return;
+                flush (a, k);
+                flush (b, k);
+                if (count[a] < count[b])
+                  std::swap (a, b);
+                parent[b] = a;
+                count[a] += count[b];
+                delta[b] -= delta[a];
+              }
+
+              //! complete the integration & write the enhanced statistic for elements in \a indices
+              void get (const std::vector<uint32_t>& indices, std::vector<value_type>& enhanced) {
+                for (auto i : indices)
+                  if (parent[i] == i)
+                    flush (i, -1);
+                // sum values along the path to the root, reusing those already computed:
+                std::vector<uint32_t> path;
+                for (auto i : indices) {
+                  uint32_t j = i;
+                  while (parent[j] != j && parent[j] != done) {
+                    path.push_back (j);
+                    j = parent[j];
+                  }
+                  parent[j] = done;
+                  for (auto p = path.rbegin(); p != path.rend(); ++p) {
+                    delta[*p] += delta[j];
+                    parent[*p] = done;
+                    j = *p;
+                  }
+                  path.clear();
+                }
+                for (auto i : indices)
+                  enhanced[i] = delta[i];
+              }
+
+            private:
+              enum : uint32_t { inactive = std::numeric_limits<uint32_t>::max(), done = inactive - 1 };
+
+              std::vector<uint32_t> parent, count;
+              std::vector<ssize_t> level;
+              std::vector<double> delta;
+              const std::vector<double>& cumulative;
+              const value_type E;
+
+              uint32_t root (uint32_t i) const {
+                while (parent[i] != i)
+                  i = parent[i];
+                return i;
+              }
+
+              // add the contribution of cluster rooted at \a i for all
+              // thresholds above \a k not yet accounted for:
+              void flush (uint32_t i, ssize_t k) {
+                if (level[i] > k) {
+                  delta[i] += std::pow (double (count[i]), double (E)) * (cumulative[level[i]+1] - cumulative[k+1]);
+                  level[i] = k;
+                }
+              }
+          };
       };
 
       //! @}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "timer.h"
+#include "image.h"
+#include "algo/loop.h"
+#include "algo/threaded_loop.h"
+#include "dwi/denoise.h"
+
+using namespace MR;
+using namespace App;
+using namespace MR::DWI::Denoise;
+
+// allow for voxels where the Marchenko-Pastur threshold falls within
+// rounding error of an eigenvalue, so that the number of components
+// retained depends on the order of operations:
+#define MAX_DIFFERENT_FRACTION 0.01
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  DESCRIPTION
+  + "compare the performance and output of the sliding-window MP-PCA "
+    "denoising engine used in dwidenoise against a reference implementation "
+    "that loads the patch and computes its eigendecomposition afresh for "
+    "every voxel."
+
+  + "The command fails if the outputs differ by more than the specified "
+    "tolerance (relative to the maximum intensity in the reference output) "
+    "in more than 1% of voxels; a small number of voxels may legitimately "
+    "differ where the number of components retained is decided by rounding "
+    "errors. "
+    "If the -aggregate option is supplied, the patch-wise aggregated mode "
+    "is also timed (its output is not expected to match the reference).";
+
+  ARGUMENTS
+  + Argument ("dwi", "the input diffusion-weighted image.").type_image_in();
+
+  OPTIONS
+  + Option ("extent", "set the window size of the denoising filter (default = 5,5,5)")
+    + Argument ("window").type_sequence_int()
+
+  + Option ("aggregate", "also time the aggregated mode with the specified spacing")
+    + Argument ("spacing").type_sequence_int()
+
+  + Option ("tolerance", "the maximum relative difference allowed (default: 1e-4)")
+    + Argument ("value").type_float (0.0);
+}
+
+
+
+// MP-PCA denoising as originally implemented, one voxel at a time:
+template <class ImageType>
+class ReferenceFunctor
+{
+  public:
+  ReferenceFunctor (ImageType& dwi, std::vector<int> extent)
+    : extent {{extent[0]/2, extent[1]/2, extent[2]/2}},
+      m (dwi.size(3)),
+      n (extent[0]*extent[1]*extent[2]),
+      r ((m<n) ? m : n),
+      X (m,n),
+      pos {{0, 0, 0}} { }
+
+  void operator () (ImageType& dwi, ImageType& out)
+  {
+    load_data (dwi);
+
+    Eigen::MatrixXf XtX (r,r);
+    if (m <= n)
+      XtX.template triangularView<Eigen::Lower>() = X * X.transpose();
+    else
+      XtX.template triangularView<Eigen::Lower>() = X.transpose() * X;
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> eig (XtX);
+    Eigen::VectorXf s = eig.eigenvalues();
+
+    const double lam_r = s[0] / n;
+    double clam = 0.0;
+    ssize_t cutoff_p = 0;
+    for (ssize_t p = 0; p < r; ++p)
+    {
+      double lam = s[p] / n;
+      clam += lam;
+      double gam = double(m-r+p+1) / double(n);
+      double sigsq1 = clam / (p+1) / std::max (gam, 1.0);
+      double sigsq2 = (lam - lam_r) / 4 / std::sqrt(gam);
+      if (sigsq2 < sigsq1)
+        cutoff_p = p+1;
+    }
+
+    if (cutoff_p > 0) {
+      s.head (cutoff_p).setZero();
+      s.tail (r-cutoff_p).setOnes();
+      if (m <= n)
+        X.col (n/2) = eig.eigenvectors() * ( s.asDiagonal() * ( eig.eigenvectors().adjoint() * X.col(n/2) ));
+      else
+        X.col (n/2) = X * ( eig.eigenvectors() * ( s.asDiagonal() * eig.eigenvectors().adjoint().col(n/2) ));
+    }
+
+    assign_pos_of(dwi).to(out);
+    for (auto l = Loop (3) (out); l; ++l)
+      out.value() = X(ssize_t (out.index(3)), n/2);
+  }
+
+  void load_data (ImageType& dwi)
+  {
+    pos[0] = dwi.index(0); pos[1] = dwi.index(1); pos[2] = dwi.index(2);
+    X.setZero();
+    ssize_t k = 0;
+    for (dwi.index(2) = pos[2]-extent[2]; dwi.index(2) <= pos[2]+extent[2]; ++dwi.index(2))
+      for (dwi.index(1) = pos[1]-extent[1]; dwi.index(1) <= pos[1]+extent[1]; ++dwi.index(1))
+        for (dwi.index(0) = pos[0]-extent[0]; dwi.index(0) <= pos[0]+extent[0]; ++dwi.index(0), ++k)
+          if (! is_out_of_bounds(dwi))
+            X.col(k) = dwi.row(3).template cast<float>();
+    dwi.index(0) = pos[0];
+    dwi.index(1) = pos[1];
+    dwi.index(2) = pos[2];
+  }
+
+  private:
+  const std::array<ssize_t, 3> extent;
+  const ssize_t m, n, r;
+  Eigen::MatrixXf X;
+  std::array<ssize_t, 3> pos;
+};
+
+
+
+
+std::vector<int> parse_extent (const std::string& option, std::vector<int> default_value)
+{
+  auto opt = get_options (option);
+  if (!opt.size())
+    return default_value;
+  auto values = parse_ints (opt[0][0]);
+  if (values.size() == 1)
+    values = { values[0], values[0], values[0] };
+  if (values.size() != 3)
+    throw Exception ("-" + option + " must be either a scalar or a list of length 3");
+  return values;
+}
+
+
+
+void run ()
+{
+  auto dwi = Image<value_type>::open (argument[0]).with_direct_io(3);
+  const std::vector<int> extent = parse_extent ("extent", { 5, 5, 5 });
+  const value_type tolerance = get_option_value ("tolerance", 1e-4);
+  Image<bool> mask;
+  Image<value_type> noise;
+
+  auto reference_output = Image<value_type>::scratch (dwi);
+  Timer timer;
+  ReferenceFunctor<Image<value_type>> reference (dwi, extent);
+  ThreadedLoop ("running reference denoising", dwi, 0, 3).run (reference, dwi, reference_output);
+  std::cout << "reference: " << timer.elapsed() << " s\n";
+
+  auto output = Image<value_type>::scratch (dwi);
+  timer.start();
+  {
+    Data data (dwi, {{ extent[0]/2, extent[1]/2, extent[2]/2 }});
+    DenoisingFunctor<Image<value_type>> func (data, extent, mask, output, noise);
+    ThreadedLoop ("running sliding-window denoising", dwi, { 1, 2 }, { 0 }).run_outer (func);
+  }
+  std::cout << "sliding window: " << timer.elapsed() << " s\n";
+
+  value_type max_reference = 0.0;
+  for (auto l = Loop (reference_output) (reference_output); l; ++l)
+    max_reference = std::max (max_reference, std::abs (value_type (reference_output.value())));
+
+  value_type max_diff = 0.0;
+  size_t num_voxels = 0, num_different = 0;
+  for (auto l = Loop (output, 0, 3) (output, reference_output); l; ++l) {
+    value_type voxel_diff = 0.0;
+    for (auto l2 = Loop (3) (output, reference_output); l2; ++l2)
+      voxel_diff = std::max (voxel_diff, std::abs (output.value() - reference_output.value()));
+    max_diff = std::max (max_diff, voxel_diff);
+    ++num_voxels;
+    if (voxel_diff > tolerance * max_reference)
+      ++num_different;
+  }
+  std::cout << "maximum difference: " << max_diff << " (relative to maximum intensity: " << max_diff / max_reference << ")\n";
+  std::cout << "voxels differing beyond tolerance: " << num_different << " of " << num_voxels << "\n";
+
+  if (get_options ("aggregate").size()) {
+    const std::vector<int> spacing = parse_extent ("aggregate", { 1, 1, 1 });
+    timer.start();
+    Data data (dwi, {{ extent[0]/2, extent[1]/2, extent[2]/2 }});
+    Aggregator aggregator (data);
+    DenoisingFunctor<Image<value_type>> func (data, extent, mask, output, noise, &aggregator, spacing);
+    ThreadedLoop ("running aggregated denoising", dwi, { 1, 2 }, { 0 }).run_outer (func);
+    aggregator.write (output, noise, mask);
+    std::cout << "aggregated (spacing " << spacing[0] << "," << spacing[1] << "," << spacing[2] << "): " << timer.elapsed() << " s\n";
+  }
+
+  if (num_different > MAX_DIFFERENT_FRACTION * num_voxels)
+    throw Exception ("outputs of sliding-window and reference denoising differ beyond tolerance");
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "timer.h"
+#include "image.h"
+#include "algo/loop.h"
+#include "file/gz.h"
+#include "file/gz_parallel.h"
+#include "file/utils.h"
+
+#define BYTES_PER_ZCALL 524288
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  DESCRIPTION
+  + "compare the performance of the single-threaded and multi-threaded gzip "
+    "compression & decompression used for compressed image formats."
+
+  + "The voxel values of the input image are compressed and uncompressed "
+    "using both methods, and the timings and compressed file sizes reported.";
+
+  ARGUMENTS
+  + Argument ("image", "the image whose voxel data will be used for the benchmark.").type_image_in();
+
+  OPTIONS
+  + Option ("repeat", "the number of times to repeat each test (default: 3)")
+    + Argument ("number").type_integer (1);
+}
+
+
+
+void run ()
+{
+  auto image = Image<float>::open (argument[0]);
+  const size_t repeat = get_option_value ("repeat", 3);
+
+  std::vector<float> data (voxel_count (image));
+  size_t n = 0;
+  for (auto l = Loop (image) (image); l; ++l)
+    data[n++] = image.value();
+  const uint8_t* address = reinterpret_cast<const uint8_t*> (data.data());
+  const size_t size = data.size() * sizeof (float);
+
+  std::vector<float> check (data.size());
+  uint8_t* check_address = reinterpret_cast<uint8_t*> (check.data());
+
+  auto report = [&](const std::string& test, double elapsed, const std::string& filename) {
+    struct stat sbuf;
+    if (stat (filename.c_str(), &sbuf))
+      throw Exception ("cannot stat file \"" + filename + "\": " + strerror (errno));
+    std::cout << test << ": " << elapsed / repeat << " s (" << (size / (1024.0*1024.0)) * repeat / elapsed << " MB/s), "
+      << "compressed size " << sbuf.st_size << " bytes\n";
+  };
+
+  const std::string serial_file = File::create_tempfile (0, "gz");
+  const std::string parallel_file = File::create_tempfile (0, "gz");
+
+  try {
+    std::cout << "uncompressed size " << size << " bytes, using " << Thread::number_of_threads() << " threads\n";
+
+    Timer timer;
+    for (size_t r = 0; r < repeat; ++r) {
+      File::GZ zf (serial_file, "wb");
+      for (size_t offset = 0; offset < size; offset += BYTES_PER_ZCALL)
+        zf.write (reinterpret_cast<const char*> (address + offset), std::min<size_t> (BYTES_PER_ZCALL, size - offset));
+    }
+    report ("single-threaded compression", timer.elapsed(), serial_file);
+
+    timer.start();
+    for (size_t r = 0; r < repeat; ++r)
+      File::ParallelGZ::write (parallel_file, nullptr, 0, address, size);
+    report ("multi-threaded compression", timer.elapsed(), parallel_file);
+
+    timer.start();
+    for (size_t r = 0; r < repeat; ++r) {
+      File::GZ zf (parallel_file, "rb");
+      for (size_t offset = 0; offset < size; offset += BYTES_PER_ZCALL)
+        zf.read (reinterpret_cast<char*> (check_address + offset), std::min<size_t> (BYTES_PER_ZCALL, size - offset));
+    }
+    report ("single-threaded decompression", timer.elapsed(), parallel_file);
+    if (check != data)
+      throw Exception ("single-threaded decompression does not match original data");
+
+    std::fill (check.begin(), check.end(), 0.0f);
+    timer.start();
+    for (size_t r = 0; r < repeat; ++r)
+      if (!File::ParallelGZ::read (parallel_file, 0, check_address, size))
+        throw Exception ("block index not found in compressed file");
+    report ("multi-threaded decompression", timer.elapsed(), parallel_file);
+    if (check != data)
+      throw Exception ("multi-threaded decompression does not match original data");
+  }
+  catch (...) {
+    File::unlink (serial_file);
+    File::unlink (parallel_file);
+    throw;
+  }
+
+  File::unlink (serial_file);
+  File::unlink (parallel_file);
+}
+
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include <atomic>
+
+#include "command.h"
+#include "timer.h"
+#include "thread.h"
+#include "thread_queue.h"
+
+using namespace MR;
+using namespace App;
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  DESCRIPTION
+  + "compare the throughput of the mutex-based and lock-free backends of the "
+    "queue used to pass items between threads."
+
+  + "For each number of threads N (in powers of two, up to the number of "
+    "threads requested), N threads push integers onto a queue, while another "
+    "N threads pop them off. The number of items transferred per second is "
+    "reported for each backend.";
+
+  OPTIONS
+  + Option ("items", "the number of items to pass through the queue for each test (default: 1000000)")
+    + Argument ("number").type_integer (1)
+
+  + Option ("capacity", "the capacity of the queue (default: " + str(MRTRIX_QUEUE_DEFAULT_CAPACITY) + ")")
+    + Argument ("number").type_integer (1);
+}
+
+
+
+class Producer
+{
+  public:
+    Producer (Thread::Queue<size_t>& queue, std::atomic<size_t>& next, size_t total) :
+      writer (queue), next (next), total (total) { }
+
+    void execute () {
+      Thread::Queue<size_t>::Writer::Item item (writer);
+      size_t n;
+      while ((n = next++) < total) {
+        *item = n;
+        if (!item.write())
+          return;
+      }
+    }
+
+  private:
+    Thread::Queue<size_t>::Writer writer;
+    std::atomic<size_t>& next;
+    const size_t total;
+};
+
+
+
+class Consumer
+{
+  public:
+    Consumer (Thread::Queue<size_t>& queue, std::atomic<size_t>& sum) :
+      reader (queue), sum (sum) { }
+
+    void execute () {
+      Thread::Queue<size_t>::Reader::Item item (reader);
+      size_t local_sum = 0;
+      while (item.read())
+        local_sum += *item;
+      sum += local_sum;
+    }
+
+  private:
+    Thread::Queue<size_t>::Reader reader;
+    std::atomic<size_t>& sum;
+};
+
+
+
+double run_test (bool lockfree, size_t nthreads, size_t total, size_t capacity)
+{
+  Thread::Queue<size_t> queue ("benchmark", capacity, lockfree);
+  std::atomic<size_t> next (0), sum (0);
+  Producer producer (queue, next, total);
+  Consumer consumer (queue, sum);
+
+  Timer timer;
+  {
+    auto producers = Thread::run (Thread::multi (producer, nthreads), "producers");
+    auto consumers = Thread::run (Thread::multi (consumer, nthreads), "consumers");
+  }
+  const double elapsed = timer.elapsed();
+
+  if (sum != total * (total-1) / 2)
+    throw Exception (std::string ("items lost or corrupted using ") + (lockfree ? "lock-free" : "mutex-based") + " queue");
+  return elapsed;
+}
+
+
+
+void run ()
+{
+  const size_t total = get_option_value ("items", 1000000);
+  const size_t capacity = get_option_value ("capacity", MRTRIX_QUEUE_DEFAULT_CAPACITY);
+  const size_t max_threads = std::max (Thread::number_of_threads(), size_t(1));
+
+  std::cout << "threads     mutex (items/s)     lock-free (items/s)\n";
+  for (size_t nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    const double mutex_time = run_test (false, nthreads, total, capacity);
+    const double lockfree_time = run_test (true, nthreads, total, capacity);
+    std::cout << nthreads << "    " << total / mutex_time << "    " << total / lockfree_time << "\n";
+    if (nthreads < max_threads && 2*nthreads > max_threads)
+      nthreads = max_threads / 2;
+  }
+}
+
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2008-2016 the MRtrix3 contributors
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/
+ *
+ * MRtrix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * For more details, see www.mrtrix.org
+ *
+ */
+
+#include "command.h"
+#include "timer.h"
+#include "image.h"
+#include "algo/loop.h"
+#include "filter/connected_components.h"
+#include "stats/tfce.h"
+
+using namespace MR;
+using namespace App;
+
+typedef Stats::TFCE::value_type value_type;
+
+void usage ()
+{
+  AUTHOR = "agent (agent@local)";
+
+  DESCRIPTION
+  + "compare the performance and output of the union-find TFCE enhancer "
+    "against a reference implementation that identifies connected "
+    "components afresh at each threshold."
+
+  + "The voxel values of the input image (within the mask, if provided) are "
+    "used as the statistic to be enhanced. The command fails if the outputs "
+    "differ by more than the specified relative tolerance.";
+
+  ARGUMENTS
+  + Argument ("image", "the 3D image whose voxel values will be used as the statistic.").type_image_in();
+
+  OPTIONS
+  + Option ("mask", "only include voxels within this mask")
+    + Argument ("image").type_image_in()
+
+  + Option ("repeat", "the number of times to repeat each test (default: 3)")
+    + Argument ("number").type_integer (1)
+
+  + Option ("tolerance", "the maximum relative difference allowed (default: 1e-4)")
+    + Argument ("value").type_float (0.0)
+
+  + Option ("connectivity", "use 26-neighbourhood connectivity (Default: 6)");
+}
+
+
+
+// TFCE as originally implemented, using connected components at each threshold:
+class ReferenceEnhancer {
+  public:
+    ReferenceEnhancer (const Filter::Connector& connector, const value_type dh, const value_type E, const value_type H) :
+      connector (connector), dh (dh), E (E), H (H) {}
+
+    value_type operator() (const value_type max_stat, const std::vector<value_type>& stats,
+                           std::vector<value_type>& enhanced_stats) const
+    {
+      enhanced_stats.resize(stats.size());
+      std::fill (enhanced_stats.begin(), enhanced_stats.end(), 0.0);
+
+      for (value_type h = this->dh; h < max_stat; h += this->dh) {
+        std::vector<Filter::cluster> clusters;
+        std::vector<uint32_t> labels (enhanced_stats.size(), 0);
+        connector.run (clusters, labels, stats, h);
+        for (size_t i = 0; i < enhanced_stats.size(); ++i)
+          if (labels[i])
+            enhanced_stats[i] += pow (clusters[labels[i]-1].size, this->E) * pow (h, this->H);
+      }
+
+      return *std::max_element (enhanced_stats.begin(), enhanced_stats.end());
+    }
+
+  protected:
+    const Filter::Connector& connector;
+    const value_type dh, E, H;
+};
+
+
+
+void run ()
+{
+  auto image = Image<value_type>::open (argument[0]);
+  const size_t repeat = get_option_value ("repeat", 3);
+  const value_type tolerance = get_option_value ("tolerance", 1e-4);
+
+  auto mask = Image<value_type>::scratch (image);
+  auto opt = get_options ("mask");
+  if (opt.size()) {
+    auto mask_in = Image<bool>::open (opt[0][0]);
+    check_dimensions (mask_in, image, 0, 3);
+    for (auto l = Loop (mask) (mask, mask_in); l; ++l)
+      mask.value() = mask_in.value();
+  }
+  else {
+    for (auto l = Loop (mask) (mask); l; ++l)
+      mask.value() = 1.0;
+  }
+
+  Filter::Connector connector (get_options ("connectivity").size());
+  const auto& indices = connector.precompute_adjacency (mask);
+
+  std::vector<value_type> stats (indices.size());
+  value_type max_stat = 0.0;
+  for (size_t n = 0; n < indices.size(); ++n) {
+    for (size_t axis = 0; axis < 3; ++axis)
+      image.index (axis) = indices[n][axis];
+    stats[n] = image.value();
+    max_stat = std::max (max_stat, stats[n]);
+  }
+  std::cout << "number of voxels: " << stats.size() << ", maximum statistic: " << max_stat << "\n";
+
+  const value_type dh = 0.1, E = 0.5, H = 2.0;
+  std::vector<value_type> reference_output, output;
+
+  Timer timer;
+  ReferenceEnhancer reference (connector, dh, E, H);
+  for (size_t r = 0; r < repeat; ++r)
+    reference (max_stat, stats, reference_output);
+  std::cout << "reference enhancer: " << timer.elapsed() / repeat << " s\n";
+
+  timer.start();
+  Stats::TFCE::Enhancer enhancer (connector, dh, E, H);
+  for (size_t r = 0; r < repeat; ++r)
+    enhancer (max_stat, stats, output);
+  std::cout << "union-find enhancer: " << timer.elapsed() / repeat << " s\n";
+
+  const value_type max_reference = *std::max_element (reference_output.begin(), reference_output.end());
+  value_type max_diff = 0.0;
+  for (size_t n = 0; n < output.size(); ++n)
+    max_diff = std::max (max_diff, std::abs (output[n] - reference_output[n]));
+  std::cout << "maximum difference: " << max_diff << " (relative to maximum enhanced statistic: " << max_diff / max_reference << ")\n";
+
+  if (max_diff > tolerance * max_reference)
+    throw Exception ("outputs of union-find and reference enhancers differ beyond tolerance");
+}
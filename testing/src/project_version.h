@@ -0,0 +1 @@
+#define MRTRIX_PROJECT_VERSION "f84698dd"